@@ -2,6 +2,9 @@
 #define __BASE_H__
 
 #include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
 
 typedef int64_t _key_t;
 typedef int64_t _value_t;
@@ -48,15 +51,117 @@ class tree_api {
 public:
     virtual ~tree_api(){};
 
+    // false if key is not in the tree
     virtual bool find(_key_t key, _value_t & value) = 0;
 
+    // add the record, or replace the value if key is in the tree already
     virtual void insert(_key_t key, _value_t value) = 0;
 
+    // update and remove return false and change nothing if key is not in the tree
     virtual bool update(_key_t key, _value_t value) = 0;
 
     virtual bool remove(_key_t key) = 0;
 
+    // copy the values of up to num records whose key >= start_key into vals in key
+    // order, return how many were copied or -1 if the tree cannot scan
+    virtual int scan(_key_t, int, _value_t *) { return -1; }
+
     virtual void printAll() = 0;
 };
 
+/*
+    The static interface of the engines: an engine derives from
+    tree_base<Engine, K, V> and implements find, insert, update, remove,
+    printAll and, if it can, scan. Calls on the engine type are resolved at
+    compile time, so a driver templated on the engine gets find inlined into
+    its loop. tree_api above is for the drivers that pick a tree at run time,
+    api_adapter<Engine> implements it by forwarding to the engine.
+*/
+template <typename D, typename K, typename V>
+class tree_base {
+    public:
+        typedef K key_type;
+        typedef V value_type;
+
+        // an engine that cannot scan keeps this one
+        int scan(K, int, V *) { return -1; }
+
+        // look up num keys back to back, return how many were found
+        uint64_t find_batch(const K * keys, uint64_t num, V * vals) {
+            uint64_t found = 0;
+            for(uint64_t i = 0; i < num; i++) found += self().find(keys[i], vals[i]);
+            return found;
+        }
+
+    protected:
+        D & self() {
+            return static_cast<D &>(*this);
+        }
+};
+
+template <typename T>
+class api_adapter : tree_api {
+    private:
+        T tree;
+
+    public:
+        template <typename... Args>
+        api_adapter(Args &&... args) : tree(std::forward<Args>(args)...) {}
+
+        T & engine() {
+            return tree;
+        }
+
+        bool find(_key_t key, _value_t & value) final {
+            return tree.find(key, value);
+        }
+
+        void insert(_key_t key, _value_t value) final {
+            tree.insert(key, value);
+        }
+
+        bool update(_key_t key, _value_t value) final {
+            return tree.update(key, value);
+        }
+
+        bool remove(_key_t key) final {
+            return tree.remove(key);
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) final {
+            return tree.scan(start_key, num, vals);
+        }
+
+        void printAll() final {
+            tree.printAll();
+        }
+};
+
+// Compare is a stateless strict weak order like std::less
+template <typename Compare, typename K>
+static inline bool key_less(const K & a, const K & b) {
+    return Compare()(a, b);
+}
+
+template <typename Compare, typename K>
+static inline bool key_equal(const K & a, const K & b) {
+    return !Compare()(a, b) && !Compare()(b, a);
+}
+
+// a value shares the pointer slot of a record with the child pointers of inner nodes
+template <typename V>
+static inline char * to_slot(V v) {
+    static_assert(sizeof(V) <= sizeof(char *) && std::is_trivially_copyable<V>::value, "a value must fit in a pointer");
+    char * p = NULL;
+    memcpy(&p, &v, sizeof(V));
+    return p;
+}
+
+template <typename V>
+static inline V from_slot(char * p) {
+    V v;
+    memcpy(&v, &p, sizeof(V));
+    return v;
+}
+
 #endif //__BASE_H__
\ No newline at end of file
@@ -0,0 +1,389 @@
+/*  baseline.h - standard containers behind the engine interface, the reference lines of the benchmarks
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BASELINE__
+#define __BASELINE__
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#include "base.h"
+
+namespace baseline {
+
+class std_map : public tree_base<std_map, _key_t, _value_t> {
+    private:
+        std::map<_key_t, _value_t> m;
+
+    public:
+        bool find(_key_t key, _value_t & value) {
+            auto it = m.find(key);
+            if(it == m.end()) return false;
+            value = it->second;
+            return true;
+        }
+
+        void insert(_key_t key, _value_t value) {
+            m[key] = value;
+        }
+
+        bool update(_key_t key, _value_t value) {
+            auto it = m.find(key);
+            if(it == m.end()) return false;
+            it->second = value;
+            return true;
+        }
+
+        bool remove(_key_t key) {
+            return m.erase(key) > 0;
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            int n = 0;
+            for(auto it = m.lower_bound(start_key); it != m.end() && n < num; ++it) vals[n++] = it->second;
+            return n;
+        }
+
+        void printAll() {
+            for(auto & kv : m) printf("(%ld, %ld) ", kv.first, kv.second);
+            printf("\n");
+        }
+};
+
+// point operations only, scan is left unsupported
+class hash_map : public tree_base<hash_map, _key_t, _value_t> {
+    private:
+        std::unordered_map<_key_t, _value_t> m;
+
+    public:
+        bool find(_key_t key, _value_t & value) {
+            auto it = m.find(key);
+            if(it == m.end()) return false;
+            value = it->second;
+            return true;
+        }
+
+        void insert(_key_t key, _value_t value) {
+            m[key] = value;
+        }
+
+        bool update(_key_t key, _value_t value) {
+            auto it = m.find(key);
+            if(it == m.end()) return false;
+            it->second = value;
+            return true;
+        }
+
+        bool remove(_key_t key) {
+            return m.erase(key) > 0;
+        }
+
+        void printAll() {
+            for(auto & kv : m) printf("(%ld, %ld) ", kv.first, kv.second);
+            printf("\n");
+        }
+};
+
+/*
+    A sorted array searched with binary search. Inserting into the middle of
+    one array costs O(n) moves, which would make the load phase quadratic,
+    so new keys go to a small sorted delta array that is merged into the
+    main array once it holds sqrt(n) (at least 1024) records.
+*/
+class sorted_vector : public tree_base<sorted_vector, _key_t, _value_t> {
+    private:
+        struct Record {
+            _key_t key;
+            _value_t val;
+        };
+
+        std::vector<Record> recs, delta;
+
+        static Record * lookup(std::vector<Record> & v, _key_t key) {
+            auto it = std::lower_bound(v.begin(), v.end(), key, [](const Record & r, _key_t k) { return r.key < k; });
+            return it != v.end() && it->key == key ? &*it : NULL;
+        }
+
+        static size_t lower(const std::vector<Record> & v, _key_t key) {
+            return std::lower_bound(v.begin(), v.end(), key, [](const Record & r, _key_t k) { return r.key < k; }) - v.begin();
+        }
+
+        void merge() {
+            size_t n = recs.size();
+            recs.insert(recs.end(), delta.begin(), delta.end());
+            std::inplace_merge(recs.begin(), recs.begin() + n, recs.end(), [](const Record & a, const Record & b) {
+                return a.key < b.key;
+            });
+            delta.clear();
+        }
+
+    public:
+        bool find(_key_t key, _value_t & value) {
+            Record * r = lookup(recs, key);
+            if(r == NULL) r = lookup(delta, key);
+            if(r == NULL) return false;
+            value = r->val;
+            return true;
+        }
+
+        void insert(_key_t key, _value_t value) {
+            if(update(key, value)) return;
+            delta.insert(delta.begin() + lower(delta, key), {key, value});
+            if(delta.size() >= std::max<size_t>(1024, sqrt((double)recs.size()))) merge();
+        }
+
+        bool update(_key_t key, _value_t value) {
+            Record * r = lookup(recs, key);
+            if(r == NULL) r = lookup(delta, key);
+            if(r == NULL) return false;
+            r->val = value;
+            return true;
+        }
+
+        bool remove(_key_t key) {
+            for(std::vector<Record> * v : {&recs, &delta}) {
+                size_t i = lower(*v, key);
+                if(i < v->size() && (*v)[i].key == key) {
+                    v->erase(v->begin() + i);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            size_t i = lower(recs, start_key), j = lower(delta, start_key);
+            int n = 0;
+            while(n < num && (i < recs.size() || j < delta.size())) {
+                if(j == delta.size() || (i < recs.size() && recs[i].key < delta[j].key)) vals[n++] = recs[i++].val;
+                else vals[n++] = delta[j++].val;
+            }
+            return n;
+        }
+
+        void printAll() {
+            merge();
+            for(Record & r : recs) printf("(%ld, %ld) ", r.key, r.val);
+            printf("\n");
+        }
+};
+
+/*
+    A stand-in for abseil's btree_map: 256-byte nodes whose keys are kept in
+    their own array (values and children in another), searched with binary
+    search, and linked leaves for scans. Like std::map it owns its nodes
+    through new/delete. A remove only takes the record out of its leaf,
+    nodes are never merged.
+*/
+const int NODE_BYTES = 256;
+const int LEAF_SLOTS = (NODE_BYTES - 16) / 16;
+const int INNER_SLOTS = (NODE_BYTES - 16) / 16;
+
+struct node_t {
+    uint32_t count;
+    bool leaf;
+};
+
+struct leaf_t : node_t {
+    leaf_t * next;
+    _key_t keys[LEAF_SLOTS];
+    _value_t vals[LEAF_SLOTS];
+};
+
+struct inner_t : node_t {
+    _key_t keys[INNER_SLOTS];
+    node_t * child[INNER_SLOTS + 1];
+};
+
+class btree_map : public tree_base<btree_map, _key_t, _value_t> {
+    private:
+        node_t * root;
+
+        static leaf_t * new_leaf() {
+            leaf_t * l = new leaf_t;
+            l->count = 0;
+            l->leaf = true;
+            l->next = NULL;
+            return l;
+        }
+
+        static inner_t * new_inner() {
+            inner_t * n = new inner_t;
+            n->count = 0;
+            n->leaf = false;
+            return n;
+        }
+
+        static void free_node(node_t * n) {
+            if(n->leaf) {
+                delete (leaf_t *)n;
+                return;
+            }
+            inner_t * in = (inner_t *)n;
+            for(uint32_t i = 0; i <= in->count; i++) free_node(in->child[i]);
+            delete in;
+        }
+
+        // the leaf that holds key if it is in the tree
+        leaf_t * find_leaf(_key_t key) const {
+            node_t * n = root;
+            while(!n->leaf) {
+                inner_t * in = (inner_t *)n;
+                n = in->child[std::upper_bound(in->keys, in->keys + in->count, key) - in->keys];
+            }
+            return (leaf_t *)n;
+        }
+
+        // the slot of key in l, or -1
+        static int slot_of(leaf_t * l, _key_t key) {
+            int i = std::lower_bound(l->keys, l->keys + l->count, key) - l->keys;
+            return i < (int)l->count && l->keys[i] == key ? i : -1;
+        }
+
+        // insert into the subtree of n, a split returns the separator and the new right node
+        bool insert_recursive(node_t * n, _key_t key, _value_t value, _key_t & split_k, node_t * & split_node) {
+            if(n->leaf) {
+                leaf_t * l = (leaf_t *)n;
+                int i = std::lower_bound(l->keys, l->keys + l->count, key) - l->keys;
+                if(i < (int)l->count && l->keys[i] == key) {
+                    l->vals[i] = value;
+                    return false;
+                }
+                bool split = l->count == LEAF_SLOTS;
+                if(split) { // the upper half moves to a new right leaf
+                    leaf_t * r = new_leaf();
+                    int m = LEAF_SLOTS / 2;
+                    r->count = LEAF_SLOTS - m;
+                    memcpy(r->keys, l->keys + m, sizeof(_key_t) * r->count);
+                    memcpy(r->vals, l->vals + m, sizeof(_value_t) * r->count);
+                    l->count = m;
+                    r->next = l->next;
+                    l->next = r;
+                    split_node = r;
+                    if(i > m) {
+                        l = r;
+                        i -= m;
+                    }
+                }
+                memmove(l->keys + i + 1, l->keys + i, sizeof(_key_t) * (l->count - i));
+                memmove(l->vals + i + 1, l->vals + i, sizeof(_value_t) * (l->count - i));
+                l->keys[i] = key;
+                l->vals[i] = value;
+                l->count += 1;
+                if(split) split_k = ((leaf_t *)split_node)->keys[0];
+                return split;
+            }
+
+            inner_t * in = (inner_t *)n;
+            int i = std::upper_bound(in->keys, in->keys + in->count, key) - in->keys;
+            _key_t child_k;
+            node_t * child_node = NULL;
+            if(!insert_recursive(in->child[i], key, value, child_k, child_node)) return false;
+
+            // put child_k and child_node at i, splitting a full node around its middle key
+            _key_t keys[INNER_SLOTS + 1];
+            node_t * child[INNER_SLOTS + 2];
+            memcpy(keys, in->keys, sizeof(_key_t) * i);
+            memcpy(child, in->child, sizeof(node_t *) * (i + 1));
+            keys[i] = child_k;
+            child[i + 1] = child_node;
+            memcpy(keys + i + 1, in->keys + i, sizeof(_key_t) * (in->count - i));
+            memcpy(child + i + 2, in->child + i + 1, sizeof(node_t *) * (in->count - i));
+            int total = in->count + 1;
+
+            if(total <= INNER_SLOTS) {
+                memcpy(in->keys, keys, sizeof(_key_t) * total);
+                memcpy(in->child, child, sizeof(node_t *) * (total + 1));
+                in->count = total;
+                return false;
+            }
+            int m = total / 2;
+            inner_t * r = new_inner();
+            in->count = m;
+            memcpy(in->keys, keys, sizeof(_key_t) * m);
+            memcpy(in->child, child, sizeof(node_t *) * (m + 1));
+            r->count = total - m - 1;
+            memcpy(r->keys, keys + m + 1, sizeof(_key_t) * r->count);
+            memcpy(r->child, child + m + 1, sizeof(node_t *) * (r->count + 1));
+            split_k = keys[m];
+            split_node = r;
+            return true;
+        }
+
+    public:
+        btree_map() : root(new_leaf()) {}
+
+        ~btree_map() {
+            free_node(root);
+        }
+
+        bool find(_key_t key, _value_t & value) {
+            leaf_t * l = find_leaf(key);
+            int i = slot_of(l, key);
+            if(i < 0) return false;
+            value = l->vals[i];
+            return true;
+        }
+
+        void insert(_key_t key, _value_t value) {
+            _key_t split_k;
+            node_t * split_node = NULL;
+            if(insert_recursive(root, key, value, split_k, split_node)) {
+                inner_t * r = new_inner();
+                r->count = 1;
+                r->keys[0] = split_k;
+                r->child[0] = root;
+                r->child[1] = split_node;
+                root = r;
+            }
+        }
+
+        bool update(_key_t key, _value_t value) {
+            leaf_t * l = find_leaf(key);
+            int i = slot_of(l, key);
+            if(i < 0) return false;
+            l->vals[i] = value;
+            return true;
+        }
+
+        bool remove(_key_t key) {
+            leaf_t * l = find_leaf(key);
+            int i = slot_of(l, key);
+            if(i < 0) return false;
+            memmove(l->keys + i, l->keys + i + 1, sizeof(_key_t) * (l->count - i - 1));
+            memmove(l->vals + i, l->vals + i + 1, sizeof(_value_t) * (l->count - i - 1));
+            l->count -= 1;
+            return true;
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            leaf_t * l = find_leaf(start_key);
+            int i = std::lower_bound(l->keys, l->keys + l->count, start_key) - l->keys;
+            int n = 0;
+            while(l != NULL && n < num) {
+                for(; i < (int)l->count && n < num; i++) vals[n++] = l->vals[i];
+                l = l->next;
+                i = 0;
+            }
+            return n;
+        }
+
+        void printAll() {
+            leaf_t * l = find_leaf(INT64_MIN);
+            for(; l != NULL; l = l->next) {
+                for(uint32_t i = 0; i < l->count; i++) printf("(%ld, %ld) ", l->keys[i], l->vals[i]);
+            }
+            printf("\n");
+        }
+};
+
+static_assert(sizeof(leaf_t) == NODE_BYTES && sizeof(inner_t) == NODE_BYTES, "the nodes fill 256 bytes");
+
+}; // namespace baseline
+
+#endif //__BASELINE__
@@ -0,0 +1,583 @@
+/*  bench.h - the workloads and trees shared by the benchmark drivers
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BENCH__
+#define __BENCH__
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <shared_mutex>
+#include <malloc.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "btree.h"
+#include "btree_packed.h"
+#include "btree_compact.h"
+#include "btree_csb.h"
+#include "sets.h"
+#include "value_log.h"
+#include "btree_unsort.h"
+#include "slotonly.h"
+#include "mmap_btree.h"
+#include "slotonly_pm.h"
+#include "wal.h"
+#include "btree_disk.h"
+#include "baseline.h"
+#include "latency.h"
+#include "trace.h"
+
+using std::string;
+
+enum op_type : uint8_t {OP_READ, OP_UPDATE, OP_INSERT, OP_SCAN, OP_RMW, OP_REMOVE, OP_TYPES}; // removes come only from traces
+
+static const char * OP_NAMES[] = {"read", "update", "insert", "scan", "rmw", "remove"};
+
+struct op_t {
+    op_type type;
+    int len; // records of a scan
+    _key_t key;
+};
+
+struct workload_t {
+    char name;
+    int read, update, insert, scan, rmw; // percentages
+    const char * dist;
+};
+
+static const workload_t WORKLOADS[] = {
+    {'a', 50, 50, 0, 0, 0, "zipfian"},
+    {'b', 95, 5, 0, 0, 0, "zipfian"},
+    {'c', 100, 0, 0, 0, 0, "zipfian"},
+    {'d', 95, 0, 5, 0, 0, "latest"},
+    {'e', 0, 0, 5, 95, 0, "zipfian"},
+    {'f', 50, 0, 0, 0, 50, "zipfian"},
+};
+
+struct engine_t {
+    int id;
+    const char * name;
+};
+
+static const engine_t ENGINES[] = {
+    {1, "btree"},
+    {2, "btree_unsort"},
+    {3, "slotonly"},
+    {4, "mmap_btree"},
+    {5, "slotonly_pm"},
+    {6, "wal_btree"},
+    {7, "wal_btree_unsort"},
+    {8, "btree_disk"},
+    {9, "std_map"},
+    {10, "unordered_map"},
+    {11, "sorted_vector"},
+    {12, "btree_map"},
+    {13, "btree_packed"},
+    {14, "btree_compact"},
+    {15, "btree_csb"},
+    {16, "set_btree"},
+    {17, "set_btree_unsort"},
+    {18, "set_slotonly"},
+    {19, "btree_vlog"},
+};
+
+const int ENGINE_NUM = sizeof(ENGINES) / sizeof(engine_t);
+
+// the i-th inserted record of the ycsb key set, the insertion order is random in key space
+static inline _key_t key_of(uint64_t i) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a, as the YCSB key hash
+    for(int b = 0; b < 8; b++) {
+        h ^= (i >> (b * 8)) & 0xff;
+        h *= 0x100000001b3ULL;
+    }
+    return (_key_t)(h >> 1);
+}
+
+/*
+    The keys of a run, the i-th inserted record gets key(i). ycsb hashes i
+    as above; the other sets are materialized, deduplicated and shuffled so
+    they are inserted in random order:
+
+        dense      0 .. n-1
+        clustered  runs of about 1000 keys with gaps of 1-8, spread over the key space
+        skewed     u^4 * 2^62 for a uniform u, dense near 0 and sparse above
+        lognormal  exp(N(0, 2)) * 1e9, as the lognormal set of SOSD
+        <file>     a SOSD dataset (books, fb, osm, wiki): a uint64 count and as many sorted uint64 keys
+
+    A SOSD dataset is mapped and all its distinct keys are used, halved if
+    some do not fit in a signed key.
+*/
+class keyset {
+    private:
+        string label;
+        bool hashed;
+        std::vector<_key_t> keys;
+
+        template <typename F>
+        void generate(uint64_t n, std::mt19937_64 & e, F gen) {
+            while(keys.size() < n) {
+                while(keys.size() < n + n / 8) keys.push_back(gen(e));
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            }
+            std::shuffle(keys.begin(), keys.end(), e);
+            keys.resize(n);
+        }
+
+        void load_sosd(const string & path, std::mt19937_64 & e) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0) {
+                perror(path.c_str());
+                exit(-1);
+            }
+            struct stat st;
+            fstat(fd, &st);
+            uint64_t * data = (uint64_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if(data == MAP_FAILED || st.st_size < 8 || (uint64_t)st.st_size != 8 * (data[0] + 1)) {
+                printf("%s is not a SOSD uint64 dataset\n", path.c_str());
+                exit(-1);
+            }
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+            uint64_t n = data[0];
+            int shift = n > 0 && data[n] > (uint64_t)INT64_MAX ? 1 : 0; // the keys are sorted
+            keys.reserve(n);
+            for(uint64_t i = 1; i <= n; i++) {
+                _key_t k = data[i] >> shift;
+                if(keys.empty() || keys.back() != k) keys.push_back(k);
+            }
+            munmap(data, st.st_size);
+            if(shift) printf("%s: the keys do not fit in 63 bits, they are halved\n", label.c_str());
+            std::shuffle(keys.begin(), keys.end(), e);
+        }
+
+    public:
+        // n is the number of keys a generated set gets, the datasets have their own size
+        keyset(const string & spec, uint64_t n, uint64_t seed) : label(spec), hashed(false) {
+            std::mt19937_64 e(seed);
+            if(spec == "ycsb") {
+                hashed = true;
+            } else if(spec == "dense") {
+                for(uint64_t i = 0; i < n; i++) keys.push_back(i);
+                std::shuffle(keys.begin(), keys.end(), e);
+            } else if(spec == "clustered") {
+                _key_t next = 0;
+                uint64_t left = 0;
+                generate(n, e, [&](std::mt19937_64 & e) {
+                    if(left == 0) { // a new run
+                        next = e() >> 2;
+                        left = 500 + e() % 1000;
+                    }
+                    left -= 1;
+                    return next += 1 + e() % 8;
+                });
+            } else if(spec == "skewed") {
+                generate(n, e, [](std::mt19937_64 & e) {
+                    double u = std::uniform_real_distribution<double>(0, 1)(e);
+                    return (_key_t)(u * u * u * u * (double)(1ULL << 62));
+                });
+            } else if(spec == "lognormal") {
+                std::lognormal_distribution<double> d(0, 2);
+                generate(n, e, [&](std::mt19937_64 & e) {
+                    double k = d(e) * 1e9;
+                    return k < (double)INT64_MAX ? (_key_t)k : INT64_MAX;
+                });
+            } else {
+                size_t slash = spec.rfind('/');
+                label = slash == string::npos ? spec : spec.substr(slash + 1);
+                load_sosd(spec, e);
+            }
+        }
+
+        const string & name() const {
+            return label;
+        }
+
+        uint64_t size() const {
+            return hashed ? UINT64_MAX : keys.size();
+        }
+
+        _key_t key(uint64_t i) const {
+            return hashed ? key_of(i) : keys[i];
+        }
+};
+
+// the generator of Gray et al. "Quickly generating billion-record synthetic databases",
+// as YCSB's ZipfianGenerator: item 0 is the most popular, the item count may only grow
+class zipfian {
+    private:
+        double theta, alpha, zeta2, zetan, eta;
+        uint64_t n;
+
+        void grow(uint64_t items) {
+            for(uint64_t i = n + 1; i <= items; i++) zetan += 1.0 / pow((double)i, theta);
+            n = items;
+            eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+        }
+
+    public:
+        zipfian(double th) : theta(th), alpha(1.0 / (1.0 - th)), zetan(0), n(0) {
+            zeta2 = 1 + 1.0 / pow(2.0, theta);
+        }
+
+        uint64_t next(std::mt19937_64 & e, uint64_t items) {
+            if(items > n) grow(items);
+
+            double u = std::uniform_real_distribution<double>(0, 1)(e);
+            double uz = u * zetan;
+            if(uz < 1.0) return 0;
+            if(uz < 1.0 + pow(0.5, theta)) return 1;
+            uint64_t r = (uint64_t)(n * pow(eta * u - eta + 1, alpha));
+            return r < n ? r : n - 1;
+        }
+};
+
+static std::vector<op_t> gen_ops(const workload_t & w, const string & dist, uint64_t num, uint64_t & inserted,
+                                 int max_scan, const keyset & ks, zipfian & zipf, std::mt19937_64 & e) {
+    std::vector<op_t> ops(num);
+    std::uniform_int_distribution<int> pct(0, 99);
+    std::uniform_int_distribution<int> scan_len(1, max_scan);
+
+    for(uint64_t i = 0; i < num; i++) {
+        int r = pct(e);
+        op_t & op = ops[i];
+        op.len = 0;
+        if(r < w.insert) {
+            if(inserted >= ks.size()) {
+                printf("the key set %s has only %lu keys\n", ks.name().c_str(), ks.size());
+                exit(-1);
+            }
+            op.type = OP_INSERT;
+            op.key = ks.key(inserted++);
+            continue;
+        }
+        r -= w.insert;
+        if(r < w.read) op.type = OP_READ;
+        else if(r < w.read + w.update) op.type = OP_UPDATE;
+        else if(r < w.read + w.update + w.scan) op.type = OP_SCAN;
+        else op.type = OP_RMW;
+        if(op.type == OP_SCAN) op.len = scan_len(e);
+
+        uint64_t idx;
+        if(dist == "uniform") {
+            idx = std::uniform_int_distribution<uint64_t>(0, inserted - 1)(e);
+        } else if(dist == "latest") { // the latest inserted records are the most popular
+            idx = inserted - 1 - zipf.next(e, inserted);
+        } else {
+            idx = zipf.next(e, inserted);
+        }
+        op.key = ks.key(idx);
+    }
+    return ops;
+}
+
+// the results of the reads end here, or an inlined find whose result is unused may be dropped.
+// One per thread: the workers of test2 would race on a shared one and bounce its cache line
+static thread_local volatile uint64_t sink;
+
+// hist is indexed by the op type, the timer is compiled out when TIMED is false. T is
+// tree_api for a virtual call per operation, or an engine to have them resolved statically.
+// Returns the updates that found no key, their time is not the one of an update
+template <bool TIMED, typename T>
+static uint64_t run_ops(T * tree, const op_t * ops, uint64_t num, latency::histogram * hist) {
+    _value_t val = 0;
+    uint64_t found = 0, missed = 0;
+    std::vector<_value_t> buf(1024);
+    for(uint64_t i = 0; i < num; i++) {
+        const op_t & op = ops[i];
+        uint64_t t0 = TIMED ? latency::now() : 0;
+        switch(op.type) {
+            case OP_READ:
+                found += tree->find(op.key, val);
+                break;
+            case OP_UPDATE:
+                missed += !tree->update(op.key, (_value_t)i);
+                break;
+            case OP_INSERT:
+                tree->insert(op.key, (_value_t)op.key);
+                break;
+            case OP_SCAN:
+                if((size_t)op.len > buf.size()) buf.resize(op.len);
+                tree->scan(op.key, op.len, buf.data());
+                break;
+            case OP_RMW:
+                tree->find(op.key, val);
+                missed += !tree->update(op.key, val + 1);
+                break;
+            case OP_REMOVE:
+                tree->remove(op.key);
+                break;
+            default:
+                break;
+        }
+        if(TIMED) hist[op.type].record(latency::now() - t0);
+    }
+    sink = found + val;
+    return missed;
+}
+
+// the op type the records of a trace are counted under, indexed by trace::op_code
+static const op_type TRACE_TYPES[] = {OP_READ, OP_INSERT, OP_UPDATE, OP_REMOVE, OP_SCAN};
+
+/*
+    Closed loop issues a record as soon as the previous one returned. Open
+    loop issues record i when the deltas up to i, divided by speed, have
+    passed since the start, whether or not the tree kept up; its latency is
+    counted from that intended time, so a stall also shows in the latency of
+    the records that queued up behind it.
+*/
+template <bool TIMED>
+static void replay(tree_api * tree, const trace::record_t * recs, uint64_t num, bool open_loop, double speed,
+                   latency::histogram * hist) {
+    _value_t val = 0;
+    std::vector<_value_t> buf(1024);
+    double ticks_per_ns = open_loop ? 1.0 / latency::ns_per_tick() / speed : 0;
+    uint64_t start = latency::now();
+    double due = 0;
+    for(uint64_t i = 0; i < num; i++) {
+        const trace::record_t & r = recs[i];
+        uint64_t t0;
+        if(open_loop) {
+            due += r.delta * ticks_per_ns;
+            t0 = start + (uint64_t)due;
+            while(latency::now() < t0) {}
+        } else {
+            t0 = TIMED ? latency::now() : 0;
+        }
+        switch(r.op) {
+            case trace::FIND:
+                tree->find(r.key, val);
+                break;
+            case trace::INSERT:
+                tree->insert(r.key, r.value);
+                break;
+            case trace::UPDATE:
+                tree->update(r.key, r.value);
+                break;
+            case trace::REMOVE:
+                tree->remove(r.key);
+                break;
+            case trace::SCAN:
+                if(r.value > (_value_t)buf.size()) buf.resize(r.value);
+                tree->scan(r.key, r.value > 0 ? r.value : 0, buf.data());
+                break;
+            default:
+                continue; // an op code of a newer version
+        }
+        if(TIMED) hist[TRACE_TYPES[r.op]].record(latency::now() - t0);
+    }
+}
+
+// runs a batch of operations on a tree made by make_tree, see static_path
+typedef uint64_t (*batch_fn)(tree_api * tree, const op_t * ops, uint64_t num, latency::histogram * hist);
+
+template <typename T>
+static uint64_t run_static(tree_api * tree, const op_t * ops, uint64_t num, latency::histogram * hist) {
+    T * t = &((api_adapter<T> *)tree)->engine();
+    if(hist != NULL) return run_ops<true>(t, ops, num, hist);
+    return run_ops<false>(t, ops, num, NULL);
+}
+
+// an engine of type T behind tree_api, *run gets the batch runner that calls T directly
+template <typename T, typename... Args>
+static tree_api * make_engine(batch_fn * run, Args &&... args) {
+    if(run != NULL) *run = run_static<T>;
+    return (tree_api *) new api_adapter<T>(std::forward<Args>(args)...);
+}
+
+// the in-memory engine id (1-3) with B-byte nodes, NULL if its nodes cannot be that large
+template <int B>
+static tree_api * make_sized(int id, batch_fn * run) {
+    if(id == 1) return make_engine<btree::btree_t<_key_t, _value_t, B>>(run);
+    if constexpr(B <= 32 + 64 * 16) { // the bitmap covers 64 records
+        if(id == 2) return make_engine<btree_unsort::btree_t<_key_t, _value_t, B>>(run);
+    }
+    if constexpr(B <= 32 + slotonly::MAX_CARDINALITY * 16) {
+        if(id == 3) return make_engine<slotonly::wbtree_t<_key_t, _value_t, B>>(run);
+    }
+    return NULL;
+}
+
+// the node sizes a sweep can pick, every one is compiled in
+static tree_api * make_sized_tree(int id, int bytes, batch_fn * run = NULL) {
+    switch(bytes) {
+        case 128: return make_sized<128>(id, run);
+        case 256: return make_sized<256>(id, run);
+        case 512: return make_sized<512>(id, run);
+        case 1024: return make_sized<1024>(id, run);
+        case 2048: return make_sized<2048>(id, run);
+        case 4096: return make_sized<4096>(id, run);
+        default: return NULL;
+    }
+}
+
+/*
+    The static path: unless run is NULL, make_tree sets *run to a function
+    that executes a batch of operations on the engine behind the returned
+    tree_api with direct calls, or to NULL if the tree is a run-time wrapper
+    (the write-ahead log trees). The batch runner must only be given the tree
+    it came with, not a wrapper of it.
+*/
+static tree_api * make_tree(int id, const string & file, int pool, bool sync, batch_fn * run = NULL) {
+    if(run != NULL) *run = NULL;
+    switch(id) {
+        case 1: return make_engine<btree::btree>(run);
+        case 2: return make_engine<btree_unsort::btree>(run);
+        case 3: return make_engine<slotonly::wbtree>(run);
+        case 4: return make_engine<mmap_btree::btree>(run, file.c_str());
+        case 5: return make_engine<slotonly_pm::wbtree>(run, file.c_str());
+        case 6: return (tree_api *) new wal::durable<btree::btree>(file, sync);
+        case 7: return (tree_api *) new wal::durable<btree_unsort::btree>(file, sync);
+        case 8: return make_engine<btree_disk::btree>(run, file.c_str(), pool);
+        case 9: return make_engine<baseline::std_map>(run);
+        case 10: return make_engine<baseline::hash_map>(run);
+        case 11: return make_engine<baseline::sorted_vector>(run);
+        case 12: return make_engine<baseline::btree_map>(run);
+        case 13: return make_engine<btree::packed>(run);
+        case 14: return make_engine<btree::compact>(run);
+        case 15: return make_engine<btree::csb>(run);
+        case 16: return make_engine<sets::as_map<sets::btree_set<>>>(run);
+        case 17: return make_engine<sets::as_map<sets::unsort_set<>>>(run);
+        case 18: return make_engine<sets::as_map<sets::slotonly_set<>>>(run);
+        case 19: return make_engine<vlog::as_map<>>(run);
+        default: printf("Invalid tree type %d\n", id); exit(-1);
+    }
+}
+
+// remove the files of a tree, dir is the private directory of this run
+static void clean_dir(const string & dir) {
+    DIR * d = opendir(dir.c_str());
+    if(d == NULL) return;
+    struct dirent * ent;
+    while((ent = readdir(d)) != NULL) {
+        if(strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+            unlink((dir + "/" + ent->d_name).c_str());
+    }
+    closedir(d);
+}
+
+// bytes the process holds on the heap, the node arenas included
+static uint64_t heap_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd + btree::arena_bytes().load();
+}
+
+// bytes allocated to the files of dir
+static uint64_t dir_bytes(const string & dir) {
+    uint64_t total = 0;
+    DIR * d = opendir(dir.c_str());
+    if(d == NULL) return 0;
+    struct dirent * ent;
+    while((ent = readdir(d)) != NULL) {
+        struct stat st;
+        if(stat((dir + "/" + ent->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) total += st.st_blocks * 512;
+    }
+    closedir(d);
+    return total;
+}
+
+// the items of a comma separated list
+static std::vector<string> split(const string & s) {
+    std::vector<string> items;
+    size_t pos = 0;
+    while(pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if(end == string::npos) end = s.size();
+        items.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return items;
+}
+
+static std::vector<int> parse_trees(const string & s) {
+    std::vector<int> ids;
+    if(s == "all") {
+        for(const engine_t & e : ENGINES) ids.push_back(e.id);
+        return ids;
+    }
+    for(const string & item : split(s)) {
+        int id = atoi(item.c_str());
+        if(id < 1 || id > ENGINE_NUM) {
+            printf("Invalid tree type %s\n", item.c_str());
+            exit(-1);
+        }
+        ids.push_back(id);
+    }
+    return ids;
+}
+
+/*
+    None of the trees is thread safe, the multi-threaded driver runs them
+    behind a reader-writer lock. A lookup of the disk-resident tree swizzles
+    and evicts pages, so its readers take the lock exclusively too.
+*/
+class locked : tree_api {
+    private:
+        tree_api * tree;
+        bool shared_reads;
+        std::shared_mutex mtx;
+
+    public:
+        locked(tree_api * t, bool shared) : tree(t), shared_reads(shared) {}
+
+        ~locked() {
+            delete tree;
+        }
+
+        bool find(_key_t key, _value_t & value) {
+            if(shared_reads) {
+                std::shared_lock<std::shared_mutex> lk(mtx);
+                return tree->find(key, value);
+            }
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            return tree->find(key, value);
+        }
+
+        void insert(_key_t key, _value_t value) {
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            tree->insert(key, value);
+        }
+
+        bool update(_key_t key, _value_t value) {
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            return tree->update(key, value);
+        }
+
+        bool remove(_key_t key) {
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            return tree->remove(key);
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            if(shared_reads) {
+                std::shared_lock<std::shared_mutex> lk(mtx);
+                return tree->scan(start_key, num, vals);
+            }
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            return tree->scan(start_key, num, vals);
+        }
+
+        void printAll() {
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            tree->printAll();
+        }
+};
+
+// the tree for the multi-threaded driver, the trees with a write-ahead log lock themselves
+static tree_api * make_concurrent_tree(int id, const string & file, int pool, bool sync) {
+    tree_api * t = make_tree(id, file, pool, sync);
+    if(id == 6 || id == 7) return t;
+    return (tree_api *) new locked(t, id != 8);
+}
+
+#endif //__BENCH__
@@ -8,51 +8,126 @@
 #include <cstring>
 #include <string>
 #include <cstdio>
+#include <iostream>
 #include <random>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <limits>
+#include <functional>
 
 #include "base.h"
+#include "stats.h"
 
 namespace btree {
 using std::string;
 
-const int PAGESIZE = 256;
-const int NODE_SIZE = (PAGESIZE - 32) / 16;
+const int PAGESIZE = 256; // the default node bytes
 
-struct Record {
-    _key_t key;
+// a process wide epoch, nodes are stamped with it when they are modified so a
+// checkpoint can find the nodes changed since the previous one
+static inline std::atomic<uint64_t> & epoch_counter() {
+    static std::atomic<uint64_t> e(1);
+    return e;
+}
+
+static inline uint64_t current_epoch() {
+    return epoch_counter().load(std::memory_order_relaxed);
+}
+
+// start a new epoch, return the one that ends
+static inline uint64_t advance_epoch() {
+    return epoch_counter().fetch_add(1);
+}
+
+// the largest power of two not greater than n, and the steps of a binary search over n records
+constexpr int top_step(int n) {
+    return n <= 1 ? 1 : 2 * top_step(n / 2);
+}
+
+constexpr int search_steps(int n) {
+    return n <= 1 ? 1 : 1 + search_steps(n / 2);
+}
+
+template <typename K>
+struct record_t {
+    K key;
     char * val;
 };
 
-class Node {
+/*
+    A node of NODE_BYTES bytes: 32 bytes of meta data and the sorted records.
+    The fan-out is derived from the geometry at compile time, so the search
+    is a binary search of a constant number of steps that the compiler
+    unrolls.
+*/
+template <typename K, typename V, int NODE_BYTES, typename Compare>
+class node_t {
     public:
+        typedef record_t<K> Record;
+        static constexpr int NODE_SIZE = (NODE_BYTES - 32) / sizeof(Record);
+        static_assert(NODE_SIZE >= 3, "a node must hold at least 3 records");
+
         char * leftmost_ptr; // NULL means the node is a leaf node; Non-null value represents the leftmost child of current node
         char * sibling_ptr;
         uint64_t count;      // total record number in current node
-        char dummy[8];       // the total meta data is 32 bytes
+        uint64_t epoch;      // epoch of the last modification, the total meta data is 32 bytes
         Record recs[NODE_SIZE];
     private:
-        void insert(_key_t k, _value_t v) {
-            uint64_t i;
-            for(i = 0; i < count; i++) {
-                if(recs[i].key > k) {
-                    break;
+        static constexpr int TOP_STEP = top_step(NODE_SIZE);
+        static constexpr int SEARCH_STEPS = search_steps(NODE_SIZE);
+
+        // the number of records whose key is not greater than key (UPPER) or less than key
+        template <bool UPPER>
+        inline uint64_t rank(const K & key) const {
+            uint64_t i = 0;
+            for(uint64_t step = TOP_STEP; step > 0; step >>= 1) {
+                if(i + step <= count && (UPPER ? !key_less<Compare>(key, recs[i + step - 1].key)
+                                               : key_less<Compare>(recs[i + step - 1].key, key))) {
+                    i += step;
                 }
             }
+            return i;
+        }
+
+        void insert(const K & k, char * v) {
+            uint64_t i = rank<true>(k);
 
-            // recs[i].key <= key
+            // recs[i].key > key
             memmove(&recs[i + 1], &recs[i], sizeof(Record) * (count - i));
 
-            recs[i] = {k, (char *) v};
+            recs[i] = {k, v};
 
             count += 1;
         }
-    
+
     public:
-        Node (): leftmost_ptr(NULL), sibling_ptr(NULL), count(0){}
-        
+        node_t (): leftmost_ptr(NULL), sibling_ptr(NULL), count(0), epoch(current_epoch()){}
+
+        inline void mark_dirty() {
+            uint64_t e = current_epoch();
+            if(epoch != e) epoch = e; // do not dirty the cache line again
+        }
+
+        // the slot of the child get_child(key) returns, inner nodes only
+        char * & get_child_ref(const K & key) {
+            uint64_t i = rank<true>(key);
+            STAT_ADD(BTREE, SEARCHES, 1);
+            STAT_ADD(BTREE, COMPARES, SEARCH_STEPS);
+            return i == 0 ? leftmost_ptr : recs[i - 1].val;
+        }
+
+        // the slot of the idx-th child, the 0-th is leftmost_ptr
+        inline char * & child_ref(int idx) {
+            return idx == 0 ? leftmost_ptr : recs[idx - 1].val;
+        }
+
         void * operator new (size_t size) { // make the allocation 64 B aligned
             #ifdef _WIN32
-                void *ret = _aligned_malloc(size, 64); 
+                void *ret = _aligned_malloc(size, 64);
             #else
                 void * ret;
                 if(posix_memalign(&ret,64,size) != 0)
@@ -63,13 +138,13 @@ class Node {
 
         void operator delete(void * ptr) {
             if(ptr != NULL) {
-                Node * this_node = (Node *) ptr;
+                node_t * this_node = (node_t *) ptr;
                 if(this_node->leftmost_ptr != NULL) {
-                    delete (Node *)this_node->leftmost_ptr;
+                    delete (node_t *)this_node->leftmost_ptr;
                     for(int i = 0; i < this_node->count; i++) {
-                        delete (Node *)this_node->recs[i].val;
+                        delete (node_t *)this_node->recs[i].val;
                     }
-                } 
+                }
 
                 #ifdef _WIN32
                     _aligned_free(ptr);
@@ -79,26 +154,18 @@ class Node {
             }
         }
 
-        char * get_child(_key_t key) { // find the record whose key is the last one that is less equal to key
+        char * get_child(const K & key) { // find the record whose key is the last one that is less equal to key
+            STAT_ADD(BTREE, SEARCHES, 1);
+            STAT_ADD(BTREE, COMPARES, SEARCH_STEPS);
             if(leftmost_ptr == NULL) {
-                uint64_t i;
-                for(i = 0; i < count; i++) {
-                    if(recs[i].key >= key) {
-                        break;
-                    }
-                }
+                uint64_t i = rank<false>(key);
 
-                if (recs[i].key == key)
+                if (i < count && key_equal<Compare>(recs[i].key, key))
                     return recs[i].val;
                 else // recs[i].key > key, not found
                     return NULL;
             } else {
-                uint64_t i;
-                for(i = 0; i < count; i++) {
-                    if(recs[i].key > key) {
-                        break;
-                    }
-                }
+                uint64_t i = rank<true>(key);
 
                 if(i == 0)
                     return leftmost_ptr;
@@ -107,9 +174,11 @@ class Node {
             }
         }
 
-        bool store(_key_t k, _value_t v, _key_t & split_k, Node * & split_node) {
+        bool store(const K & k, char * v, K & split_k, node_t * & split_node) {
+            mark_dirty();
             if(count == NODE_SIZE) {
-                split_node = new Node;
+                STAT_SPLIT(BTREE);
+                split_node = new node_t;
 
                 uint64_t m = count / 2;
                 split_k = recs[m].key;
@@ -129,7 +198,7 @@ class Node {
                 split_node->sibling_ptr = sibling_ptr;
                 sibling_ptr = (char *) split_node;
 
-                if(split_k > k) {
+                if(key_less<Compare>(k, split_k)) {
                     insert(k, v);
                 } else {
                     split_node->insert(k, v);
@@ -141,107 +210,250 @@ class Node {
             }
         }
 
-        bool remove(_key_t k) { // remove k from current node
-            int pos = -1;
-            for(int i = 0; i < count; i++) {
-                if(recs[i].key == k){
-                    pos = i;
-                    break;
-                }
+        // the value of k in a leaf, false if k is not in it
+        inline bool lookup(const K & k, char * & v) const {
+            STAT_ADD(BTREE, SEARCHES, 1);
+            STAT_ADD(BTREE, COMPARES, SEARCH_STEPS);
+            uint64_t pos = rank<false>(k);
+            if(pos < count && key_equal<Compare>(recs[pos].key, k)) {
+                v = recs[pos].val;
+                return true;
             }
-            if(pos >= 0) { // we found k in this node
+            return false;
+        }
+
+        bool update(const K & k, char * v) { // the value of k in a leaf
+            uint64_t pos = rank<false>(k);
+            if(pos < count && key_equal<Compare>(recs[pos].key, k)) {
+                mark_dirty();
+                recs[pos].val = v;
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(const K & k) { // remove k from current node
+            uint64_t pos = rank<false>(k);
+            if(pos < count && key_equal<Compare>(recs[pos].key, k)) { // we found k in this node
+                mark_dirty();
                 memmove(&recs[pos], &recs[pos + 1], sizeof(Record) * (count - pos - 1));
                 count -= 1;
                 return true;
-            } 
+            }
             return false;
         }
 
-        int get_lrchild(_key_t k, Node * & left, Node * & right) {
-            int16_t i = 0;
-            for( ; i < count; i++) {
-                if(recs[i].key > k)
-                    break;
-            }
+        int get_lrchild(const K & k, node_t * & left, node_t * & right) {
+            int16_t i = rank<true>(k);
 
             if(i == 0) {
                 left = NULL;
             } else if(i == 1) {
-                left = (Node *)leftmost_ptr;
+                left = (node_t *)leftmost_ptr;
             } else {
-                left = (Node *)recs[i - 2].val;
+                left = (node_t *)recs[i - 2].val;
             }
 
             if(i == count) {
                 right = NULL;
             } else {
-                right = (Node *)recs[i].val;
+                right = (node_t *)recs[i].val;
             }
             return i;
         }
-    
-        static void merge(Node * left, Node * right, _key_t merge_key) {
+
+        static void merge(node_t * left, node_t * right, const K & merge_key) {
+            STAT_ADD(BTREE, MERGES, 1);
+            left->mark_dirty();
             if(left->leftmost_ptr == NULL) {
                 for(int i = 0; i < right->count; i++) {
                     left->recs[left->count++] = right->recs[i];
                 }
             } else {
-                left->recs[left->count++] = {merge_key, right->leftmost_ptr}; 
+                left->recs[left->count++] = {merge_key, right->leftmost_ptr};
                 for(int i = 0; i < right->count; i++) {
                     left->recs[left->count++] = right->recs[i];
                 }
             }
-            free((void *)right);
+            left->sibling_ptr = right->sibling_ptr; // right is released by the caller
         }
 
         void print(string prefix) {
-            printf("%s[(%lu) ", prefix.c_str(), count);
+            std::cout << prefix << "[(" << count << ") ";
             for(int i = 0; i < count; i++) {
-                printf("(%ld, %ld) ", recs[i].key, (int64_t)recs[i].val);
+                std::cout << "(" << recs[i].key << ", " << (int64_t)recs[i].val << ") ";
             }
-            printf("]\n");
+            std::cout << "]" << std::endl;
 
             if(leftmost_ptr != NULL) {
-                Node * child = (Node *)leftmost_ptr;
+                node_t * child = (node_t *)leftmost_ptr;
                 child->print(prefix + "    ");
 
                 for(int i = 0; i < count; i++) {
-                    Node * child = (Node *)recs[i].val;
+                    node_t * child = (node_t *)recs[i].val;
                     child->print(prefix + "    ");
                 }
             }
         }
 };
 
-class btree : tree_api{
+/*
+    Snapshots: snapshot() returns a read-only view of the tree in O(1). While a
+    snapshot is alive, a node stamped with an epoch not newer than the snapshot
+    is never modified: the writer copies it first and the copy replaces it in
+    its parent, so an insert or remove copies the path from the root to the
+    leaf. Replaced and removed nodes are kept on a retired list until no live
+    snapshot can reach them anymore.
+
+    The tree itself is single writer: snapshot() must be called by the writer,
+    a snapshot can be read and dropped from any thread. Sibling pointers are not
+    kept up to date for copied nodes, so scans descend from the root. All the
+    snapshots must be dropped before the tree is destroyed.
+
+    Keys are trivially copyable and ordered by Compare, values fit in the
+    pointer slot of a record (to_slot in base.h).
+*/
+template <typename K = _key_t, typename V = _value_t, int NODE_BYTES = PAGESIZE, typename Compare = std::less<K>>
+class btree_t : public tree_base<btree_t<K, V, NODE_BYTES, Compare>, K, V> {
+    public:
+        typedef node_t<K, V, NODE_BYTES, Compare> Node;
+        typedef record_t<K> Record;
+        static constexpr int NODE_SIZE = Node::NODE_SIZE;
+
+        class snapshot_t {
+            private:
+                btree_t * tree;
+                Node * root;
+                uint64_t epoch;
+
+            public:
+                snapshot_t(btree_t * t, Node * r, uint64_t e) : tree(t), root(r), epoch(e) {}
+
+                ~snapshot_t() {
+                    tree->release_snapshot(epoch);
+                }
+
+                bool find(const K & key, V &val) const {
+                    return find_in(root, key, val);
+                }
+
+                // call f(key, value) on every record in key order
+                template <typename F>
+                void for_each(F f) const {
+                    for_each_recursive(root, f);
+                }
+
+                // call f(key, value) on the records with low <= key < high in key order
+                template <typename F>
+                void for_each_range(const K & low, const K & high, F f) const {
+                    range_recursive(root, low, high, f);
+                }
+
+                uint64_t get_epoch() const {
+                    return epoch;
+                }
+        };
+
     private:
+        struct retired_t {
+            Node * node;
+            uint64_t born; // the epoch stamp of the node
+            uint64_t died; // the epoch it was replaced or removed in
+        };
+
         Node * root;
+        std::atomic<uint64_t> cow_epoch; // the newest live snapshot, 0 if there is none
+        std::mutex snap_mtx;             // protects live_snaps and retired
+        std::multiset<uint64_t> live_snaps;
+        std::vector<retired_t> retired;
+
+        inline bool shared(Node * n) const { // a live snapshot may read n
+            uint64_t s = cow_epoch.load(std::memory_order_acquire);
+            return s != 0 && n->epoch <= s;
+        }
+
+        // return a node that may be modified in place, the caller installs it in the parent
+        Node * cow(Node * n) {
+            if(!shared(n)) return n;
+
+            Node * copy = new Node;
+            memcpy((void *)copy, (void *)n, sizeof(Node));
+            copy->epoch = current_epoch();
+            release(n);
+            return copy;
+        }
+
+        void release(Node * n) { // n has left the tree, the children are not touched
+            if(shared(n)) {
+                std::lock_guard<std::mutex> lk(snap_mtx);
+                retired.push_back({n, n->epoch, current_epoch()});
+            } else {
+                free((void *)n);
+            }
+        }
+
+        void release_tree(Node * n) {
+            if(n->leftmost_ptr != NULL) {
+                release_tree((Node *)n->leftmost_ptr);
+                for(uint64_t i = 0; i < n->count; i++) {
+                    release_tree((Node *)n->recs[i].val);
+                }
+            }
+            release(n);
+        }
+
+        void release_snapshot(uint64_t s) {
+            std::lock_guard<std::mutex> lk(snap_mtx);
+            live_snaps.erase(live_snaps.find(s));
+            cow_epoch.store(live_snaps.empty() ? 0 : *live_snaps.rbegin(), std::memory_order_release);
+
+            // a retired node is reachable from the snapshots taken in [born, died)
+            size_t j = 0;
+            for(size_t i = 0; i < retired.size(); i++) {
+                auto it = live_snaps.lower_bound(retired[i].born);
+                if(it != live_snaps.end() && *it < retired[i].died) {
+                    retired[j++] = retired[i];
+                } else {
+                    free((void *)retired[i].node);
+                }
+            }
+            retired.resize(j);
+        }
 
     public:
-        btree() {
+        btree_t() : cow_epoch(0) {
             root = new Node;
         }
 
-        ~btree() {
+        ~btree_t() {
+            for(retired_t & r : retired) {
+                free((void *)r.node);
+            }
             delete root;
         }
 
-        bool find(_key_t key, _value_t &val) {
-            Node * cur = root;
-            while(cur->leftmost_ptr != NULL) { // no prefetch here
-                char * child_ptr = cur->get_child(key);
-                cur = (Node *)child_ptr;
-            }
-
-            val = (_value_t) cur->get_child(key);
+        bool find(K key, V &val) {
+            return find_in(root, key, val);
+        }
 
-            return true;
+        // a consistent read-only view, released when the last reference is dropped
+        std::shared_ptr<const snapshot_t> snapshot() {
+            uint64_t s = advance_epoch(); // every node is stamped with s or older
+            {
+                std::lock_guard<std::mutex> lk(snap_mtx);
+                live_snaps.insert(s);
+            }
+            cow_epoch.store(s, std::memory_order_release);
+            return std::make_shared<const snapshot_t>(this, root, s);
         }
 
-        void insert(_key_t key, _value_t val) {
-            _key_t split_k;
+        void insert(K key, V val) {
+            STAT_INSERT(BTREE);
+            root = cow(root);
+
+            K split_k;
             Node * split_node;
-            bool splitIf = insert_recursive(root, key, val, split_k, split_node);
+            bool splitIf = insert_recursive(root, key, to_slot(val), split_k, split_node);
 
             if(splitIf) {
                 Node *new_root = new Node;
@@ -250,23 +462,96 @@ class btree : tree_api{
                 new_root->recs[0].key = split_k;
                 new_root->count = 1;
                 root = new_root;
+                STAT_ADD(BTREE, ROOT_GROWS, 1);
             }
         }
-        
-        bool update(_key_t key, _value_t value) { // TODO: not implemented
-            return false;
+
+        bool update(K key, V value) {
+            root = cow(root);
+            Node * cur = root;
+            while(cur->leftmost_ptr != NULL) { // the path is copied and marked like the one of an insert
+                cur->mark_dirty();
+                char * & slot = cur->get_child_ref(key);
+                Node * child = cow((Node *)slot);
+                slot = (char *)child;
+                cur = child;
+            }
+            return cur->update(key, to_slot(value));
         }
 
-        bool remove(_key_t key) {   
-            if(root->leftmost_ptr == NULL) {
-                root->remove(key);
+        // replace the content of the tree with num records sorted by key, built bottom-up
+        void bulk_load(const std::pair<K, V> * kvs, uint64_t num) {
+            if(cow_epoch.load() == 0) {
+                delete root;
+            } else {
+                release_tree(root);
+            }
+
+            const uint64_t per_node = NODE_SIZE * 3 / 4; // leave room for inserts after loading
+            std::vector<Node *> level;
+            std::vector<K> lows; // the smallest key under each node of the level
+
+            uint64_t node_num = num == 0 ? 1 : (num + per_node - 1) / per_node;
+            for(uint64_t i = 0; i < node_num; i++) {
+                Node * n = new Node;
+                uint64_t start = num * i / node_num, end = num * (i + 1) / node_num;
+                for(uint64_t j = start; j < end; j++) {
+                    n->recs[n->count++] = {kvs[j].first, to_slot(kvs[j].second)};
+                }
+                if(i > 0) level.back()->sibling_ptr = (char *)n;
+                level.push_back(n);
+                lows.push_back(num == 0 ? K() : kvs[start].first);
+            }
+
+            while(level.size() > 1) { // build the upper level, each node gets per_node + 1 children at most
+                std::vector<Node *> up;
+                std::vector<K> up_lows;
+                node_num = (level.size() + per_node) / (per_node + 1);
+                for(uint64_t i = 0; i < node_num; i++) {
+                    Node * n = new Node;
+                    uint64_t start = level.size() * i / node_num, end = level.size() * (i + 1) / node_num;
+                    n->leftmost_ptr = (char *)level[start];
+                    for(uint64_t j = start + 1; j < end; j++) {
+                        n->recs[n->count++] = {lows[j], (char *)level[j]};
+                    }
+                    if(i > 0) up.back()->sibling_ptr = (char *)n;
+                    up.push_back(n);
+                    up_lows.push_back(lows[start]);
+                }
+                level.swap(up);
+                lows.swap(up_lows);
+            }
+            root = level[0];
+        }
+
+        // call f(key, value) on every record in key order
+        template <typename F>
+        void for_each(F f) {
+            for_each_recursive(root, f);
+        }
+
+        // call f(low, high, open_high, recs, count) on every leaf modified after epoch since,
+        // in key order. The leaf covers the keys in [low, high), or [low, +inf) if open_high
+        template <typename F>
+        void for_each_dirty(uint64_t since, F f) {
+            dirty_recursive(root, since, std::numeric_limits<K>::lowest(), std::numeric_limits<K>::max(), true, f);
+        }
 
-                return root->count == 0;
+        // true if key was in the tree
+        bool remove(K key) {
+            STAT_ADD(BTREE, REMOVES, 1);
+            root = cow(root);
+            if(root->leftmost_ptr == NULL) {
+                return root->remove(key);
             }
             else {
-                Node * child = (Node *) root->get_child(key);
+                root->mark_dirty();
+                char * & slot = root->get_child_ref(key);
+                Node * child = cow((Node *)slot);
+                slot = (char *)child;
 
-                bool shouldMrg = remove_recursive(child, key);
+                bool removed = false;
+                bool shouldMrg = remove_recursive(child, key, removed);
 
                 if(shouldMrg) {
                     Node *leftsib = NULL, *rightsib = NULL;
@@ -274,29 +559,39 @@ class btree : tree_api{
 
                     if(leftsib != NULL && (child->count + leftsib->count) < NODE_SIZE) {
                         // merge with left node
-                        _key_t merge_key = root->recs[pos - 1].key;
+                        K merge_key = root->recs[pos - 1].key;
+                        leftsib = cow(leftsib);
+                        root->child_ref(pos - 1) = (char *)leftsib;
                         root->remove(merge_key);
                         Node::merge(leftsib, child, merge_key);
-                    } 
+                        release(child);
+                    }
                     else if (rightsib != NULL && (child->count + rightsib->count) < NODE_SIZE) {
                         // merge with right node
-                        _key_t merge_key = root->recs[pos].key;
+                        K merge_key = root->recs[pos].key;
                         root->remove(merge_key);
                         Node::merge(child, rightsib, merge_key);
+                        release(rightsib);
                     }
-                    
+
                     if(root->count == 0) { // the root is empty
                         Node * old_root = root;
 
                         root = (Node *)root->leftmost_ptr;
-                        
-                        old_root->leftmost_ptr = NULL;
-                        delete old_root;
+
+                        release(old_root);
+                        STAT_ADD(BTREE, ROOT_SHRINKS, 1);
                     }
                 }
 
-                return false;
-            } 
+                return removed;
+            }
+        }
+
+        int scan(K start_key, int num, V * vals) {
+            int cnt = 0;
+            if(num > 0) scan_recursive(root, start_key, num, vals, cnt);
+            return cnt;
         }
 
         void printAll() {
@@ -304,32 +599,119 @@ class btree : tree_api{
         }
 
     private:
-        bool insert_recursive(Node * n, _key_t k, _value_t v, _key_t &split_k, Node * &split_node) {
+        static bool find_in(Node * root, const K & key, V &val) {
+            STAT_ADD(BTREE, FINDS, 1);
+            Node * cur = root;
+            while(cur->leftmost_ptr != NULL) { // no prefetch here
+                STAT_ADD(BTREE, FIND_NODES, 1);
+                char * child_ptr = cur->get_child(key);
+                cur = (Node *)child_ptr;
+            }
+
+            STAT_ADD(BTREE, FIND_NODES, 1);
+            char * v;
+            if(!cur->lookup(key, v)) return false;
+            val = from_slot<V>(v);
+            return true;
+        }
+
+        template <typename F>
+        static void range_recursive(Node * n, const K & low, const K & high, F & f) {
             if(n->leftmost_ptr == NULL) {
+                for(uint64_t i = 0; i < n->count; i++) {
+                    if(!key_less<Compare>(n->recs[i].key, low) && key_less<Compare>(n->recs[i].key, high))
+                        f(n->recs[i].key, from_slot<V>(n->recs[i].val));
+                }
+            } else {
+                // the i-th child covers [recs[i - 1].key, recs[i].key)
+                for(uint64_t i = 0; i <= n->count; i++) {
+                    if(i > 0 && !key_less<Compare>(n->recs[i - 1].key, high)) break;
+                    if(i < n->count && !key_less<Compare>(low, n->recs[i].key)) continue;
+                    range_recursive((Node *)n->child_ref(i), low, high, f);
+                }
+            }
+        }
+
+        // descend instead of following sibling_ptr, which is stale in nodes copied for a snapshot
+        static void scan_recursive(Node * n, const K & start, int num, V * vals, int & cnt) {
+            if(n->leftmost_ptr == NULL) {
+                for(uint64_t i = 0; i < n->count && cnt < num; i++) {
+                    if(!key_less<Compare>(n->recs[i].key, start))
+                        vals[cnt++] = from_slot<V>(n->recs[i].val);
+                }
+            } else {
+                for(uint64_t i = 0; i <= n->count && cnt < num; i++) {
+                    if(i < n->count && !key_less<Compare>(start, n->recs[i].key)) continue;
+                    scan_recursive((Node *)n->child_ref(i), start, num, vals, cnt);
+                }
+            }
+        }
+
+        template <typename F>
+        static void for_each_recursive(Node * n, F & f) {
+            if(n->leftmost_ptr == NULL) {
+                for(uint64_t i = 0; i < n->count; i++) {
+                    f(n->recs[i].key, from_slot<V>(n->recs[i].val));
+                }
+            } else {
+                for_each_recursive((Node *)n->leftmost_ptr, f);
+                for(uint64_t i = 0; i < n->count; i++) {
+                    for_each_recursive((Node *)n->recs[i].val, f);
+                }
+            }
+        }
+
+        template <typename F>
+        void dirty_recursive(Node * n, uint64_t since, const K & low, const K & high, bool open_high, F & f) {
+            if(n->epoch <= since) return; // nothing below n has changed
+
+            if(n->leftmost_ptr == NULL) {
+                f(low, high, open_high, (const Record *)n->recs, n->count);
+            } else if(n->count == 0) {
+                dirty_recursive((Node *)n->leftmost_ptr, since, low, high, open_high, f);
+            } else {
+                dirty_recursive((Node *)n->leftmost_ptr, since, low, n->recs[0].key, false, f);
+                for(uint64_t i = 0; i + 1 < n->count; i++) {
+                    dirty_recursive((Node *)n->recs[i].val, since, n->recs[i].key, n->recs[i + 1].key, false, f);
+                }
+                dirty_recursive((Node *)n->recs[n->count - 1].val, since, n->recs[n->count - 1].key, high, open_high, f);
+            }
+        }
+
+        bool insert_recursive(Node * n, const K & k, char * v, K &split_k, Node * &split_node) {
+            if(n->leftmost_ptr == NULL) {
+                if(n->update(k, v)) return false; // the key is in the tree, its value is replaced
                 return n->store(k, v, split_k, split_node);
             } else {
-                Node * child = (Node *)n->get_child(k);
-                
-                _key_t split_k_child;
+                n->mark_dirty(); // keep the path to the modified leaf visible to for_each_dirty
+                char * & slot = n->get_child_ref(k);
+                Node * child = cow((Node *)slot); // path copying if a snapshot shares the child
+                slot = (char *)child;
+
+                K split_k_child;
                 Node * split_node_child;
                 bool splitIf = insert_recursive(child, k, v, split_k_child, split_node_child);
 
-                if(splitIf) { 
-                    return n->store(split_k_child, (_value_t)split_node_child, split_k, split_node);
-                } 
+                if(splitIf) {
+                    return n->store(split_k_child, (char *)split_node_child, split_k, split_node);
+                }
                 return false;
             }
         }
 
-        bool remove_recursive(Node * n, _key_t k) {
+        // removed tells if k was found, the result if n should be merged
+        bool remove_recursive(Node * n, const K & k, bool & removed) {
             if(n->leftmost_ptr == NULL) {
-                n->remove(k);
+                removed = n->remove(k);
                 return n->count <= NODE_SIZE / 3;
             }
             else {
-                Node * child = (Node *) n->get_child(k);
+                n->mark_dirty();
+                char * & slot = n->get_child_ref(k);
+                Node * child = cow((Node *)slot);
+                slot = (char *)child;
 
-                bool shouldMrg = remove_recursive(child, k);
+                bool shouldMrg = remove_recursive(child, k, removed);
 
                 if(shouldMrg) {
                     Node *leftsib = NULL, *rightsib = NULL;
@@ -337,17 +719,21 @@ class btree : tree_api{
 
                     if(leftsib != NULL && (child->count + leftsib->count) < NODE_SIZE) {
                         // merge with left node
-                        _key_t merge_key = n->recs[pos - 1].key;
+                        K merge_key = n->recs[pos - 1].key;
+                        leftsib = cow(leftsib);
+                        n->child_ref(pos - 1) = (char *)leftsib;
                         n->remove(merge_key);
                         Node::merge(leftsib, child, merge_key);
-                        
+                        release(child);
+
                         return n->count <= NODE_SIZE / 3;
                     } else if (rightsib != NULL && (child->count + rightsib->count) < NODE_SIZE) {
                         // merge with right node
-                        _key_t merge_key = n->recs[pos].key;
+                        K merge_key = n->recs[pos].key;
                         n->remove(merge_key);
                         Node::merge(child, rightsib, merge_key);
-                        
+                        release(rightsib);
+
                         return n->count <= NODE_SIZE / 3;
                     }
                 }
@@ -355,7 +741,13 @@ class btree : tree_api{
             }
         }
 
-}; // class btree
+}; // class btree_t
+
+// the default geometry, the tree behind the benchmark drivers
+typedef record_t<_key_t> Record;
+typedef node_t<_key_t, _value_t, PAGESIZE, std::less<_key_t>> Node;
+const int NODE_SIZE = Node::NODE_SIZE;
+typedef btree_t<> btree;
 
 }; // namespace btree
 
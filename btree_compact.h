@@ -0,0 +1,371 @@
+/*  btree_compact.h - the btree with 32-bit node references into a node arena
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BTREE_COMPACT__
+#define __BTREE_COMPACT__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+#include <atomic>
+
+#include <sys/mman.h>
+
+#include "base.h"
+#include "btree.h"
+
+namespace btree {
+
+// bytes of the nodes handed out by all node arenas, malloc does not see them
+static inline std::atomic<uint64_t> & arena_bytes() {
+    static std::atomic<uint64_t> b(0);
+    return b;
+}
+
+/*
+    Nodes of NODE_BYTES bytes in one anonymous mapping, addressed by their
+    32-bit index. Like mmap_region, the address range for all 2^32 nodes is
+    reserved up front (1 TB for 256-byte nodes, backed only where it is
+    touched), so nodes never move. Node 0 is the header and doubles as the
+    NULL reference; it holds the root, so the bytes of nodes [0, used) are
+    a complete image of the tree that can be copied or mapped anywhere.
+*/
+template <int NODE_BYTES>
+class node_arena {
+    public:
+        static const uint64_t MAGIC = 0x4254524545494458; // "BTREEIDX"
+        static constexpr uint64_t MAX_NODES = (uint64_t)1 << 32;
+
+        struct header_t {
+            uint64_t magic;
+            uint64_t node_bytes;
+            uint32_t used; // nodes handed out, the header included
+            uint32_t root;
+        };
+        static_assert(sizeof(header_t) <= NODE_BYTES, "the header fits node 0");
+
+    private:
+        char * base;
+
+        void reserve() {
+            base = (char *)mmap(NULL, MAX_NODES * NODE_BYTES, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(base == MAP_FAILED) {
+                perror("node_arena: reserve");
+                exit(-1);
+            }
+        }
+
+    public:
+        node_arena() {
+            reserve();
+            header()->magic = MAGIC;
+            header()->node_bytes = NODE_BYTES;
+            header()->used = 1;
+            arena_bytes() += NODE_BYTES;
+        }
+
+        // a copy of the image of another arena, no reference needs to be fixed
+        node_arena(const char * image, uint64_t bytes) {
+            const header_t * h = (const header_t *)image;
+            if(bytes < sizeof(header_t) || h->magic != MAGIC || h->node_bytes != NODE_BYTES
+               || bytes < (uint64_t)h->used * NODE_BYTES) {
+                fprintf(stderr, "node_arena: not an image of %d B nodes\n", NODE_BYTES);
+                exit(-1);
+            }
+            reserve();
+            memcpy(base, image, (uint64_t)h->used * NODE_BYTES);
+            arena_bytes() += this->bytes();
+        }
+
+        ~node_arena() {
+            arena_bytes() -= bytes();
+            munmap(base, MAX_NODES * NODE_BYTES);
+        }
+
+        inline header_t * header() const {
+            return (header_t *)base;
+        }
+
+        template <typename T>
+        inline T * at(uint32_t idx) const {
+            return (T *)(base + (uint64_t)idx * NODE_BYTES);
+        }
+
+        uint32_t alloc() {
+            if(header()->used == UINT32_MAX) {
+                fprintf(stderr, "node_arena: out of node indices\n");
+                exit(-1);
+            }
+            arena_bytes() += NODE_BYTES;
+            return header()->used++; // fresh pages of the mapping are zero
+        }
+
+        // the image of the tree: the first bytes() bytes from image()
+        const char * image() const {
+            return base;
+        }
+
+        uint64_t bytes() const {
+            return (uint64_t)header()->used * NODE_BYTES;
+        }
+};
+
+// the 16 bytes every node starts with
+struct compact_head_t {
+    uint32_t leftmost; // 0 means the node is a leaf node
+    uint32_t sibling;
+    uint32_t count;
+    uint32_t unused;
+};
+
+/*
+    The btree on node_arena. The keys and the references of a node are kept
+    in two arrays, so an inner entry is a key and a 4-byte index: 20 keys
+    in a 256-byte inner node instead of the 14 of btree::Node, and 15
+    records in a leaf. The search is the same binary search of a constant
+    number of steps.
+
+    Values are stored in the pointer slot of a record like in btree_t; an
+    image is only position independent as far as the values are. A remove
+    only takes the record out of its leaf, nodes are never merged.
+*/
+template <typename K = _key_t, typename V = _value_t, int NODE_BYTES = PAGESIZE, typename Compare = std::less<K>>
+class compact_t : public tree_base<compact_t<K, V, NODE_BYTES, Compare>, K, V> {
+    public:
+        static constexpr int LEAF_SIZE = (NODE_BYTES - sizeof(compact_head_t)) / (sizeof(K) + sizeof(char *));
+        static constexpr int INNER_SIZE = (NODE_BYTES - sizeof(compact_head_t)) / (sizeof(K) + sizeof(uint32_t));
+        static_assert(LEAF_SIZE >= 3, "a node must hold at least 3 records");
+
+        struct leaf_t : compact_head_t {
+            K keys[LEAF_SIZE];
+            char * vals[LEAF_SIZE];
+        };
+
+        struct inner_t : compact_head_t {
+            K keys[INNER_SIZE];
+            uint32_t child[INNER_SIZE]; // child[i] holds the keys not less than keys[i]
+        };
+        static_assert(sizeof(leaf_t) <= NODE_BYTES && sizeof(inner_t) <= NODE_BYTES, "the nodes fit NODE_BYTES");
+
+    private:
+        node_arena<NODE_BYTES> arena;
+
+        // the number of keys not greater than key (UPPER) or less than key, STEP is the top step of N
+        template <bool UPPER, int STEP>
+        static inline uint32_t rank(const K * keys, uint32_t count, const K & key) {
+            uint32_t i = 0;
+            for(uint32_t step = STEP; step > 0; step >>= 1) {
+                if(i + step <= count && (UPPER ? !key_less<Compare>(key, keys[i + step - 1])
+                                               : key_less<Compare>(keys[i + step - 1], key))) {
+                    i += step;
+                }
+            }
+            return i;
+        }
+
+        static inline uint32_t inner_rank(const inner_t * n, const K & key) {
+            return rank<true, top_step(INNER_SIZE)>(n->keys, n->count, key);
+        }
+
+        static inline uint32_t leaf_rank(const leaf_t * n, const K & key) {
+            return rank<false, top_step(LEAF_SIZE)>(n->keys, n->count, key);
+        }
+
+        static inline uint32_t child_at(const inner_t * n, uint32_t i) {
+            return i == 0 ? n->leftmost : n->child[i - 1];
+        }
+
+        inline compact_head_t * node(uint32_t idx) const {
+            return arena.template at<compact_head_t>(idx);
+        }
+
+        leaf_t * find_leaf(const K & key) const {
+            uint32_t idx = arena.header()->root;
+            compact_head_t * n = node(idx);
+            while(n->leftmost != 0) {
+                n = node(child_at((inner_t *)n, inner_rank((inner_t *)n, key)));
+            }
+            return (leaf_t *)n;
+        }
+
+        bool insert_leaf(leaf_t * l, const K & k, char * v, K & split_k, uint32_t & split_idx) {
+            uint32_t i = leaf_rank(l, k);
+            if(i < l->count && key_equal<Compare>(l->keys[i], k)) {
+                l->vals[i] = v;
+                return false;
+            }
+
+            bool split = l->count == LEAF_SIZE;
+            if(split) { // the upper half moves to a new right leaf
+                split_idx = arena.alloc();
+                leaf_t * r = arena.template at<leaf_t>(split_idx);
+                uint32_t m = LEAF_SIZE / 2;
+                r->count = LEAF_SIZE - m;
+                memcpy(r->keys, l->keys + m, sizeof(K) * r->count);
+                memcpy(r->vals, l->vals + m, sizeof(char *) * r->count);
+                l->count = m;
+                r->sibling = l->sibling;
+                l->sibling = split_idx;
+                split_k = r->keys[0];
+                if(i > m) {
+                    l = r;
+                    i -= m;
+                }
+            }
+            memmove(l->keys + i + 1, l->keys + i, sizeof(K) * (l->count - i));
+            memmove(l->vals + i + 1, l->vals + i, sizeof(char *) * (l->count - i));
+            l->keys[i] = k;
+            l->vals[i] = v;
+            l->count += 1;
+            return split;
+        }
+
+        // put the separator k with its right child c into n, a full node is split around its middle key first
+        bool insert_inner(inner_t * n, const K & k, uint32_t c, K & split_k, uint32_t & split_idx) {
+            bool split = n->count == INNER_SIZE;
+            if(split) {
+                split_idx = arena.alloc();
+                inner_t * r = arena.template at<inner_t>(split_idx);
+                uint32_t m = INNER_SIZE / 2;
+                split_k = n->keys[m];
+                r->leftmost = n->child[m];
+                r->count = INNER_SIZE - m - 1;
+                memcpy(r->keys, n->keys + m + 1, sizeof(K) * r->count);
+                memcpy(r->child, n->child + m + 1, sizeof(uint32_t) * r->count);
+                n->count = m;
+                r->sibling = n->sibling;
+                n->sibling = split_idx;
+                if(!key_less<Compare>(k, split_k)) n = r;
+            }
+            uint32_t i = inner_rank(n, k);
+            memmove(n->keys + i + 1, n->keys + i, sizeof(K) * (n->count - i));
+            memmove(n->child + i + 1, n->child + i, sizeof(uint32_t) * (n->count - i));
+            n->keys[i] = k;
+            n->child[i] = c;
+            n->count += 1;
+            return split;
+        }
+
+        bool insert_recursive(uint32_t idx, const K & k, char * v, K & split_k, uint32_t & split_idx) {
+            compact_head_t * n = node(idx);
+            if(n->leftmost == 0) return insert_leaf((leaf_t *)n, k, v, split_k, split_idx);
+
+            inner_t * in = (inner_t *)n;
+            K child_k;
+            uint32_t child_idx;
+            if(!insert_recursive(child_at(in, inner_rank(in, k)), k, v, child_k, child_idx)) return false;
+            return insert_inner(in, child_k, child_idx, split_k, split_idx);
+        }
+
+        void print_recursive(uint32_t idx, string prefix) const {
+            compact_head_t * n = node(idx);
+            std::cout << prefix << "[(" << n->count << ") ";
+            if(n->leftmost == 0) {
+                leaf_t * l = (leaf_t *)n;
+                for(uint32_t i = 0; i < l->count; i++) std::cout << "(" << l->keys[i] << ", " << (int64_t)l->vals[i] << ") ";
+                std::cout << "]" << std::endl;
+            } else {
+                inner_t * in = (inner_t *)n;
+                for(uint32_t i = 0; i < in->count; i++) std::cout << in->keys[i] << " ";
+                std::cout << "]" << std::endl;
+                for(uint32_t i = 0; i <= in->count; i++) print_recursive(child_at(in, i), prefix + "    ");
+            }
+        }
+
+    public:
+        compact_t() {
+            arena.header()->root = arena.alloc(); // an empty leaf
+        }
+
+        // the tree of an image made by image() and image_bytes(), at any address
+        compact_t(const char * image, uint64_t bytes) : arena(image, bytes) {}
+
+        bool find(K key, V & val) {
+            leaf_t * l = find_leaf(key);
+            uint32_t i = leaf_rank(l, key);
+            if(i < l->count && key_equal<Compare>(l->keys[i], key)) {
+                val = from_slot<V>(l->vals[i]);
+                return true;
+            }
+            return false;
+        }
+
+        void insert(K key, V val) {
+            K split_k;
+            uint32_t split_idx;
+            uint32_t root = arena.header()->root;
+            if(insert_recursive(root, key, to_slot(val), split_k, split_idx)) {
+                uint32_t idx = arena.alloc();
+                inner_t * r = arena.template at<inner_t>(idx);
+                r->leftmost = root;
+                r->keys[0] = split_k;
+                r->child[0] = split_idx;
+                r->count = 1;
+                arena.header()->root = idx;
+            }
+        }
+
+        bool update(K key, V val) {
+            leaf_t * l = find_leaf(key);
+            uint32_t i = leaf_rank(l, key);
+            if(i < l->count && key_equal<Compare>(l->keys[i], key)) {
+                l->vals[i] = to_slot(val);
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(K key) {
+            leaf_t * l = find_leaf(key);
+            uint32_t i = leaf_rank(l, key);
+            if(i < l->count && key_equal<Compare>(l->keys[i], key)) {
+                memmove(l->keys + i, l->keys + i + 1, sizeof(K) * (l->count - i - 1));
+                memmove(l->vals + i, l->vals + i + 1, sizeof(char *) * (l->count - i - 1));
+                l->count -= 1;
+                return true;
+            }
+            return false;
+        }
+
+        int scan(K start_key, int num, V * vals) {
+            leaf_t * l = find_leaf(start_key);
+            uint32_t i = leaf_rank(l, start_key);
+            int cnt = 0;
+            while(cnt < num) {
+                for(; i < l->count && cnt < num; i++) vals[cnt++] = from_slot<V>(l->vals[i]);
+                if(l->sibling == 0) break;
+                l = arena.template at<leaf_t>(l->sibling);
+                i = 0;
+            }
+            return cnt;
+        }
+
+        // the levels of the tree, 1 for a single leaf
+        int height() const {
+            int h = 1;
+            for(compact_head_t * n = node(arena.header()->root); n->leftmost != 0; n = node(n->leftmost)) h++;
+            return h;
+        }
+
+        const char * image() const {
+            return arena.image();
+        }
+
+        uint64_t image_bytes() const {
+            return arena.bytes();
+        }
+
+        void printAll() {
+            print_recursive(arena.header()->root, string(""));
+        }
+};
+
+typedef compact_t<> compact;
+
+}; // namespace btree
+
+#endif //__BTREE_COMPACT__
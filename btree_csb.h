@@ -0,0 +1,310 @@
+/*  btree_csb.h - the btree with cache-sensitive inner nodes (node groups)
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BTREE_CSB__
+#define __BTREE_CSB__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+
+#include "base.h"
+#include "btree.h"
+
+namespace btree {
+
+// the 16 bytes every node of csb_t starts with
+struct csb_head_t {
+    char * group;   // the children, one after the other, NULL in a leaf
+    uint32_t count; // keys in the node
+    uint32_t leaf;
+};
+
+/*
+    A CSB+-tree: all the children of an inner node are allocated together
+    as a node group, so the node keeps one group pointer and the keys, the
+    i-th child is at group + i * NODE_BYTES. A 256-byte inner node holds 30
+    keys instead of the 14 of btree::Node; leaves hold 15 records.
+
+    The price is paid by the inserts: a split adds a node to the group of
+    its parent, so that group is reallocated and copied (the group of an
+    inner node that splits is cut in two). Nodes move when their group is
+    reallocated, so the leaves are not linked and scans descend from the
+    root like the ones of btree_t. A remove only takes the record out of
+    its leaf, nodes are never merged.
+*/
+template <typename K = _key_t, typename V = _value_t, int NODE_BYTES = PAGESIZE, typename Compare = std::less<K>>
+class csb_t : public tree_base<csb_t<K, V, NODE_BYTES, Compare>, K, V> {
+    public:
+        static constexpr int LEAF_SIZE = (NODE_BYTES - sizeof(csb_head_t)) / (sizeof(K) + sizeof(char *));
+        static constexpr int INNER_SIZE = (NODE_BYTES - sizeof(csb_head_t)) / sizeof(K);
+        static_assert(LEAF_SIZE >= 3, "a node must hold at least 3 records");
+
+        struct leaf_t : csb_head_t {
+            K keys[LEAF_SIZE];
+            char * vals[LEAF_SIZE];
+        };
+
+        struct inner_t : csb_head_t {
+            K keys[INNER_SIZE];
+        };
+        static_assert(sizeof(leaf_t) <= NODE_BYTES && sizeof(inner_t) <= NODE_BYTES, "the nodes fit NODE_BYTES");
+
+    private:
+        // a node buffer: where a split puts its right half before the parent moves it into a group
+        struct alignas(64) node_buf {
+            char bytes[NODE_BYTES];
+        };
+
+        csb_head_t * root;
+
+        static char * alloc_group(uint64_t nodes) {
+            void * g;
+            if(posix_memalign(&g, 64, nodes * NODE_BYTES) != 0) {
+                perror("posix_memalign");
+                exit(-1);
+            }
+            return (char *)g;
+        }
+
+        static inline csb_head_t * child(const csb_head_t * n, uint64_t i) {
+            return (csb_head_t *)(n->group + i * NODE_BYTES);
+        }
+
+        // the number of keys not greater than key (UPPER) or less than key, STEP is the top step of N
+        template <bool UPPER, int STEP>
+        static inline uint32_t rank(const K * keys, uint32_t count, const K & key) {
+            uint32_t i = 0;
+            for(uint32_t step = STEP; step > 0; step >>= 1) {
+                if(i + step <= count && (UPPER ? !key_less<Compare>(key, keys[i + step - 1])
+                                               : key_less<Compare>(keys[i + step - 1], key))) {
+                    i += step;
+                }
+            }
+            return i;
+        }
+
+        static inline uint32_t inner_rank(const csb_head_t * n, const K & key) {
+            return rank<true, top_step(INNER_SIZE)>(((const inner_t *)n)->keys, n->count, key);
+        }
+
+        static inline uint32_t leaf_rank(const csb_head_t * n, const K & key) {
+            return rank<false, top_step(LEAF_SIZE)>(((const leaf_t *)n)->keys, n->count, key);
+        }
+
+        // free the groups below n, not n itself
+        static void free_below(csb_head_t * n) {
+            if(n->leaf) return;
+            for(uint32_t i = 0; i <= n->count; i++) free_below(child(n, i));
+            free(n->group);
+        }
+
+        leaf_t * find_leaf(const K & key) const {
+            csb_head_t * n = root;
+            while(!n->leaf) n = child(n, inner_rank(n, key));
+            return (leaf_t *)n;
+        }
+
+        // a split leaves the upper half in right and returns true
+        static bool insert_leaf(leaf_t * l, const K & k, char * v, K & split_k, node_buf & right) {
+            uint32_t i = leaf_rank(l, k);
+            if(i < l->count && key_equal<Compare>(l->keys[i], k)) {
+                l->vals[i] = v;
+                return false;
+            }
+
+            bool split = l->count == LEAF_SIZE;
+            if(split) {
+                leaf_t * r = (leaf_t *)right.bytes;
+                uint32_t m = LEAF_SIZE / 2;
+                r->group = NULL;
+                r->leaf = 1;
+                r->count = LEAF_SIZE - m;
+                memcpy(r->keys, l->keys + m, sizeof(K) * r->count);
+                memcpy(r->vals, l->vals + m, sizeof(char *) * r->count);
+                l->count = m;
+                split_k = r->keys[0];
+                if(i > m) {
+                    l = r;
+                    i -= m;
+                }
+            }
+            memmove(l->keys + i + 1, l->keys + i, sizeof(K) * (l->count - i));
+            memmove(l->vals + i + 1, l->vals + i, sizeof(char *) * (l->count - i));
+            l->keys[i] = k;
+            l->vals[i] = v;
+            l->count += 1;
+            return split;
+        }
+
+        /*
+            Child i of n has split into itself and sep, node: put sep at key
+            position i and node right after child i. The group grows by one
+            node, or n splits: the keys and the children are cut around the
+            middle key and the right part goes to right with a group of its
+            own.
+        */
+        static bool insert_inner(inner_t * n, uint32_t i, const K & sep, const node_buf & node, K & split_k, node_buf & right) {
+            uint32_t total = n->count + 1; // keys after the insert, total + 1 children
+            K keys[INNER_SIZE + 1];
+            memcpy(keys, n->keys, sizeof(K) * i);
+            keys[i] = sep;
+            memcpy(keys + i + 1, n->keys + i, sizeof(K) * (n->count - i));
+
+            // the j-th child after the insert
+            char * old_group = n->group;
+            auto child_at = [&](uint32_t j) -> const char * {
+                if(j <= i) return old_group + (uint64_t)j * NODE_BYTES;
+                if(j == i + 1) return node.bytes;
+                return old_group + (uint64_t)(j - 1) * NODE_BYTES;
+            };
+            // a new group with the children [from, to)
+            auto regroup = [&](uint32_t from, uint32_t to) {
+                char * g = alloc_group(to - from);
+                if(from <= i + 1 && i + 1 < to) { // three runs: before the new node, it, after it
+                    memcpy(g, child_at(from), (uint64_t)(i + 1 - from) * NODE_BYTES);
+                    memcpy(g + (uint64_t)(i + 1 - from) * NODE_BYTES, node.bytes, NODE_BYTES);
+                    memcpy(g + (uint64_t)(i + 2 - from) * NODE_BYTES, child_at(i + 2), (uint64_t)(to - i - 2) * NODE_BYTES);
+                } else { // the children of one side are contiguous in the old group
+                    memcpy(g, child_at(from), (uint64_t)(to - from) * NODE_BYTES);
+                }
+                return g;
+            };
+
+            if(total <= INNER_SIZE) {
+                n->group = regroup(0, total + 1);
+                memcpy(n->keys, keys, sizeof(K) * total);
+                n->count = total;
+                free(old_group);
+                return false;
+            }
+
+            uint32_t m = total / 2;
+            inner_t * r = (inner_t *)right.bytes;
+            r->leaf = 0;
+            r->count = total - m - 1;
+            memcpy(r->keys, keys + m + 1, sizeof(K) * r->count);
+            r->group = regroup(m + 1, total + 1);
+            n->group = regroup(0, m + 1);
+            n->count = m;
+            memcpy(n->keys, keys, sizeof(K) * m);
+            split_k = keys[m];
+            free(old_group);
+            return true;
+        }
+
+        static bool insert_recursive(csb_head_t * n, const K & k, char * v, K & split_k, node_buf & right) {
+            if(n->leaf) return insert_leaf((leaf_t *)n, k, v, split_k, right);
+
+            uint32_t i = inner_rank(n, k);
+            K child_k;
+            node_buf child_right;
+            if(!insert_recursive(child(n, i), k, v, child_k, child_right)) return false;
+            return insert_inner((inner_t *)n, i, child_k, child_right, split_k, right);
+        }
+
+        static void scan_recursive(csb_head_t * n, const K & start, int num, V * vals, int & cnt) {
+            if(n->leaf) {
+                leaf_t * l = (leaf_t *)n;
+                for(uint32_t i = leaf_rank(n, start); i < l->count && cnt < num; i++) {
+                    vals[cnt++] = from_slot<V>(l->vals[i]);
+                }
+            } else {
+                for(uint32_t i = inner_rank(n, start); i <= n->count && cnt < num; i++) {
+                    scan_recursive(child(n, i), start, num, vals, cnt);
+                }
+            }
+        }
+
+        static void print_recursive(csb_head_t * n, string prefix) {
+            std::cout << prefix << "[(" << n->count << ") ";
+            if(n->leaf) {
+                leaf_t * l = (leaf_t *)n;
+                for(uint32_t i = 0; i < l->count; i++) std::cout << "(" << l->keys[i] << ", " << (int64_t)l->vals[i] << ") ";
+                std::cout << "]" << std::endl;
+            } else {
+                for(uint32_t i = 0; i < n->count; i++) std::cout << ((inner_t *)n)->keys[i] << " ";
+                std::cout << "]" << std::endl;
+                for(uint32_t i = 0; i <= n->count; i++) print_recursive(child(n, i), prefix + "    ");
+            }
+        }
+
+    public:
+        csb_t() {
+            root = (csb_head_t *)alloc_group(1);
+            root->group = NULL;
+            root->count = 0;
+            root->leaf = 1;
+        }
+
+        ~csb_t() {
+            free_below(root);
+            free(root);
+        }
+
+        bool find(K key, V & val) {
+            leaf_t * l = find_leaf(key);
+            uint32_t i = leaf_rank(l, key);
+            if(i < l->count && key_equal<Compare>(l->keys[i], key)) {
+                val = from_slot<V>(l->vals[i]);
+                return true;
+            }
+            return false;
+        }
+
+        void insert(K key, V val) {
+            K split_k;
+            node_buf right;
+            if(insert_recursive(root, key, to_slot(val), split_k, right)) { // the old root and right are the group of the new one
+                char * g = alloc_group(2);
+                memcpy(g, root, NODE_BYTES);
+                memcpy(g + NODE_BYTES, right.bytes, NODE_BYTES);
+                inner_t * r = (inner_t *)root; // reused in place
+                r->group = g;
+                r->leaf = 0;
+                r->count = 1;
+                r->keys[0] = split_k;
+            }
+        }
+
+        bool update(K key, V val) {
+            leaf_t * l = find_leaf(key);
+            uint32_t i = leaf_rank(l, key);
+            if(i < l->count && key_equal<Compare>(l->keys[i], key)) {
+                l->vals[i] = to_slot(val);
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(K key) {
+            leaf_t * l = find_leaf(key);
+            uint32_t i = leaf_rank(l, key);
+            if(i < l->count && key_equal<Compare>(l->keys[i], key)) {
+                memmove(l->keys + i, l->keys + i + 1, sizeof(K) * (l->count - i - 1));
+                memmove(l->vals + i, l->vals + i + 1, sizeof(char *) * (l->count - i - 1));
+                l->count -= 1;
+                return true;
+            }
+            return false;
+        }
+
+        int scan(K start_key, int num, V * vals) {
+            int cnt = 0;
+            if(num > 0) scan_recursive(root, start_key, num, vals, cnt);
+            return cnt;
+        }
+
+        void printAll() {
+            print_recursive(root, string(""));
+        }
+};
+
+typedef csb_t<> csb;
+
+}; // namespace btree
+
+#endif //__BTREE_CSB__
@@ -0,0 +1,855 @@
+/*  btree_disk.h - a disk-resident btree on top of a bounded buffer pool
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BTREE_DISK__
+#define __BTREE_DISK__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <cstdio>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "base.h"
+#include "uring.h"
+
+namespace btree_disk {
+using std::string;
+
+/*
+    The nodes are 4 KB pages with the layout of btree::Node, read and written
+    with pread/pwrite. Only a fixed number of pages are kept in memory, a CLOCK
+    sweep picks the frame to reuse on a miss.
+
+    Child references are swips: a resident child is referenced by the address
+    of its frame (swizzled), a child on disk by its page id shifted left with
+    the low bit set. A hit is therefore a plain pointer dereference, there is
+    no page table. Every page has exactly one parent, so a frame remembers it
+    and eviction turns the swip in the parent back into a page id. A frame is
+    only evicted when none of its children are resident, i.e. the pool is
+    drained from the leaves up, and the root is never evicted.
+
+    Pages are written back on eviction and on sync()/close, the file is not
+    crash consistent. Page 0 holds the meta data.
+
+    Reads can also go through io_uring: find_overlapped() overlaps the misses
+    of many lookups (find_batch() of tree_base goes through it in batches of
+    IO_DEPTH keys) and scan() reads the next leaves ahead. A page whose read is
+    in flight is already swizzled into its parent, its frame is marked loading
+    and pinned until the completion is reaped.
+*/
+const int PAGESIZE = 4096;
+const int NODE_SIZE = (PAGESIZE - 32) / 16;
+const uint64_t MAGIC = 0x4b5349442d455254ULL;
+const unsigned IO_DEPTH = 64; // reads in flight at most
+
+typedef uint64_t swip_t;
+
+static inline bool is_swizzled(swip_t s) {
+    return (s & 1) == 0;
+}
+
+static inline swip_t pid_swip(uint64_t pid) {
+    return (pid << 1) | 1;
+}
+
+static inline uint64_t swip_pid(swip_t s) {
+    return s >> 1;
+}
+
+struct Record {
+    _key_t key;
+    swip_t val; // value in the leaf nodes, swip of the child in the inner nodes
+};
+
+// the image of a page in the file; not btree::node_t, whose children are pointers and whose splits allocate with new
+class Node {
+    public:
+        swip_t leftmost;   // 0 means the node is a leaf node
+        uint64_t sibling;  // page id of the right sibling, 0 means none
+        uint64_t count;
+        char dummy[8];     // the total meta data is 32 bytes
+        Record recs[NODE_SIZE];
+
+        // the first record whose key is larger than key, the nodes are too wide for a linear search
+        uint64_t upper_bound(_key_t key) {
+            uint64_t l = 0, r = count;
+            while(l < r) {
+                uint64_t mid = (l + r) / 2;
+                if(recs[mid].key <= key) l = mid + 1;
+                else r = mid;
+            }
+            return l;
+        }
+
+        uint64_t lower_bound(_key_t key) {
+            uint64_t l = 0, r = count;
+            while(l < r) {
+                uint64_t mid = (l + r) / 2;
+                if(recs[mid].key < key) l = mid + 1;
+                else r = mid;
+            }
+            return l;
+        }
+
+        // the idx-th child, the 0-th is leftmost
+        inline swip_t & child_ref(uint64_t idx) {
+            return idx == 0 ? leftmost : recs[idx - 1].val;
+        }
+
+        void insert(_key_t k, swip_t v) {
+            uint64_t i = upper_bound(k);
+            memmove(&recs[i + 1], &recs[i], sizeof(Record) * (count - i));
+            recs[i] = {k, v};
+            count += 1;
+        }
+
+        bool update(_key_t k, swip_t v) {
+            uint64_t i = lower_bound(k);
+            if(i < count && recs[i].key == k) {
+                recs[i].val = v;
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(_key_t k) {
+            uint64_t i = lower_bound(k);
+            if(i < count && recs[i].key == k) {
+                memmove(&recs[i], &recs[i + 1], sizeof(Record) * (count - i - 1));
+                count -= 1;
+                return true;
+            }
+            return false;
+        }
+};
+
+static_assert(sizeof(Node) == PAGESIZE, "a node must fill exactly one page");
+
+struct meta_t { // the head of page 0
+    uint64_t magic;
+    uint64_t root;      // page id of the root
+    uint64_t next_pid;  // the file holds the pages [0, next_pid)
+    uint64_t free_head; // freed pages are chained by their first 8 bytes
+};
+
+struct frame_t {
+    Node * page;
+    uint64_t pid;      // 0 means the frame is free
+    frame_t * parent;  // the frame holding the swip of this one, NULL for the root
+    uint32_t pins;     // a pinned frame is never evicted
+    uint32_t swizzled; // number of resident children
+    bool dirty;
+    bool ref;          // CLOCK reference bit
+    bool loading;      // an asynchronous read into the frame is in flight
+};
+
+struct pool_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t evictions;
+    uint64_t async_reads; // the part of reads issued through io_uring
+};
+
+class buffer_pool {
+    private:
+        int fd;
+        uint64_t capacity;
+        Node * pages;
+        Node * scratch;   // a page sized I/O buffer
+        frame_t * frames;
+        std::vector<frame_t *> free_frames;
+        uint64_t hand;    // CLOCK hand
+        meta_t meta;
+        pool_stats_t stats;
+        uring::ring ring;
+        unsigned inflight;
+
+    public:
+        // capacity is the number of pages kept in memory, direct bypasses the page cache if the file system allows
+        buffer_pool(const char * path, uint64_t cap, bool direct) : capacity(cap), hand(0), stats({0, 0, 0, 0}), ring(IO_DEPTH), inflight(0) {
+            fd = -1;
+            if(direct) fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+            if(fd < 0) fd = open(path, O_RDWR | O_CREAT, 0644);
+            if(fd < 0) {
+                perror("open");
+                exit(-1);
+            }
+
+            if(posix_memalign((void **)&pages, PAGESIZE, (capacity + 1) * PAGESIZE) != 0)
+                exit(-1);
+            scratch = pages + capacity;
+            frames = new frame_t[capacity];
+            for(uint64_t i = 0; i < capacity; i++) {
+                frames[i] = {&pages[i], 0, NULL, 0, 0, false, false, false};
+                free_frames.push_back(&frames[capacity - 1 - i]);
+            }
+
+            struct stat st;
+            fstat(fd, &st);
+            if(st.st_size >= PAGESIZE) {
+                read_page(0, scratch);
+                memcpy(&meta, scratch, sizeof(meta_t));
+                if(meta.magic != MAGIC) {
+                    printf("%s is not a btree file\n", path);
+                    exit(-1);
+                }
+            } else {
+                meta = {MAGIC, 0, 1, 0};
+            }
+        }
+
+        ~buffer_pool() {
+            flush();
+            close(fd);
+            free(pages);
+            delete [] frames;
+        }
+
+        meta_t & get_meta() {
+            return meta;
+        }
+
+        pool_stats_t get_stats() {
+            return stats;
+        }
+
+        uint64_t get_capacity() {
+            return capacity;
+        }
+
+        // return the frame of the page referenced by swip, which lives in the page of parent
+        frame_t * fix(swip_t & swip, frame_t * parent) {
+            if(is_swizzled(swip)) {
+                frame_t * f = (frame_t *)swip;
+                f->ref = true;
+                if(f->loading) wait_for(f);
+                return f;
+            }
+
+            parent->pins += 1; // the swip must stay where it is while a frame is freed
+            frame_t * f = get_frame();
+            parent->pins -= 1;
+
+            uint64_t pid = swip_pid(swip);
+            read_page(pid, f->page);
+            *f = {f->page, pid, parent, 0, 0, false, true, false};
+            swip = (swip_t)f;
+            parent->swizzled += 1;
+            return f;
+        }
+
+        // like fix, but a miss only queues the read: the frame comes back loading
+        // and stays pinned until complete() reaps it. Without io_uring it is fix.
+        frame_t * fix_async(swip_t & swip, frame_t * parent) {
+            if(is_swizzled(swip) || !ring.ok() || inflight == ring.depth()) return fix(swip, parent);
+
+            parent->pins += 1;
+            frame_t * f = get_frame();
+            parent->pins -= 1;
+
+            uint64_t pid = swip_pid(swip);
+            if(!ring.read(fd, f->page, PAGESIZE, pid * PAGESIZE, (uint64_t)f)) {
+                complete(false); // the submission queue is full of unsubmitted reads
+                ring.read(fd, f->page, PAGESIZE, pid * PAGESIZE, (uint64_t)f);
+            }
+            *f = {f->page, pid, parent, 1, 0, false, true, true};
+            swip = (swip_t)f;
+            parent->swizzled += 1;
+
+            inflight += 1;
+            stats.reads += 1;
+            stats.async_reads += 1;
+            return f;
+        }
+
+        bool has_async() {
+            return ring.ok();
+        }
+
+        // true if fix_async can queue another read
+        bool can_issue() {
+            return ring.ok() && inflight < ring.depth();
+        }
+
+        // submit the queued reads, wait for one completion if wait is set, finish the completed
+        // reads; return their number
+        unsigned complete(bool wait) {
+            if(!ring.ok()) return 0;
+
+            ring.submit(wait && inflight > 0 ? 1 : 0);
+            return ring.reap([&](uint64_t data, int res) {
+                frame_t * f = (frame_t *)data;
+                if(res != PAGESIZE) {
+                    printf("io_uring read of page %lu failed: %s\n", f->pid, res < 0 ? strerror(-res) : "short read");
+                    exit(-1);
+                }
+                f->loading = false;
+                f->pins -= 1;
+                inflight -= 1;
+            });
+        }
+
+        void wait_for(frame_t * f) {
+            while(f->loading) complete(true);
+        }
+
+        // wait for every read in flight
+        void drain() {
+            while(inflight > 0) complete(true);
+        }
+
+        // load the root page, it stays pinned
+        frame_t * fix_root() {
+            frame_t * f = get_frame();
+            if(meta.root == 0) {
+                memset((void *)f->page, 0, PAGESIZE);
+                *f = {f->page, alloc_pid(), NULL, 1, 0, true, true, false};
+                meta.root = f->pid;
+            } else {
+                read_page(meta.root, f->page);
+                *f = {f->page, meta.root, NULL, 1, 0, false, true, false};
+            }
+            return f;
+        }
+
+        // a zeroed page, returned pinned: the caller unpins it once its swip is installed
+        frame_t * new_page(frame_t * parent) {
+            frame_t * f = get_frame();
+            memset((void *)f->page, 0, PAGESIZE);
+            *f = {f->page, alloc_pid(), parent, 1, 0, true, true, false};
+            return f;
+        }
+
+        // the caller has removed the swip of f from its parent
+        void free_page(frame_t * f) {
+            memset((void *)scratch, 0, PAGESIZE);
+            memcpy(scratch, &meta.free_head, sizeof(uint64_t));
+            write_raw(f->pid, scratch);
+            meta.free_head = f->pid;
+
+            f->pid = 0;
+            f->parent = NULL;
+            f->pins = f->swizzled = 0;
+            f->dirty = false;
+            free_frames.push_back(f);
+        }
+
+        // recompute the resident children of an inner node after records moved into it
+        void adopt(frame_t * f) {
+            Node * n = f->page;
+            uint32_t cnt = 0;
+            for(uint64_t i = 0; i <= n->count; i++) {
+                swip_t s = n->child_ref(i);
+                if(is_swizzled(s)) {
+                    ((frame_t *)s)->parent = f;
+                    cnt += 1;
+                }
+            }
+            f->swizzled = cnt;
+        }
+
+        // write back every dirty page and the meta data
+        void flush() {
+            for(uint64_t i = 0; i < capacity; i++) {
+                if(frames[i].pid != 0 && frames[i].dirty)
+                    write_page(&frames[i]);
+            }
+            memset((void *)scratch, 0, PAGESIZE);
+            memcpy(scratch, &meta, sizeof(meta_t));
+            write_raw(0, scratch);
+        }
+
+        void sync() {
+            flush();
+            fsync(fd);
+        }
+
+    private:
+        frame_t * get_frame() {
+            if(!free_frames.empty()) {
+                frame_t * f = free_frames.back();
+                free_frames.pop_back();
+                return f;
+            }
+
+            // CLOCK: the first round may only clear the reference bits
+            for(uint64_t i = 0; i < 3 * capacity; i++) {
+                frame_t * f = &frames[hand];
+                hand = (hand + 1) % capacity;
+
+                if(f->pins != 0 || f->swizzled != 0) continue;
+                if(f->ref) {
+                    f->ref = false;
+                    continue;
+                }
+                evict(f);
+                return f;
+            }
+            printf("the buffer pool is too small\n");
+            exit(-1);
+        }
+
+        void evict(frame_t * f) {
+            if(f->dirty) write_page(f);
+
+            Node * p = f->parent->page;
+            for(uint64_t i = 0; i <= p->count; i++) {
+                if(p->child_ref(i) == (swip_t)f) {
+                    p->child_ref(i) = pid_swip(f->pid);
+                    break;
+                }
+            }
+            f->parent->swizzled -= 1;
+            f->pid = 0;
+            stats.evictions += 1;
+        }
+
+        uint64_t alloc_pid() {
+            if(meta.free_head != 0) {
+                uint64_t pid = meta.free_head;
+                read_page(pid, scratch);
+                memcpy(&meta.free_head, scratch, sizeof(uint64_t));
+                return pid;
+            }
+            return meta.next_pid++;
+        }
+
+        void read_page(uint64_t pid, Node * dst) {
+            if(pread(fd, dst, PAGESIZE, pid * PAGESIZE) != PAGESIZE) {
+                perror("pread");
+                exit(-1);
+            }
+            stats.reads += 1;
+        }
+
+        void write_raw(uint64_t pid, Node * src) {
+            if(pwrite(fd, src, PAGESIZE, pid * PAGESIZE) != PAGESIZE) {
+                perror("pwrite");
+                exit(-1);
+            }
+            stats.writes += 1;
+        }
+
+        // the page on disk references its children by page id
+        void write_page(frame_t * f) {
+            memcpy(scratch, f->page, PAGESIZE);
+            if(scratch->leftmost != 0) {
+                for(uint64_t i = 0; i <= scratch->count; i++) {
+                    swip_t & s = scratch->child_ref(i);
+                    if(is_swizzled(s)) s = pid_swip(((frame_t *)s)->pid);
+                }
+            }
+            write_raw(f->pid, scratch);
+            f->dirty = false;
+        }
+};
+
+class btree : public tree_base<btree, _key_t, _value_t> {
+    private:
+        buffer_pool pool;
+        frame_t * root;
+
+    public:
+        // pool_pages pages of 4 KB are kept in memory
+        btree(const char * path, uint64_t pool_pages = 16384, bool direct = false) : pool(path, pool_pages, direct) {
+            root = pool.fix_root();
+        }
+
+        ~btree() {} // the pool writes back the dirty pages
+
+        void sync() {
+            pool.sync();
+        }
+
+        pool_stats_t get_stats() {
+            return pool.get_stats();
+        }
+
+        bool find(_key_t key, _value_t &val) {
+            frame_t * cur = root;
+            while(cur->page->leftmost != 0) {
+                Node * n = cur->page;
+                cur = pool.fix(n->child_ref(n->upper_bound(key)), cur);
+            }
+
+            Node * leaf = cur->page;
+            uint64_t i = leaf->lower_bound(key);
+            if(i < leaf->count && leaf->recs[i].key == key) {
+                val = (_value_t)leaf->recs[i].val;
+                return true;
+            }
+            val = 0;
+            return false;
+        }
+
+        void insert(_key_t key, _value_t val) {
+            _key_t split_k;
+            frame_t * split_f;
+            bool splitIf = insert_recursive(root, key, val, split_k, split_f);
+
+            if(splitIf) {
+                frame_t * new_root = pool.new_page(NULL);
+                Node * n = new_root->page;
+                n->leftmost = (swip_t)root;
+                n->recs[0] = {split_k, (swip_t)split_f};
+                n->count = 1;
+                pool.adopt(new_root);
+
+                root->pins -= 1;
+                split_f->pins -= 1;
+                root = new_root; // stays pinned
+                pool.get_meta().root = root->pid;
+            }
+        }
+
+        bool update(_key_t key, _value_t value) {
+            frame_t * cur = root;
+            while(cur->page->leftmost != 0) {
+                Node * n = cur->page;
+                cur = pool.fix(n->child_ref(n->upper_bound(key)), cur);
+            }
+
+            if(cur->page->update(key, (swip_t)value)) {
+                cur->dirty = true;
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(_key_t key) {
+            Node * r = root->page;
+            if(r->leftmost == 0) {
+                if(!r->remove(key)) return false;
+
+                root->dirty = true;
+                return true;
+            }
+            else {
+                frame_t * child = pool.fix(r->child_ref(r->upper_bound(key)), root);
+
+                bool removed = false;
+                bool shouldMrg = remove_recursive(child, key, removed);
+
+                if(shouldMrg) {
+                    merge_child(root, key);
+
+                    if(r->count == 0) { // the root is empty
+                        frame_t * old_root = root;
+                        root = pool.fix(r->leftmost, old_root);
+                        root->parent = NULL;
+                        root->pins += 1;
+                        pool.get_meta().root = root->pid;
+                        pool.free_page(old_root);
+                    }
+                }
+
+                return removed;
+            }
+        }
+
+        // look up num keys at once, found[i] tells if keys[i] is in the tree. Every lookup is
+        // a small state machine that parks on a page while its read is in flight, so the
+        // misses of the whole batch overlap on the device. num must stay well below the
+        // pool size, each lookup pins a page.
+        int find_overlapped(const _key_t * keys, _value_t * vals, bool * found, int num) {
+            std::vector<frame_t *> cur(num, root);
+            std::vector<int> ready, parked, next;
+            for(int i = 0; i < num; i++) ready.push_back(i);
+            root->pins += num; // a lookup that is not running pins its page
+
+            int done = 0, hits = 0;
+            while(done < num) {
+                next.clear(); // the lookups that found the queue full
+                for(int i : ready) {
+                    frame_t * f = cur[i];
+                    f->pins -= 1;
+                    while(true) {
+                        if(f->loading) {
+                            f->pins += 1;
+                            parked.push_back(i);
+                            break;
+                        }
+                        Node * n = f->page;
+                        if(n->leftmost == 0) {
+                            uint64_t pos = n->lower_bound(keys[i]);
+                            found[i] = pos < n->count && n->recs[pos].key == keys[i];
+                            vals[i] = found[i] ? (_value_t)n->recs[pos].val : 0;
+                            hits += found[i];
+                            done += 1;
+                            break;
+                        }
+                        swip_t & s = n->child_ref(n->upper_bound(keys[i]));
+                        if(!is_swizzled(s) && pool.has_async() && !pool.can_issue()) {
+                            f->pins += 1;
+                            next.push_back(i);
+                            break;
+                        }
+                        f = pool.fix_async(s, f);
+                    }
+                    cur[i] = f;
+                }
+
+                ready.swap(next);
+                size_t blocked = ready.size();
+                pool.complete(false);
+                unpark(cur, parked, ready);
+                if(ready.size() == blocked && done < num) { // nothing to run until a read finishes
+                    pool.complete(true);
+                    unpark(cur, parked, ready);
+                }
+            }
+            return hits;
+        }
+
+        // the form of tree_base, the keys are looked up IO_DEPTH at a time by find_overlapped
+        uint64_t find_batch(const _key_t * keys, uint64_t num, _value_t * vals) {
+            bool found[IO_DEPTH];
+            uint64_t hits = 0;
+            for(uint64_t i = 0; i < num; i += IO_DEPTH) {
+                hits += find_overlapped(keys + i, vals + i, found, std::min<uint64_t>(IO_DEPTH, num - i));
+            }
+            return hits;
+        }
+
+        // call f(key, value) on up to num records with key >= start in key order, return how
+        // many were visited. While a leaf is scanned, the next readahead leaves are read
+        // asynchronously: they are the next children of its parent, i.e. the pages sibling
+        // would lead to, but reached through swips so they can be swizzled.
+        template <typename F>
+        uint64_t scan(_key_t start, uint64_t num, F f, unsigned readahead = 8) {
+            std::vector<std::pair<frame_t *, uint64_t>> path; // pinned inner frames and the child taken
+            frame_t * cur = root;
+            uint64_t cnt = 0;
+            if(num == 0) return 0;
+
+            while(cur->page->leftmost != 0) {
+                Node * n = cur->page;
+                uint64_t idx = n->upper_bound(start);
+                cur->pins += 1;
+                path.push_back({cur, idx});
+                cur = pool.fix(n->child_ref(idx), cur);
+            }
+
+            uint64_t i = cur->page->lower_bound(start);
+            while(true) {
+                cur->pins += 1;
+                if(!path.empty() && readahead > 0) {
+                    frame_t * parent = path.back().first;
+                    Node * p = parent->page;
+                    uint64_t last = std::min(path.back().second + readahead, (uint64_t)p->count);
+                    for(uint64_t j = path.back().second + 1; j <= last && pool.can_issue(); j++) {
+                        if(!is_swizzled(p->child_ref(j))) pool.fix_async(p->child_ref(j), parent);
+                    }
+                    pool.complete(false);
+                }
+
+                Node * leaf = cur->page;
+                for(; i < leaf->count && cnt < num; i++, cnt++) {
+                    f(leaf->recs[i].key, (_value_t)leaf->recs[i].val);
+                }
+                cur->pins -= 1;
+                if(cnt == num) break;
+
+                // move to the next leaf
+                while(!path.empty() && path.back().second == path.back().first->page->count) {
+                    path.back().first->pins -= 1;
+                    path.pop_back();
+                }
+                if(path.empty()) break;
+
+                path.back().second += 1;
+                cur = pool.fix(path.back().first->page->child_ref(path.back().second), path.back().first);
+                while(cur->page->leftmost != 0) {
+                    cur->pins += 1;
+                    path.push_back({cur, 0});
+                    cur = pool.fix(cur->page->child_ref(0), cur);
+                }
+                i = 0;
+            }
+
+            for(auto & p : path) p.first->pins -= 1;
+            pool.drain();
+            return cnt;
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            int cnt = 0;
+            scan(start_key, num < 0 ? 0 : num, [&](_key_t, _value_t v) { vals[cnt++] = v; });
+            return cnt;
+        }
+
+        void printAll() {
+            print(root, string(""));
+        }
+
+    private:
+        void unpark(std::vector<frame_t *> & cur, std::vector<int> & parked, std::vector<int> & ready) {
+            size_t j = 0;
+            for(int i : parked) {
+                if(cur[i]->loading) parked[j++] = i;
+                else ready.push_back(i);
+            }
+            parked.resize(j);
+        }
+
+        bool store(frame_t * f, _key_t k, swip_t v, _key_t & split_k, frame_t * & split_f) {
+            Node * n = f->page;
+            f->dirty = true;
+
+            if(n->count == NODE_SIZE) {
+                split_f = pool.new_page(f->parent);
+                Node * split_node = split_f->page;
+
+                uint64_t m = n->count / 2;
+                split_k = n->recs[m].key;
+                if(n->leftmost == 0) {
+                    split_node->count = n->count - m;
+                    memcpy(&(split_node->recs[0]), &(n->recs[m]), sizeof(Record) * (split_node->count));
+                } else {
+                    split_node->leftmost = n->recs[m].val;
+
+                    split_node->count = n->count - m - 1;
+                    memcpy(&(split_node->recs[0]), &(n->recs[m + 1]), sizeof(Record) * (split_node->count));
+                }
+                n->count = m;
+
+                split_node->sibling = n->sibling;
+                n->sibling = split_f->pid;
+
+                if(split_k > k) {
+                    n->insert(k, v);
+                } else {
+                    split_node->insert(k, v);
+                }
+
+                if(n->leftmost != 0) { // resident children may have moved
+                    pool.adopt(f);
+                    pool.adopt(split_f);
+                }
+                return true;
+            } else {
+                n->insert(k, v);
+                if(n->leftmost != 0 && is_swizzled(v)) {
+                    ((frame_t *)v)->parent = f;
+                    f->swizzled += 1;
+                }
+                return false;
+            }
+        }
+
+        bool insert_recursive(frame_t * f, _key_t k, _value_t v, _key_t & split_k, frame_t * & split_f) {
+            bool splitIf = false;
+            f->pins += 1; // a split allocates pages, which may evict
+            Node * n = f->page;
+            if(n->leftmost == 0) {
+                if(n->update(k, (swip_t)v)) f->dirty = true; // the key is in the tree, its value is replaced
+                else splitIf = store(f, k, (swip_t)v, split_k, split_f);
+            } else {
+                frame_t * child = pool.fix(n->child_ref(n->upper_bound(k)), f);
+
+                _key_t split_k_child;
+                frame_t * split_f_child;
+                if(insert_recursive(child, k, v, split_k_child, split_f_child)) {
+                    splitIf = store(f, split_k_child, (swip_t)split_f_child, split_k, split_f);
+                    split_f_child->pins -= 1;
+                }
+            }
+            f->pins -= 1;
+            return splitIf;
+        }
+
+        static void merge(frame_t * left, frame_t * right, _key_t merge_key) {
+            Node * l = left->page, * r = right->page;
+            if(l->leftmost != 0) {
+                l->recs[l->count++] = {merge_key, r->leftmost};
+            }
+            memcpy(&(l->recs[l->count]), &(r->recs[0]), sizeof(Record) * r->count);
+            l->count += r->count;
+            l->sibling = r->sibling;
+            left->dirty = true;
+        }
+
+        // merge the child of f on the path of k with one of its siblings, if they fit in one page
+        void merge_child(frame_t * f, _key_t k) {
+            Node * n = f->page;
+            uint64_t pos = n->upper_bound(k);
+            frame_t * child = (frame_t *)n->child_ref(pos); // resident, we just came from it
+            child->pins += 1;
+
+            if(pos > 0) {
+                frame_t * leftsib = pool.fix(n->child_ref(pos - 1), f);
+                if(child->page->count + leftsib->page->count < NODE_SIZE) {
+                    _key_t merge_key = n->recs[pos - 1].key;
+                    n->remove(merge_key);
+                    f->swizzled -= 1;
+                    f->dirty = true;
+                    merge(leftsib, child, merge_key);
+                    if(leftsib->page->leftmost != 0) pool.adopt(leftsib);
+                    pool.free_page(child);
+                    return;
+                }
+            }
+            if(pos < n->count) {
+                frame_t * rightsib = pool.fix(n->child_ref(pos + 1), f);
+                if(child->page->count + rightsib->page->count < NODE_SIZE) {
+                    _key_t merge_key = n->recs[pos].key;
+                    n->remove(merge_key);
+                    f->swizzled -= 1;
+                    f->dirty = true;
+                    merge(child, rightsib, merge_key);
+                    if(child->page->leftmost != 0) pool.adopt(child);
+                    pool.free_page(rightsib);
+                }
+            }
+            child->pins -= 1;
+        }
+
+        bool remove_recursive(frame_t * f, _key_t k, bool & removed) {
+            bool shouldMrg = false;
+            f->pins += 1;
+            Node * n = f->page;
+            if(n->leftmost == 0) {
+                removed = n->remove(k);
+                if(removed) f->dirty = true;
+                shouldMrg = n->count <= NODE_SIZE / 3;
+            }
+            else {
+                frame_t * child = pool.fix(n->child_ref(n->upper_bound(k)), f);
+
+                if(remove_recursive(child, k, removed)) {
+                    merge_child(f, k);
+                    shouldMrg = n->count <= NODE_SIZE / 3;
+                }
+            }
+            f->pins -= 1;
+            return shouldMrg;
+        }
+
+        void print(frame_t * f, string prefix) {
+            f->pins += 1;
+            Node * n = f->page;
+            printf("%s[(%lu) ", prefix.c_str(), n->count);
+            for(uint64_t i = 0; i < n->count; i++) {
+                printf("(%ld, %ld) ", n->recs[i].key, (int64_t)n->recs[i].val);
+            }
+            printf("]\n");
+
+            if(n->leftmost != 0) {
+                for(uint64_t i = 0; i <= n->count; i++) {
+                    print(pool.fix(n->child_ref(i), f), prefix + "    ");
+                }
+            }
+            f->pins -= 1;
+        }
+}; // class btree
+
+}; // namespace btree_disk
+
+#endif
@@ -0,0 +1,415 @@
+/*  btree_packed.h - the btree with compressed leaves
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BTREE_PACKED__
+#define __BTREE_PACKED__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+#include <type_traits>
+
+#include "btree.h"
+
+namespace btree {
+
+/*
+    A leaf that stores its smallest key once and every key as the offset
+    from it, 2, 4 or 8 bytes wide as the key range of the leaf needs; the
+    width is chosen per leaf when it is packed. With 256-byte nodes a leaf
+    holds 22 keys with 2-byte offsets, 18 with 4-byte ones and 14 (the
+    normal node) with 8-byte ones:
+
+        leftmost_ptr (NULL), sibling_ptr, base, count, width   32 bytes
+        offsets[capacity(width)], padded to 8 bytes
+        values[capacity(width)]
+
+    The search is a binary search on the packed offsets, the key is turned
+    into an offset once. A key that fits the width and is not below the
+    base goes in place, any other one repacks the leaf (and splits it when
+    the new width holds fewer records than it has).
+*/
+
+// the records a leaf of bytes payload bytes holds with offsets of w bytes
+constexpr int packed_capacity(int bytes, int w) {
+    int c = bytes / (w + 8);
+    while(((c * w + 7) & ~7) + 8 * c > bytes) c--;
+    return c;
+}
+
+template <typename K, int NODE_BYTES>
+class packed_leaf_t {
+    public:
+        static_assert(std::is_integral<K>::value && sizeof(K) <= 8, "packed leaves take integer keys");
+
+        static constexpr int PAYLOAD = NODE_BYTES - 32;
+        static constexpr int MAX_SIZE = packed_capacity(PAYLOAD, 2);
+
+        char * leftmost_ptr; // always NULL, at the place of leftmost_ptr of the inner nodes
+        char * sibling_ptr;
+        K base;              // the smallest key, when the leaf was packed
+        uint16_t count;
+        uint8_t width;       // bytes of an offset: 2, 4 or 8
+        uint8_t unused[5];
+        char data[PAYLOAD];
+
+        static inline int capacity(int w) {
+            return w == 2 ? packed_capacity(PAYLOAD, 2) : (w == 4 ? packed_capacity(PAYLOAD, 4) : packed_capacity(PAYLOAD, 8));
+        }
+
+        static inline int width_for(uint64_t range) {
+            return range <= UINT16_MAX ? 2 : (range <= UINT32_MAX ? 4 : 8);
+        }
+
+    private:
+        template <typename O>
+        inline O * offs() const {
+            return (O *)data;
+        }
+
+        inline char ** vals() const {
+            return (char **)(data + ((capacity(width) * width + 7) & ~7));
+        }
+
+        // the number of offsets less than q
+        template <typename O>
+        inline uint64_t lower(O q) const {
+            const O * o = offs<O>();
+            uint64_t i = 0;
+            for(uint64_t step = top_step(count); step > 0; step >>= 1) {
+                if(i + step <= count && o[i + step - 1] < q) i += step;
+            }
+            return i;
+        }
+
+        inline uint64_t offset_at(uint64_t i) const {
+            return width == 2 ? offs<uint16_t>()[i] : (width == 4 ? offs<uint32_t>()[i] : offs<uint64_t>()[i]);
+        }
+
+        inline void set_offset(uint64_t i, uint64_t d) {
+            if(width == 2) offs<uint16_t>()[i] = d;
+            else if(width == 4) offs<uint32_t>()[i] = d;
+            else offs<uint64_t>()[i] = d;
+        }
+
+    public:
+        packed_leaf_t() : leftmost_ptr(NULL), sibling_ptr(NULL), base(0), count(0), width(2) {}
+
+        void * operator new (size_t size) { // make the allocation 64 B aligned
+            void * ret;
+            if(posix_memalign(&ret, 64, size) != 0)
+                exit(-1);
+            return ret;
+        }
+
+        void operator delete(void * ptr) {
+            free(ptr);
+        }
+
+        inline int cap() const {
+            return capacity(width);
+        }
+
+        inline K key_at(uint64_t i) const {
+            return (K)((uint64_t)base + offset_at(i));
+        }
+
+        inline char * val_at(uint64_t i) const {
+            return vals()[i];
+        }
+
+        inline void set_val(uint64_t i, char * v) {
+            vals()[i] = v;
+        }
+
+        // the number of keys less than key
+        uint64_t rank(K key) const {
+            if(count == 0 || key < base) return 0;
+            uint64_t d = (uint64_t)key - (uint64_t)base;
+            if(width == 2) return d > UINT16_MAX ? count : lower<uint16_t>(d);
+            if(width == 4) return d > UINT32_MAX ? count : lower<uint32_t>(d);
+            return lower<uint64_t>(d);
+        }
+
+        int unpack(K * keys, char ** vs) const {
+            for(uint64_t i = 0; i < count; i++) {
+                keys[i] = key_at(i);
+                vs[i] = val_at(i);
+            }
+            return count;
+        }
+
+        // fill the leaf with n sorted records, base and width are chosen from their keys
+        void pack(const K * keys, char * const * vs, int n) {
+            base = n > 0 ? keys[0] : 0;
+            width = n > 0 ? width_for((uint64_t)keys[n - 1] - (uint64_t)base) : 2;
+            count = n;
+            for(int i = 0; i < n; i++) {
+                set_offset(i, (uint64_t)keys[i] - (uint64_t)base);
+                vals()[i] = vs[i];
+            }
+        }
+
+        // put k at position i (its rank), a leaf that cannot hold it after repacking is split
+        bool store(uint64_t i, K k, char * v, K & split_k, packed_leaf_t * & split_node) {
+            if(count > 0 && !(k < base) && width_for((uint64_t)k - (uint64_t)base) <= width && count < cap()) {
+                if(width == 2) memmove(offs<uint16_t>() + i + 1, offs<uint16_t>() + i, 2 * (count - i));
+                else if(width == 4) memmove(offs<uint32_t>() + i + 1, offs<uint32_t>() + i, 4 * (count - i));
+                else memmove(offs<uint64_t>() + i + 1, offs<uint64_t>() + i, 8 * (count - i));
+                memmove(vals() + i + 1, vals() + i, sizeof(char *) * (count - i));
+                set_offset(i, (uint64_t)k - (uint64_t)base);
+                vals()[i] = v;
+                count += 1;
+                return false;
+            }
+
+            K keys[MAX_SIZE + 1];
+            char * vs[MAX_SIZE + 1];
+            unpack(keys, vs);
+            memmove(keys + i + 1, keys + i, sizeof(K) * (count - i));
+            memmove(vs + i + 1, vs + i, sizeof(char *) * (count - i));
+            keys[i] = k;
+            vs[i] = v;
+            int n = count + 1;
+
+            if(n <= capacity(width_for((uint64_t)keys[n - 1] - (uint64_t)keys[0]))) {
+                pack(keys, vs, n);
+                return false;
+            }
+            STAT_SPLIT(BTREE);
+            int m = n / 2;
+            split_node = new packed_leaf_t;
+            split_node->pack(keys + m, vs + m, n - m);
+            pack(keys, vs, m);
+            split_k = keys[m];
+            split_node->sibling_ptr = sibling_ptr;
+            sibling_ptr = (char *)split_node;
+            return true;
+        }
+
+        void remove_at(uint64_t i) {
+            if(width == 2) memmove(offs<uint16_t>() + i, offs<uint16_t>() + i + 1, 2 * (count - i - 1));
+            else if(width == 4) memmove(offs<uint32_t>() + i, offs<uint32_t>() + i + 1, 4 * (count - i - 1));
+            else memmove(offs<uint64_t>() + i, offs<uint64_t>() + i + 1, 8 * (count - i - 1));
+            memmove(vals() + i, vals() + i + 1, sizeof(char *) * (count - i - 1));
+            count -= 1;
+        }
+
+        // move the records of right into left if they fit one leaf, right is released by the caller
+        static bool merge(packed_leaf_t * left, packed_leaf_t * right) {
+            K keys[2 * MAX_SIZE];
+            char * vs[2 * MAX_SIZE];
+            int n = left->unpack(keys, vs);
+            n += right->unpack(keys + n, vs + n);
+            if(n > MAX_SIZE || (n > 0 && n > capacity(width_for((uint64_t)keys[n - 1] - (uint64_t)keys[0]))))
+                return false;
+            STAT_ADD(BTREE, MERGES, 1);
+            left->pack(keys, vs, n);
+            left->sibling_ptr = right->sibling_ptr;
+            return true;
+        }
+
+        void print(string prefix) const {
+            std::cout << prefix << "[(" << count << ", base " << base << ", width " << (int)width << ") ";
+            for(uint64_t i = 0; i < count; i++) {
+                std::cout << "(" << key_at(i) << ", " << (int64_t)val_at(i) << ") ";
+            }
+            std::cout << "]" << std::endl;
+        }
+};
+
+/*
+    The btree with packed leaves: the inner nodes are those of btree_t, the
+    leaves are packed_leaf_t. Both start with leftmost_ptr, which is NULL in
+    a leaf only. Dense keys (timestamps, ids, the dense and clustered key
+    sets) get up to 22 records per 256-byte leaf instead of 14; sparse keys
+    fall back to 8-byte offsets and the layout of the normal leaf.
+
+    No snapshots and no dirty tracking, and the values fit in the pointer
+    slot of a record like in btree_t.
+*/
+template <typename K = _key_t, typename V = _value_t, int NODE_BYTES = PAGESIZE>
+class packed_t : public tree_base<packed_t<K, V, NODE_BYTES>, K, V> {
+    public:
+        typedef node_t<K, V, NODE_BYTES, std::less<K>> Inner;
+        typedef packed_leaf_t<K, NODE_BYTES> Leaf;
+        static_assert(sizeof(Leaf) == NODE_BYTES && sizeof(Inner) <= NODE_BYTES, "the nodes fill NODE_BYTES");
+
+    private:
+        char * root;
+
+        static inline bool is_leaf(const char * n) {
+            return *(char * const *)n == NULL; // leftmost_ptr
+        }
+
+        static void free_node(char * n) {
+            if(is_leaf(n)) {
+                delete (Leaf *)n;
+                return;
+            }
+            Inner * in = (Inner *)n;
+            free_node(in->leftmost_ptr);
+            for(uint64_t i = 0; i < in->count; i++) free_node(in->recs[i].val);
+            free(in); // the children are gone, delete would visit them again
+        }
+
+        Leaf * find_leaf(const K & key) const {
+            char * cur = root;
+            while(!is_leaf(cur)) {
+                STAT_ADD(BTREE, FIND_NODES, 1);
+                cur = ((Inner *)cur)->get_child(key);
+            }
+            STAT_ADD(BTREE, FIND_NODES, 1);
+            return (Leaf *)cur;
+        }
+
+        bool insert_recursive(char * n, const K & k, char * v, K & split_k, char * & split_node) {
+            if(is_leaf(n)) {
+                Leaf * l = (Leaf *)n;
+                uint64_t i = l->rank(k);
+                if(i < l->count && l->key_at(i) == k) {
+                    l->set_val(i, v);
+                    return false;
+                }
+                return l->store(i, k, v, split_k, (Leaf * &)split_node);
+            }
+
+            Inner * in = (Inner *)n;
+            K child_k;
+            char * child_node;
+            if(!insert_recursive(in->get_child(k), k, v, child_k, child_node)) return false;
+            return in->store(child_k, child_node, split_k, (Inner * &)split_node);
+        }
+
+        // true if n has too few records left
+        bool remove_recursive(char * n, const K & k, bool & found) {
+            if(is_leaf(n)) {
+                Leaf * l = (Leaf *)n;
+                uint64_t i = l->rank(k);
+                found = i < l->count && l->key_at(i) == k;
+                if(found) l->remove_at(i);
+                return l->count <= l->cap() / 3;
+            }
+
+            Inner * in = (Inner *)n;
+            char * child = in->get_child(k);
+            if(!remove_recursive(child, k, found)) return false;
+
+            Inner * leftsib = NULL, * rightsib = NULL;
+            int pos = in->get_lrchild(k, leftsib, rightsib);
+            if(is_leaf(child)) {
+                if(leftsib != NULL && Leaf::merge((Leaf *)leftsib, (Leaf *)child)) {
+                    in->remove(in->recs[pos - 1].key);
+                    delete (Leaf *)child;
+                } else if(rightsib != NULL && Leaf::merge((Leaf *)child, (Leaf *)rightsib)) {
+                    in->remove(in->recs[pos].key);
+                    delete (Leaf *)rightsib;
+                }
+            } else {
+                Inner * c = (Inner *)child;
+                if(leftsib != NULL && (c->count + leftsib->count) < Inner::NODE_SIZE) {
+                    K merge_key = in->recs[pos - 1].key;
+                    in->remove(merge_key);
+                    Inner::merge(leftsib, c, merge_key);
+                    free(c);
+                } else if(rightsib != NULL && (c->count + rightsib->count) < Inner::NODE_SIZE) {
+                    K merge_key = in->recs[pos].key;
+                    in->remove(merge_key);
+                    Inner::merge(c, rightsib, merge_key);
+                    free(rightsib);
+                }
+            }
+            return in->count <= Inner::NODE_SIZE / 3;
+        }
+
+        void print_recursive(char * n, string prefix) {
+            if(is_leaf(n)) {
+                ((Leaf *)n)->print(prefix);
+                return;
+            }
+            Inner * in = (Inner *)n;
+            std::cout << prefix << "[(" << in->count << ") ";
+            for(uint64_t i = 0; i < in->count; i++) std::cout << in->recs[i].key << " ";
+            std::cout << "]" << std::endl;
+            for(uint64_t i = 0; i <= in->count; i++) print_recursive(in->child_ref(i), prefix + "    ");
+        }
+
+    public:
+        packed_t() : root((char *)new Leaf) {}
+
+        ~packed_t() {
+            free_node(root);
+        }
+
+        bool find(K key, V & val) {
+            STAT_ADD(BTREE, FINDS, 1);
+            Leaf * l = find_leaf(key);
+            uint64_t i = l->rank(key);
+            if(i < l->count && l->key_at(i) == key) {
+                val = from_slot<V>(l->val_at(i));
+                return true;
+            }
+            return false;
+        }
+
+        void insert(K key, V val) {
+            STAT_INSERT(BTREE);
+            K split_k;
+            char * split_node;
+            if(insert_recursive(root, key, to_slot(val), split_k, split_node)) {
+                Inner * new_root = new Inner;
+                new_root->leftmost_ptr = root;
+                new_root->recs[0] = {split_k, split_node};
+                new_root->count = 1;
+                root = (char *)new_root;
+                STAT_ADD(BTREE, ROOT_GROWS, 1);
+            }
+        }
+
+        bool update(K key, V val) {
+            Leaf * l = find_leaf(key);
+            uint64_t i = l->rank(key);
+            if(i < l->count && l->key_at(i) == key) {
+                l->set_val(i, to_slot(val));
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(K key) {
+            STAT_ADD(BTREE, REMOVES, 1);
+            bool found;
+            remove_recursive(root, key, found);
+            if(!is_leaf(root) && ((Inner *)root)->count == 0) { // the root is empty
+                Inner * old_root = (Inner *)root;
+                root = old_root->leftmost_ptr;
+                free(old_root);
+                STAT_ADD(BTREE, ROOT_SHRINKS, 1);
+            }
+            return found;
+        }
+
+        int scan(K start_key, int num, V * vals) {
+            Leaf * l = find_leaf(start_key);
+            uint64_t i = l->rank(start_key);
+            int cnt = 0;
+            while(l != NULL && cnt < num) {
+                for(; i < l->count && cnt < num; i++) vals[cnt++] = from_slot<V>(l->val_at(i));
+                l = (Leaf *)l->sibling_ptr;
+                i = 0;
+            }
+            return cnt;
+        }
+
+        void printAll() {
+            print_recursive(root, string(""));
+        }
+};
+
+typedef packed_t<> packed;
+
+}; // namespace btree
+
+#endif //__BTREE_PACKED__
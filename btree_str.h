@@ -0,0 +1,376 @@
+/*  btree_str.h - the sorted btree for variable-length string keys
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __BTREE_STR__
+#define __BTREE_STR__
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "base.h"
+
+/*
+    The full keys are copied once into a key arena and never move. A slot of
+    a node holds an 8-byte normalized prefix of its key (the next 8 bytes as
+    a big-endian integer, zero padded), the address of the full key and the
+    value or child, 24 bytes in all:
+
+        node    leftmost_ptr, sibling_ptr, count, plen, slots
+        slot    prefix (8 bytes), key (8 bytes), val (8 bytes)
+
+    plen is a prefix length all the keys of the node share (that of the
+    first and the last key when it was computed), and the slot prefixes are
+    taken after it. A search first compares the key with the shared part
+    once, then runs a branchless binary search on the integer prefixes and
+    reads the full keys only of the slots whose prefix ties. plen is recomputed when a key lands at either end of a
+    node and after a split; a remove leaves it as is, a shorter plen than
+    possible is still correct.
+
+    A remove only takes the record out of its leaf, nodes are never merged,
+    and the arena keeps the removed keys.
+*/
+namespace btree_str {
+
+using std::string;
+using std::string_view;
+
+// a full key in the arena, its bytes follow
+struct str_t {
+    uint32_t len;
+
+    const char * data() const {
+        return (const char *)(this + 1);
+    }
+
+    string_view view() const {
+        return string_view(data(), len);
+    }
+};
+
+// the full keys, appended to chunks that live as long as the tree
+class key_arena {
+    private:
+        static constexpr size_t CHUNK = 1 << 20;
+
+        std::vector<char *> chunks;
+        size_t used, cap, total;
+
+    public:
+        key_arena() : used(0), cap(0), total(0) {}
+
+        ~key_arena() {
+            for(char * c : chunks) free(c);
+        }
+
+        const str_t * put(string_view s) {
+            size_t need = (sizeof(str_t) + s.size() + 3) & ~(size_t)3;
+            if(used + need > cap) {
+                cap = std::max(CHUNK, need);
+                char * c = (char *)malloc(cap);
+                if(c == NULL) {
+                    perror("malloc");
+                    exit(-1);
+                }
+                chunks.push_back(c);
+                used = 0;
+                total += cap;
+            }
+            str_t * k = (str_t *)(chunks.back() + used);
+            k->len = s.size();
+            memcpy((char *)k->data(), s.data(), s.size());
+            used += need;
+            return k;
+        }
+
+        uint64_t bytes() const {
+            return total;
+        }
+};
+
+// up to 8 bytes of s as a big-endian integer padded with zeros, integer order is byte order
+static inline uint64_t normalize(const char * s, size_t len) {
+    uint64_t p = 0;
+    if(len >= 8) memcpy(&p, s, 8);
+    else for(size_t i = 0; i < len; i++) p |= (uint64_t)(uint8_t)s[i] << (8 * i);
+    return __builtin_bswap64(p);
+}
+
+// the length of the common prefix of a and b
+static inline uint32_t common_prefix(const str_t * a, const str_t * b) {
+    uint32_t n = std::min(a->len, b->len), i = 0;
+    const char * x = a->data(), * y = b->data();
+    while(i + 8 <= n && memcmp(x + i, y + i, 8) == 0) i += 8;
+    while(i < n && x[i] == y[i]) i++;
+    return i;
+}
+
+template <int NODE_BYTES>
+class node_t {
+    public:
+        struct slot_t {
+            uint64_t prefix; // 8 bytes of the key after the plen shared ones
+            const str_t * key;
+            char * val;
+        };
+
+        static constexpr int NODE_SIZE = (NODE_BYTES - 24) / sizeof(slot_t);
+        static_assert(NODE_SIZE >= 3, "a node must hold at least 3 records");
+
+        char * leftmost_ptr; // NULL means the node is a leaf node
+        char * sibling_ptr;
+        uint32_t count;
+        uint32_t plen;       // the bytes every key of the node starts with, the meta data is 24 bytes
+        slot_t recs[NODE_SIZE];
+
+    private:
+        inline void set_prefix(int i) {
+            const str_t * k = recs[i].key;
+            recs[i].prefix = normalize(k->data() + plen, k->len - plen);
+        }
+
+        void reprefix() {
+            plen = count > 1 ? common_prefix(recs[0].key, recs[count - 1].key) : 0;
+            for(uint32_t i = 0; i < count; i++) set_prefix(i);
+        }
+
+        // -1 if q sorts before every key of the node, 1 if after every key, 0 if q starts with the shared bytes
+        inline int against_shared(string_view q) const {
+            if(plen == 0) return 0;
+            size_t n = std::min<size_t>(q.size(), plen);
+            int c = memcmp(q.data(), recs[0].key->data(), n);
+            if(c != 0) return c < 0 ? -1 : 1;
+            return q.size() < plen ? -1 : 0;
+        }
+
+    public:
+        node_t() : leftmost_ptr(NULL), sibling_ptr(NULL), count(0), plen(0) {}
+
+        void * operator new (size_t size) { // make the allocation 64 B aligned
+            void * ret;
+            if(posix_memalign(&ret, 64, size) != 0)
+                exit(-1);
+            return ret;
+        }
+
+        void operator delete(void * ptr) {
+            if(ptr != NULL) {
+                node_t * this_node = (node_t *) ptr;
+                if(this_node->leftmost_ptr != NULL) {
+                    delete (node_t *)this_node->leftmost_ptr;
+                    for(uint32_t i = 0; i < this_node->count; i++) {
+                        delete (node_t *)this_node->recs[i].val;
+                    }
+                }
+                free(ptr);
+            }
+        }
+
+        // the number of keys less than q, or not greater than q if upper
+        uint32_t rank(string_view q, bool upper) const {
+            int a = against_shared(q);
+            if(a != 0) return a < 0 ? 0 : count;
+
+            if(count == 0) return 0;
+            uint64_t qp = normalize(q.data() + plen, q.size() - plen);
+            const slot_t * base = recs; // a branchless binary search on the prefixes alone
+            for(uint32_t n = count; n > 1; n -= n / 2) {
+                base = base[n / 2].prefix < qp ? base + n / 2 : base;
+            }
+            uint32_t i = base - recs + (base->prefix < qp);
+
+            // only the keys whose prefix ties read their full key
+            string_view qs = q.substr(plen);
+            while(i < count && recs[i].prefix == qp) {
+                int c = recs[i].key->view().substr(plen).compare(qs);
+                if(c > 0 || (c == 0 && !upper)) break;
+                i++;
+            }
+            return i;
+        }
+
+        void insert_at(uint32_t i, const str_t * k, char * v) {
+            memmove(&recs[i + 1], &recs[i], sizeof(slot_t) * (count - i));
+            recs[i] = {0, k, v};
+            count += 1;
+            if((i == 0 || i == count - 1) && count > 1) { // the ends decide what the keys share
+                if(common_prefix(recs[0].key, recs[count - 1].key) != plen) {
+                    reprefix();
+                    return;
+                }
+            }
+            set_prefix(i);
+        }
+
+        inline char * child(uint32_t i) const {
+            return i == 0 ? leftmost_ptr : recs[i - 1].val;
+        }
+
+        // put k at position i, a full node is split around its middle first
+        bool store(uint32_t i, const str_t * k, char * v, const str_t * & split_k, node_t * & split_node) {
+            if(count < NODE_SIZE) {
+                insert_at(i, k, v);
+                return false;
+            }
+
+            split_node = new node_t;
+            uint32_t m = count / 2;
+            split_k = recs[m].key;
+            if(leftmost_ptr == NULL) {
+                split_node->count = count - m;
+                memcpy(&split_node->recs[0], &recs[m], sizeof(slot_t) * split_node->count);
+            } else { // the middle key moves up
+                split_node->leftmost_ptr = recs[m].val;
+                split_node->count = count - m - 1;
+                memcpy(&split_node->recs[0], &recs[m + 1], sizeof(slot_t) * split_node->count);
+            }
+            count = m;
+            split_node->sibling_ptr = sibling_ptr;
+            sibling_ptr = (char *)split_node;
+
+            if(i <= m) {
+                insert_at(i, k, v);
+            } else {
+                split_node->insert_at(leftmost_ptr == NULL ? i - m : i - m - 1, k, v);
+            }
+            reprefix();
+            split_node->reprefix();
+            return true;
+        }
+
+        void remove_at(uint32_t i) {
+            memmove(&recs[i], &recs[i + 1], sizeof(slot_t) * (count - i - 1));
+            count -= 1;
+            if(count == 0) plen = 0;
+        }
+
+        void print(string prefix) const {
+            std::cout << prefix << "[(" << count << ", shared " << plen << ") ";
+            for(uint32_t i = 0; i < count; i++) {
+                std::cout << "(" << recs[i].key->view() << ", " << (int64_t)recs[i].val << ") ";
+            }
+            std::cout << "]" << std::endl;
+
+            if(leftmost_ptr != NULL) {
+                for(uint32_t i = 0; i <= count; i++) ((node_t *)child(i))->print(prefix + "    ");
+            }
+        }
+};
+
+// values fit in the pointer slot of a record, like in the other engines
+template <typename V = _value_t, int NODE_BYTES = 512>
+class btree_t : public tree_base<btree_t<V, NODE_BYTES>, string_view, V> {
+    public:
+        typedef node_t<NODE_BYTES> Node;
+        static constexpr int NODE_SIZE = Node::NODE_SIZE;
+
+    private:
+        Node * root;
+        key_arena arena;
+
+        Node * find_leaf(string_view key) const {
+            Node * cur = root;
+            while(cur->leftmost_ptr != NULL) {
+                cur = (Node *)cur->child(cur->rank(key, true));
+            }
+            return cur;
+        }
+
+        bool insert_recursive(Node * n, string_view key, char * v, const str_t * & split_k, Node * & split_node) {
+            if(n->leftmost_ptr == NULL) {
+                uint32_t i = n->rank(key, false);
+                if(i < n->count && n->recs[i].key->view() == key) { // the key is in the tree
+                    n->recs[i].val = v;
+                    return false;
+                }
+                return n->store(i, arena.put(key), v, split_k, split_node);
+            }
+
+            uint32_t i = n->rank(key, true);
+            const str_t * child_k;
+            Node * child_node;
+            if(!insert_recursive((Node *)n->child(i), key, v, child_k, child_node)) return false;
+            return n->store(n->rank(child_k->view(), true), child_k, (char *)child_node, split_k, split_node);
+        }
+
+    public:
+        btree_t() : root(new Node) {}
+
+        ~btree_t() {
+            delete root;
+        }
+
+        bool find(string_view key, V & val) {
+            Node * leaf = find_leaf(key);
+            uint32_t i = leaf->rank(key, false);
+            if(i < leaf->count && leaf->recs[i].key->view() == key) {
+                val = from_slot<V>(leaf->recs[i].val);
+                return true;
+            }
+            return false;
+        }
+
+        void insert(string_view key, V val) {
+            const str_t * split_k;
+            Node * split_node;
+            if(insert_recursive(root, key, to_slot(val), split_k, split_node)) {
+                Node * new_root = new Node;
+                new_root->leftmost_ptr = (char *)root;
+                new_root->insert_at(0, split_k, (char *)split_node);
+                root = new_root;
+            }
+        }
+
+        bool update(string_view key, V val) {
+            Node * leaf = find_leaf(key);
+            uint32_t i = leaf->rank(key, false);
+            if(i < leaf->count && leaf->recs[i].key->view() == key) {
+                leaf->recs[i].val = to_slot(val);
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(string_view key) {
+            Node * leaf = find_leaf(key);
+            uint32_t i = leaf->rank(key, false);
+            if(i < leaf->count && leaf->recs[i].key->view() == key) {
+                leaf->remove_at(i);
+                return true;
+            }
+            return false;
+        }
+
+        int scan(string_view start_key, int num, V * vals) {
+            Node * leaf = find_leaf(start_key);
+            uint32_t i = leaf->rank(start_key, false);
+            int cnt = 0;
+            while(leaf != NULL && cnt < num) {
+                for(; i < leaf->count && cnt < num; i++) vals[cnt++] = from_slot<V>(leaf->recs[i].val);
+                leaf = (Node *)leaf->sibling_ptr;
+                i = 0;
+            }
+            return cnt;
+        }
+
+        // bytes of the key arena
+        uint64_t key_bytes() const {
+            return arena.bytes();
+        }
+
+        void printAll() {
+            root->print(string(""));
+        }
+};
+
+typedef btree_t<> btree;
+
+}; // namespace btree_str
+
+#endif //__BTREE_STR__
@@ -12,30 +12,41 @@
 #include <random>
 #include <queue>
 #include <functional>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iostream>
 
 #include "base.h"
+#include "stats.h"
 
 namespace btree_unsort {
 
 using std::string;
 
-const int PAGESIZE = 512;
-const int NODE_SIZE = ((PAGESIZE - 32) / 16);
+const int PAGESIZE = 512; // the default node bytes
 
-struct Record {
-    _key_t key;
+template <typename K>
+struct record_t {
+    K key;
     char * val;
 };
 
-class Node {
+// a node of NODE_BYTES bytes, its records are unsorted and the bitmap marks the used slots
+template <typename K, typename V, int NODE_BYTES, typename Compare>
+class node_t {
     public:
+        typedef record_t<K> Record;
+        static constexpr int NODE_SIZE = (NODE_BYTES - 32) / sizeof(Record);
+        static_assert(NODE_SIZE >= 3 && NODE_SIZE <= 64, "the bitmap covers 64 slots at most");
+
         char * leftmost_ptr;
         char * sibling_ptr;
         uint64_t count;
         uint64_t bitmap; // the total meta data is 32 bytes
         Record recs[NODE_SIZE];
     private:
-        void insert(_key_t k, _value_t v) {
+        void insert(const K & k, char * v) {
             uint64_t mask = 0x8000000000000000;
             int8_t slot;
             for(int i = 0; i < NODE_SIZE; i++) {
@@ -46,13 +57,13 @@ class Node {
                 mask >>= 1;
             }
     
-            recs[slot] = {k, (char *)v};
+            recs[slot] = {k, v};
 
             count += 1;
             bitmap |= mask;
         }
     public:
-        Node (): leftmost_ptr(NULL), count(0), bitmap(0) {}
+        node_t (): leftmost_ptr(NULL), sibling_ptr(NULL), count(0), bitmap(0) {}
         
         void * operator new (size_t size) {
             #ifdef _WIN32
@@ -68,14 +79,14 @@ class Node {
 
         void operator delete(void * ptr) {
             if(ptr != NULL) {
-                Node * this_node = (Node *) ptr;
+                node_t * this_node = (node_t *) ptr;
                 if(this_node->leftmost_ptr != NULL) {
-                    delete (Node *)this_node->leftmost_ptr;
+                    delete (node_t *)this_node->leftmost_ptr;
 
                     uint64_t mask = 0x8000000000000000;
                     for(int i = 0; i < NODE_SIZE; i++) {
                         if((this_node->bitmap & mask) > 0) {
-                            delete (Node *)this_node->recs[i].val;
+                            delete (node_t *)this_node->recs[i].val;
                         }
                         mask >>= 1;
                     }
@@ -89,31 +100,26 @@ class Node {
             }
         }
 
-        char * get_child(_key_t key) {
+        char * get_child(const K & key) {
+            STAT_ADD(BTREE_UNSORT, SEARCHES, 1);
             if(leftmost_ptr == NULL) {
-                uint64_t mask = 0x8000000000000000;
-                for(int i = 0; i < NODE_SIZE; i++) {
-                    if((bitmap & mask) > 0 && recs[i].key == key) {
-                        return recs[i].val;
-                    }
-                    mask >>= 1;
-                }
-                return NULL;
+                int slot = find_slot(key);
+                return slot < 0 ? NULL : recs[slot].val;
             } else {
-                _key_t max_leqkey = -1;
-                int8_t max_leqi = -1;
+                int8_t max_leqi = -1; // the slot of the largest key <= key
                 
                 uint64_t mask = 0x8000000000000000;
                 for(int i = 0; i < NODE_SIZE; i++) {
                     if((bitmap & mask) > 0) {
-                        if(recs[i].key <= key && max_leqkey < recs[i].key) {
-                            max_leqkey = recs[i].key;
+                        if(!key_less<Compare>(key, recs[i].key) &&
+                           (max_leqi == -1 || key_less<Compare>(recs[max_leqi].key, recs[i].key))) {
                             max_leqi = i;
                         }
                     }
                     mask >>= 1;
                 }
 
+                STAT_ADD(BTREE_UNSORT, COMPARES, count);
                 if(max_leqi == -1) {
                     return leftmost_ptr;
                 } else {
@@ -124,9 +130,10 @@ class Node {
             }
         }
 
-        bool store(_key_t k, _value_t v, _key_t & split_k, Node * & split_node) {
+        bool store(const K & k, char * v, K & split_k, node_t * & split_node) {
             if(count == NODE_SIZE) {
-                split_node = new Node;
+                STAT_SPLIT(BTREE_UNSORT);
+                split_node = new node_t;
 
                 split_k = get_median();
                 int8_t j = 0;
@@ -134,7 +141,7 @@ class Node {
                 uint64_t mask = 0x8000000000000000;
                 if(leftmost_ptr == NULL) {
                     for(int i = 0; i < NODE_SIZE; i++) {
-                        if(recs[i].key >= split_k) {
+                        if(!key_less<Compare>(recs[i].key, split_k)) {
                             bitmap &= (~mask);
                             split_node->recs[j++] = recs[i];
                         }
@@ -142,10 +149,10 @@ class Node {
                     }
                 } else {
                     for(int i = 0; i < NODE_SIZE; i++) {
-                        if(recs[i].key > split_k) {
+                        if(key_less<Compare>(split_k, recs[i].key)) {
                             bitmap &= (~mask);
                             split_node->recs[j++] = recs[i];
-                        } else if(recs[i].key == split_k) {
+                        } else if(key_equal<Compare>(recs[i].key, split_k)) {
                             bitmap &= (~mask);
                             split_node->leftmost_ptr = recs[i].val;
                         }
@@ -162,7 +169,7 @@ class Node {
                 split_node->sibling_ptr = sibling_ptr;
                 sibling_ptr = (char *) split_node;        
 
-                if(split_k > k) {
+                if(key_less<Compare>(k, split_k)) {
                     insert(k, v);
                 } else {
                     split_node->insert(k, v);
@@ -175,25 +182,102 @@ class Node {
             }
         }
 
+        // the slot of key in a leaf, -1 if key is not in it
+        int find_slot(const K & key) const {
+            uint64_t mask = 0x8000000000000000;
+            for(int i = 0; i < NODE_SIZE; i++) {
+                if((bitmap & mask) > 0 && key_equal<Compare>(recs[i].key, key)) {
+                    STAT_ADD(BTREE_UNSORT, COMPARES, __builtin_popcountll(bitmap & ~(mask - 1)));
+                    return i;
+                }
+                mask >>= 1;
+            }
+            STAT_ADD(BTREE_UNSORT, COMPARES, count);
+            return -1;
+        }
+
+        bool update(const K & k, char * v) { // the value of k in a leaf
+            int slot = find_slot(k);
+            if(slot < 0) return false;
+            recs[slot].val = v;
+            return true;
+        }
+
+        bool remove(const K & k) { // a record of a leaf, or a separator and its right child
+            int slot = find_slot(k);
+            if(slot < 0) return false;
+            bitmap &= ~(0x8000000000000000 >> slot);
+            count -= 1;
+            return true;
+        }
+
+        // the children left and right of the child of k in an inner node, NULL if there is
+        // none, and the keys that separate them from it
+        void get_lrchild(const K & k, node_t * & left, K & left_k, node_t * & right, K & right_k) {
+            int8_t cur = -1, next = -1; // the slots of the largest key <= k and of the smallest key > k
+            uint64_t mask = 0x8000000000000000;
+            for(int i = 0; i < NODE_SIZE; i++, mask >>= 1) {
+                if((bitmap & mask) == 0) continue;
+                if(!key_less<Compare>(k, recs[i].key)) {
+                    if(cur == -1 || key_less<Compare>(recs[cur].key, recs[i].key)) cur = i;
+                } else if(next == -1 || key_less<Compare>(recs[i].key, recs[next].key)) {
+                    next = i;
+                }
+            }
+
+            left = NULL;
+            if(cur != -1) {
+                int8_t prev = -1; // the largest key less than the one of cur
+                mask = 0x8000000000000000;
+                for(int i = 0; i < NODE_SIZE; i++, mask >>= 1) {
+                    if((bitmap & mask) > 0 && key_less<Compare>(recs[i].key, recs[cur].key) &&
+                       (prev == -1 || key_less<Compare>(recs[prev].key, recs[i].key))) {
+                        prev = i;
+                    }
+                }
+                left = (node_t *)(prev == -1 ? leftmost_ptr : recs[prev].val);
+                left_k = recs[cur].key;
+            }
+
+            right = NULL;
+            if(next != -1) {
+                right = (node_t *)recs[next].val;
+                right_k = recs[next].key;
+            }
+        }
+
+        // move the records of right into left, merge_key separated them in the parent
+        static void merge(node_t * left, node_t * right, const K & merge_key) {
+            STAT_ADD(BTREE_UNSORT, MERGES, 1);
+            if(left->leftmost_ptr != NULL) {
+                left->insert(merge_key, right->leftmost_ptr);
+            }
+            uint64_t mask = 0x8000000000000000;
+            for(int i = 0; i < NODE_SIZE; i++, mask >>= 1) {
+                if((right->bitmap & mask) > 0) left->insert(right->recs[i].key, right->recs[i].val);
+            }
+            left->sibling_ptr = right->sibling_ptr; // right is freed by the caller
+        }
+
         void print(string prefix) {
             printf("%s(%ld, %lx)[ ", prefix.c_str(), count, bitmap);
             uint64_t mask = 0x8000000000000000;
             for(int i = 0; i < NODE_SIZE; i++) {
                 if((bitmap & mask) > 0) {
-                    printf("(%ld, %ld) ", recs[i].key, (int64_t)recs[i].val);
+                    std::cout << "(" << recs[i].key << ", " << (int64_t)recs[i].val << ") ";
                 }
                 mask >>= 1;
             }
-            printf("]\n");
+            std::cout << "]" << std::endl;
 
             if(leftmost_ptr != NULL) {
-                Node * child = (Node *)leftmost_ptr;
+                node_t * child = (node_t *)leftmost_ptr;
                 child->print(prefix + "    ");
 
                 uint64_t mask = 0x8000000000000000;
                 for(int i = 0; i < NODE_SIZE; i++) {
                     if((bitmap & mask) > 0) {
-                        Node * child = (Node *)recs[i].val;
+                        node_t * child = (node_t *)recs[i].val;
                         child->print(prefix + "    ");
                     }
                     mask >>= 1;
@@ -201,15 +285,15 @@ class Node {
             }
         }
     
-        _key_t get_median() {
-            std::priority_queue<_key_t, std::vector<_key_t>> q; // max heap
+        K get_median() {
+            std::priority_queue<K, std::vector<K>, Compare> q; // max heap
 
             for(int i = 0; i <= NODE_SIZE / 2; i++) {
                 q.push(recs[i].key);
             }
 
             for(int i = NODE_SIZE / 2 + 1; i < NODE_SIZE; i++) {
-                if(q.top() > recs[i].key) {
+                if(key_less<Compare>(recs[i].key, q.top())) {
                     q.pop();
                     q.push(recs[i].key);
                 }
@@ -220,35 +304,48 @@ class Node {
         }
 };
 
-class btree : tree_api {
+// keys are trivially copyable and ordered by Compare, values fit in the pointer slot of a record
+template <typename K = _key_t, typename V = _value_t, int NODE_BYTES = PAGESIZE, typename Compare = std::less<K>>
+class btree_t : public tree_base<btree_t<K, V, NODE_BYTES, Compare>, K, V> {
+    public:
+        typedef node_t<K, V, NODE_BYTES, Compare> Node;
+        typedef record_t<K> Record;
+        static constexpr int NODE_SIZE = Node::NODE_SIZE;
+
     private:
         Node * root;
 
     public:
-        btree() {
+        btree_t() {
             root = new Node;
         }
 
-        ~btree() {
+        ~btree_t() {
             delete root;
         }
 
-        bool find(_key_t key, _value_t &val) {
+        bool find(K key, V &val) {
+            STAT_ADD(BTREE_UNSORT, FINDS, 1);
             Node * cur = root;
             while(cur->leftmost_ptr != NULL) {
+                STAT_ADD(BTREE_UNSORT, FIND_NODES, 1);
                 char * child_ptr = cur->get_child(key);
                 cur = (Node *)child_ptr;
             }
 
-            val = (_value_t) cur->get_child(key);
-
+            STAT_ADD(BTREE_UNSORT, FIND_NODES, 1);
+            STAT_ADD(BTREE_UNSORT, SEARCHES, 1);
+            int slot = cur->find_slot(key);
+            if(slot < 0) return false;
+            val = from_slot<V>(cur->recs[slot].val);
             return true;
         }
 
-        void insert(_key_t key, _value_t val) {
-            _key_t split_k;
+        void insert(K key, V val) {
+            STAT_INSERT(BTREE_UNSORT);
+            K split_k;
             Node * split_node;
-            bool splitIf = insert_recursive(root, key, val, split_k, split_node);
+            bool splitIf = insert_recursive(root, key, to_slot(val), split_k, split_node);
 
             if(splitIf) {
                 Node *new_root = new Node;
@@ -259,15 +356,110 @@ class btree : tree_api {
                 new_root->bitmap = (0x8000000000000000);
 
                 root = new_root;
+                STAT_ADD(BTREE_UNSORT, ROOT_GROWS, 1);
             }
         }
 
-        bool update(_key_t key, _value_t value) { // TODO: not implemented
-            return false;
+        bool update(K key, V value) {
+            Node * cur = root;
+            while(cur->leftmost_ptr != NULL) {
+                cur = (Node *)cur->get_child(key);
+            }
+            return cur->update(key, to_slot(value));
         }
 
-        bool remove(_key_t key) { // TODO: not implemented
-            return false;
+        // true if key was in the tree, an underfull node is merged with a sibling
+        bool remove(K key) {
+            STAT_ADD(BTREE_UNSORT, REMOVES, 1);
+            bool removed = false;
+            remove_recursive(root, key, removed);
+
+            if(root->leftmost_ptr != NULL && root->count == 0) { // the root is empty
+                Node * old_root = root;
+                root = (Node *)root->leftmost_ptr;
+                free(old_root); // not delete, it would free the children too
+                STAT_ADD(BTREE_UNSORT, ROOT_SHRINKS, 1);
+            }
+            return removed;
+        }
+
+        // replace the content of the tree with num records sorted by key, built bottom-up
+        void bulk_load(const std::pair<K, V> * kvs, uint64_t num) {
+            delete root;
+
+            const uint64_t per_node = NODE_SIZE * 3 / 4; // leave room for inserts after loading
+            std::vector<Node *> level;
+            std::vector<K> lows; // the smallest key under each node of the level
+
+            uint64_t node_num = num == 0 ? 1 : (num + per_node - 1) / per_node;
+            for(uint64_t i = 0; i < node_num; i++) {
+                Node * n = new Node;
+                uint64_t start = num * i / node_num, end = num * (i + 1) / node_num;
+                for(uint64_t j = start; j < end; j++) {
+                    n->recs[n->count++] = {kvs[j].first, to_slot(kvs[j].second)};
+                }
+                n->bitmap = n->count == 0 ? 0 : UINT64_MAX << (64 - n->count);
+                n->sibling_ptr = NULL;
+                if(i > 0) level.back()->sibling_ptr = (char *)n;
+                level.push_back(n);
+                lows.push_back(num == 0 ? K() : kvs[start].first);
+            }
+
+            while(level.size() > 1) { // build the upper level, each node gets per_node + 1 children at most
+                std::vector<Node *> up;
+                std::vector<K> up_lows;
+                node_num = (level.size() + per_node) / (per_node + 1);
+                for(uint64_t i = 0; i < node_num; i++) {
+                    Node * n = new Node;
+                    uint64_t start = level.size() * i / node_num, end = level.size() * (i + 1) / node_num;
+                    n->leftmost_ptr = (char *)level[start];
+                    for(uint64_t j = start + 1; j < end; j++) {
+                        n->recs[n->count++] = {lows[j], (char *)level[j]};
+                    }
+                    n->bitmap = n->count == 0 ? 0 : UINT64_MAX << (64 - n->count);
+                    n->sibling_ptr = NULL;
+                    if(i > 0) up.back()->sibling_ptr = (char *)n;
+                    up.push_back(n);
+                    up_lows.push_back(lows[start]);
+                }
+                level.swap(up);
+                lows.swap(up_lows);
+            }
+            root = level[0];
+        }
+
+        // call f(key, value) on every record in key order, the records of a node are sorted on the fly
+        template <typename F>
+        void for_each(F f) {
+            for_each_recursive(root, f);
+        }
+
+        int scan(K start_key, int num, V * vals) {
+            Node * cur = root;
+            while(cur->leftmost_ptr != NULL) {
+                cur = (Node *)cur->get_child(start_key);
+            }
+
+            int cnt = 0;
+            std::vector<Record> sorted;
+            while(cur != NULL && cnt < num) { // the leaves are unsorted, sort each one on the way
+                sorted.clear();
+                uint64_t mask = 0x8000000000000000;
+                for(int i = 0; i < NODE_SIZE; i++) {
+                    if((cur->bitmap & mask) > 0 && !key_less<Compare>(cur->recs[i].key, start_key)) {
+                        sorted.push_back(cur->recs[i]);
+                    }
+                    mask >>= 1;
+                }
+                std::sort(sorted.begin(), sorted.end(), [](const Record & a, const Record & b) {
+                    return key_less<Compare>(a.key, b.key);
+                });
+                for(size_t i = 0; i < sorted.size() && cnt < num; i++) {
+                    vals[cnt++] = from_slot<V>(sorted[i].val);
+                }
+                cur = (Node *)cur->sibling_ptr;
+            }
+            return cnt;
         }
 
         void printAll() {
@@ -275,24 +467,84 @@ class btree : tree_api {
         }
 
     private:
-        bool insert_recursive(Node * n, _key_t k, _value_t v, _key_t &split_k, Node * &split_node) {
+        template <typename F>
+        void for_each_recursive(Node * n, F & f) {
+            std::vector<Record> sorted;
+            uint64_t mask = 0x8000000000000000;
+            for(int i = 0; i < NODE_SIZE; i++) {
+                if((n->bitmap & mask) > 0) {
+                    sorted.push_back(n->recs[i]);
+                }
+                mask >>= 1;
+            }
+            std::sort(sorted.begin(), sorted.end(), [](const Record & a, const Record & b) {
+                return key_less<Compare>(a.key, b.key);
+            });
+
+            if(n->leftmost_ptr == NULL) {
+                for(const Record & r : sorted) {
+                    f(r.key, from_slot<V>(r.val));
+                }
+            } else {
+                for_each_recursive((Node *)n->leftmost_ptr, f);
+                for(const Record & r : sorted) {
+                    for_each_recursive((Node *)r.val, f);
+                }
+            }
+        }
+
+        // removed tells if k was found, the result if n should be merged
+        bool remove_recursive(Node * n, const K & k, bool & removed) {
             if(n->leftmost_ptr == NULL) {
+                removed = n->remove(k);
+                return n->count <= NODE_SIZE / 3;
+            }
+
+            Node * child = (Node *)n->get_child(k);
+            if(!remove_recursive(child, k, removed)) return false;
+
+            Node * left, * right;
+            K left_k, right_k;
+            n->get_lrchild(k, left, left_k, right, right_k);
+            if(left != NULL && child->count + left->count < NODE_SIZE) { // merge with the left node
+                n->remove(left_k);
+                Node::merge(left, child, left_k);
+                free(child);
+            } else if(right != NULL && child->count + right->count < NODE_SIZE) { // merge with the right node
+                n->remove(right_k);
+                Node::merge(child, right, right_k);
+                free(right);
+            } else {
+                return false;
+            }
+            return n->count <= NODE_SIZE / 3;
+        }
+
+        bool insert_recursive(Node * n, const K & k, char * v, K &split_k, Node * &split_node) {
+            if(n->leftmost_ptr == NULL) {
+                if(n->update(k, v)) return false; // the key is in the tree, its value is replaced
                 return n->store(k, v, split_k, split_node);
             } else {
                 Node * child = (Node *) n->get_child(k);
                 
-                _key_t split_k_child;
+                K split_k_child;
                 Node * split_node_child;
                 bool splitIf = insert_recursive(child, k, v, split_k_child, split_node_child);
 
                 if(splitIf) { 
-                    return n->store(split_k_child, (_value_t)split_node_child, split_k, split_node);
+                    return n->store(split_k_child, (char *)split_node_child, split_k, split_node);
                 } 
                 return false;
             }
         }
-}; // class btree
+}; // class btree_t
+
+// the default geometry, the tree behind the benchmark drivers
+typedef record_t<_key_t> Record;
+typedef node_t<_key_t, _value_t, PAGESIZE, std::less<_key_t>> Node;
+const int NODE_SIZE = Node::NODE_SIZE;
+typedef btree_t<> btree;
 
-}; // namespace btree
+}; // namespace btree_unsort
 
 #endif
@@ -0,0 +1,278 @@
+/*  crashtest.cc - crash injection for the persistent trees
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+
+    The workload runs with the emulated flush model. A tracer keeps a copy of
+    what is durable: a cache line is copied from the mapping when a fence
+    retires its flush. At the chosen fences the durable copy is written out as
+    a crash image, which is reopened (running recovery) and compared with a
+    reference model: every operation before the one in flight must be visible,
+    the one in flight either completely or not at all.
+*/
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "slotonly_pm.h"
+#include "cmdline.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+
+struct op_t {
+    char type; // 'i'nsert, 'r'emove or 'u'pdate
+    _key_t key;
+    _value_t val;
+};
+
+typedef std::map<_key_t, _value_t> model_t;
+
+static void apply_op(model_t & m, const op_t & op) {
+    switch(op.type) {
+        case 'i': m[op.key] = op.val; break;
+        case 'u': if(m.count(op.key)) m[op.key] = op.val; break;
+        case 'r': m.erase(op.key); break;
+    }
+}
+
+// return false if an update or a remove found no key
+static bool run_op(slotonly_pm::wbtree * tree, const op_t & op) {
+    switch(op.type) {
+        case 'i': tree->insert(op.key, op.val); return true;
+        case 'u': return tree->update(op.key, op.val);
+        case 'r': return tree->remove(op.key);
+    }
+    return false;
+}
+
+// an absent key is mostly inserted and sometimes removed, a present one is removed,
+// updated or inserted again
+static std::vector<op_t> gen_workload(int op_num, int key_range, int remove_ratio, uint64_t seed) {
+    std::vector<op_t> ops;
+    std::set<_key_t> present;
+    std::default_random_engine e(seed);
+    std::uniform_int_distribution<_key_t> key_dist(0, key_range - 1);
+    std::uniform_int_distribution<int> op_dist(0, 99);
+
+    for(int i = 0; i < op_num; i++) {
+        _key_t k = key_dist(e);
+        int r = op_dist(e);
+        if(present.count(k) == 0) {
+            if(r < 10) {
+                ops.push_back({'r', k, 0});
+            } else {
+                ops.push_back({'i', k, (_value_t)i + 1});
+                present.insert(k);
+            }
+        } else if(r < remove_ratio) {
+            ops.push_back({'r', k, 0});
+            present.erase(k);
+        } else if(r % 2 == 0) {
+            ops.push_back({'i', k, (_value_t)i + 1});
+        } else {
+            ops.push_back({'u', k, (_value_t)i + 1});
+        }
+    }
+    return ops;
+}
+
+class fence_counter : public persist::tracer {
+public:
+    uint64_t fences = 0;
+    void on_flush(const void *) {}
+    void on_fence() { fences += 1; }
+};
+
+class crash_tracer : public persist::tracer {
+private:
+    mmap_region & region;
+    std::vector<char> durable;
+    std::vector<const char *> pending;
+    std::vector<uint64_t> points; // sorted fence numbers to crash at
+    size_t next_point;
+    uint64_t fences;
+    double evict_ratio;
+    std::default_random_engine e;
+
+    const std::vector<op_t> & ops;
+    model_t & model; // the state before the operation in flight
+    int key_range;
+    string crash_file;
+
+public:
+    size_t cur_op;
+    int tested, failed;
+    double recovery_sum, recovery_max;
+
+    crash_tracer(mmap_region & r, std::vector<uint64_t> pts, double evict, const std::vector<op_t> & o,
+                 model_t & m, int range, string file)
+        : region(r), points(pts), next_point(0), fences(0), evict_ratio(evict), e(7), ops(o), model(m),
+          key_range(range), crash_file(file), cur_op(0), tested(0), failed(0), recovery_sum(0), recovery_max(0) {
+        durable.assign(region.get_base(), region.get_base() + region.size());
+    }
+
+    void on_flush(const void * line) {
+        pending.push_back((const char *)line);
+    }
+
+    void on_fence() {
+        if(durable.size() < region.size()) durable.resize(region.size(), 0);
+
+        const char * base = region.get_base();
+        for(const char * line : pending) {
+            uint64_t off = line - base;
+            if(off < durable.size()) memcpy(&durable[off], line, persist::CACHE_LINE);
+        }
+        pending.clear();
+
+        fences += 1;
+        if(next_point < points.size() && points[next_point] == fences) {
+            next_point += 1;
+            crash();
+        }
+    }
+
+private:
+    void crash() {
+        persist::set_tracer(NULL);
+        persist::counters_t saved = persist::counters(); // recovery must not count as workload
+
+        std::vector<char> image = durable;
+        if(evict_ratio > 0) { // dirty lines that were written back by cache evictions
+            std::uniform_real_distribution<double> dist(0, 1);
+            const char * live = region.get_base();
+            for(uint64_t off = 0; off < image.size(); off += persist::CACHE_LINE) {
+                if(memcmp(&image[off], live + off, persist::CACHE_LINE) != 0 && dist(e) < evict_ratio)
+                    memcpy(&image[off], live + off, persist::CACHE_LINE);
+            }
+        }
+
+        FILE * f = fopen(crash_file.c_str(), "wb");
+        fwrite(image.data(), 1, image.size(), f);
+        fclose(f);
+
+        model_t after = model;
+        apply_op(after, ops[cur_op]);
+
+        bool ok = true;
+        {
+            double start = seconds();
+            slotonly_pm::wbtree tree(crash_file.c_str());
+            double rec_time = seconds() - start;
+            recovery_sum += rec_time;
+            recovery_max = std::max(recovery_max, rec_time);
+
+            slotonly_pm::wbtree * t = &tree;
+            _key_t inflight = ops[cur_op].key;
+            for(_key_t k = 0; k < key_range && ok; k++) {
+                _value_t v;
+                bool found = t->find(k, v);
+                auto check = [&](const model_t & m) {
+                    auto it = m.find(k);
+                    return it == m.end() ? !found : (found && v == it->second);
+                };
+                ok = k == inflight ? (check(model) || check(after)) : check(model);
+                if(!ok) cout << "  key " << k << (found ? " has a wrong value" : " is lost") << endl;
+            }
+
+            if(ok) { // the recovered tree must keep working
+                for(_key_t k = key_range; k < key_range + 64; k++) t->insert(k, k);
+                for(_key_t k = key_range; k < key_range + 64 && ok; k++) {
+                    _value_t v;
+                    ok = t->find(k, v) && v == k;
+                }
+                if(!ok) cout << "  the recovered tree rejects new inserts" << endl;
+            }
+        }
+        remove(crash_file.c_str());
+
+        tested += 1;
+        if(!ok) {
+            failed += 1;
+            cout << "crash at fence " << fences << " (op " << cur_op << " '" << ops[cur_op].type
+                 << "' key " << ops[cur_op].key << ") failed to recover" << endl;
+        }
+
+        persist::counters() = saved;
+        persist::set_tracer(this);
+    }
+};
+
+int main(int argc, char ** argv) {
+    cmdline::parser pars;
+    pars.add<int>("ops", 'n', "number of operations", false, 20000);
+    pars.add<int>("range", 'r', "keys are drawn from [0, range)", false, 5000);
+    pars.add<int>("remove", 'd', "percentage of removes among the ops on present keys", false, 40, cmdline::range(0, 100));
+    pars.add<int>("crashes", 'c', "number of random crash points, 0 means every fence", false, 200);
+    pars.add<double>("evict", 'e', "probability that an unflushed dirty line reached the media", false, 0.0);
+    pars.add<int>("seed", 's', "seed of the workload and of the crash points", false, 1);
+    pars.add<string>("file", 'f', "backing file of the tree", false, "crashtest.img");
+    pars.parse_check(argc, argv);
+
+    int op_num = pars.get<int>("ops");
+    int key_range = pars.get<int>("range");
+    int crash_num = pars.get<int>("crashes");
+    int seed = pars.get<int>("seed");
+    string file = pars.get<string>("file");
+    string crash_file = file + ".crash";
+
+    std::vector<op_t> ops = gen_workload(op_num, key_range, pars.get<int>("remove"), seed);
+
+    // dry run: count the fences of the workload
+    uint64_t total_fences;
+    {
+        remove(file.c_str());
+        slotonly_pm::wbtree tree(file.c_str());
+        fence_counter counter;
+        persist::set_tracer(&counter);
+        for(const op_t & op : ops) run_op(&tree, op);
+        persist::set_tracer(NULL);
+        total_fences = counter.fences;
+    }
+
+    std::vector<uint64_t> points;
+    if(crash_num == 0 || (uint64_t)crash_num >= total_fences) {
+        for(uint64_t i = 1; i <= total_fences; i++) points.push_back(i);
+    } else {
+        std::default_random_engine e(seed);
+        std::uniform_int_distribution<uint64_t> dist(1, total_fences);
+        std::set<uint64_t> picked;
+        while(picked.size() < (size_t)crash_num) picked.insert(dist(e));
+        points.assign(picked.begin(), picked.end());
+    }
+
+    cout << "ops: " << op_num << ", fences: " << total_fences << ", crash points: " << points.size() << endl;
+
+    remove(file.c_str());
+    slotonly_pm::wbtree tree(file.c_str());
+    model_t model;
+    crash_tracer tracer(tree.get_pool().get_region(), points, pars.get<double>("evict"), ops, model, key_range, crash_file);
+
+    persist::counters() = {0, 0};
+    persist::set_tracer(&tracer);
+    int wrong = 0; // updates and removes that reported the wrong result
+    for(size_t i = 0; i < ops.size(); i++) {
+        tracer.cur_op = i;
+        bool present = model.count(ops[i].key) != 0;
+        if(run_op(&tree, ops[i]) != (ops[i].type == 'i' || present)) {
+            if(wrong++ == 0) cout << "op " << i << " '" << ops[i].type << "' key " << ops[i].key << " reported the wrong result" << endl;
+        }
+        apply_op(model, ops[i]);
+    }
+    persist::set_tracer(NULL);
+
+    cout << "flushes per op: " << (double)persist::counters().flushes / op_num
+         << ", fences per op: " << (double)persist::counters().fences / op_num << endl;
+    cout << "recovery time avg: " << (tracer.tested ? tracer.recovery_sum / tracer.tested * 1e6 : 0)
+         << " us, max: " << tracer.recovery_max * 1e6 << " us" << endl;
+    cout << tracer.tested - tracer.failed << "/" << tracer.tested << " crash points recovered" << endl;
+    if(wrong > 0) cout << wrong << " updates and removes reported the wrong result" << endl;
+
+    remove(file.c_str());
+    return tracer.failed == 0 && wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+/*  latency.h - a cheap cycle timer and log-linear latency histograms
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __LATENCY__
+#define __LATENCY__
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(LATENCY_CLOCK_GETTIME)
+    #include <x86intrin.h>
+    #define LATENCY_RDTSC
+#endif
+
+/*
+    now() reads the time stamp counter (about 20 cycles, the counter is
+    invariant on the CPUs we run on) and falls back to clock_gettime on other
+    architectures or with -DLATENCY_CLOCK_GETTIME. Latencies are recorded in
+    ticks and converted to nanoseconds only when they are reported.
+
+    A histogram keeps 64 linear sub-buckets per power of two, like
+    HdrHistogram with two significant digits: any value is reported within
+    1.6% of its real value, and recording is a shift and an increment.
+*/
+namespace latency {
+
+static inline uint64_t clock_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t now() {
+    #ifdef LATENCY_RDTSC
+        return __rdtsc();
+    #else
+        return clock_ns();
+    #endif
+}
+
+// measured once against CLOCK_MONOTONIC
+static inline double ns_per_tick() {
+    #ifdef LATENCY_RDTSC
+        static double ratio = 0;
+        if(ratio == 0) {
+            uint64_t t0 = clock_ns(), c0 = __rdtsc();
+            while(clock_ns() - t0 < 20000000) {} // 20 ms
+            uint64_t t1 = clock_ns(), c1 = __rdtsc();
+            ratio = (double)(t1 - t0) / (c1 - c0);
+        }
+        return ratio;
+    #else
+        return 1.0;
+    #endif
+}
+
+class histogram {
+    private:
+        static const int SUB_BITS = 7;
+        static const uint64_t HALF = 1 << (SUB_BITS - 1);
+        static const int BUCKETS = (64 - SUB_BITS + 2) * HALF;
+
+        std::vector<uint64_t> counts;
+        uint64_t total, max_v;
+
+        // values below 2^SUB_BITS are exact, above that a bucket covers 1 / HALF of its power of two
+        static inline int index(uint64_t v) {
+            if(v < 2 * HALF) return v;
+            int shift = 63 - __builtin_clzll(v) - SUB_BITS + 1;
+            return shift * HALF + (v >> shift);
+        }
+
+        static inline uint64_t upper(int idx) { // the largest value of a bucket
+            if(idx < 2 * (int)HALF) return idx;
+            int shift = idx / HALF - 1;
+            return ((idx - shift * HALF + 1) << shift) - 1;
+        }
+
+    public:
+        histogram() : counts(BUCKETS, 0), total(0), max_v(0) {}
+
+        inline void record(uint64_t v) {
+            counts[index(v)] += 1;
+            total += 1;
+            if(v > max_v) max_v = v;
+        }
+
+        void merge(const histogram & h) {
+            for(int i = 0; i < BUCKETS; i++) counts[i] += h.counts[i];
+            total += h.total;
+            if(h.max_v > max_v) max_v = h.max_v;
+        }
+
+        void reset() {
+            std::fill(counts.begin(), counts.end(), 0);
+            total = max_v = 0;
+        }
+
+        uint64_t count() const {
+            return total;
+        }
+
+        uint64_t max() const {
+            return max_v;
+        }
+
+        // the smallest recorded value v such that p percent of the values are <= v
+        uint64_t percentile(double p) const {
+            if(total == 0) return 0;
+            uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+            if(rank == 0) rank = 1;
+            uint64_t seen = 0;
+            for(int i = 0; i < BUCKETS; i++) {
+                seen += counts[i];
+                if(seen >= rank) return upper(i) < max_v ? upper(i) : max_v;
+            }
+            return max_v;
+        }
+};
+
+struct summary_t {
+    uint64_t count;
+    double p50, p99, p999, max; // nanoseconds
+};
+
+static inline summary_t summarize(const histogram & h) {
+    double r = ns_per_tick();
+    return {h.count(), h.percentile(50) * r, h.percentile(99) * r, h.percentile(99.9) * r, h.max() * r};
+}
+
+}; // namespace latency
+
+#endif //__LATENCY__
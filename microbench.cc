@@ -0,0 +1,428 @@
+/*  microbench.cc - time the node primitives of the trees in isolation
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+
+    Every primitive runs on node fixtures that stay in the L1 cache: nodes
+    filled to --fill percent of their capacity with sequential (100, 200, ...)
+    or random keys, inserted in random order. The calls are independent, so
+    a result is the throughput cost of one call, not its latency. A round
+    makes --reps calls timed with the time stamp counter; the best of
+    --rounds rounds is reported in ns per call, which is stable enough to
+    catch a regression of a few percent.
+
+        slotonly      PERMUT_READ, PERMUT_ADD, PERMUT_ALLOC, linear_search (leaf)
+        btree_unsort  get_child (leaf, inner), get_median (full node)
+        btree         Node::get_child (leaf, inner), Node::store (without
+                      split), split (store into a full leaf, allocation included)
+
+    Besides the nodes, find on whole trees of 1024 and 16384 records (still
+    in the cache) is timed three ways: through the virtual tree_api of
+    api_adapter, on the engine type with the call resolved statically, and
+    as find_batch of 64 keys; the difference is the cost of the dispatch.
+    The btree with node groups (btree_csb) is timed the same way.
+    The same keys formatted as strings ("user" and 20 digits, so string
+    order is integer order) are found in btree_str and std::map<string>.
+
+    The mutating primitives work on a batch of node copies that is restored
+    between batches, the restore is not timed.
+*/
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <map>
+
+#include "btree.h"
+#include "btree_unsort.h"
+#include "slotonly.h"
+#include "btree_str.h"
+#include "btree_csb.h"
+#include "latency.h"
+#include "cmdline.h"
+
+using std::string;
+
+const int PROBES = 4096;    // probe keys and positions, a power of two
+const int PERMUTS = 64;     // different permutations of the same fill
+const int COPIES = 32;      // node copies a mutating batch works on
+
+static volatile uint64_t sink;
+
+// make the compiler forget what it knows about memory, so a call on the same node is not hoisted
+static inline void clobber() {
+    asm volatile("" ::: "memory");
+}
+
+struct result_t {
+    string prim;
+    string pattern;
+    int fill; // records in the node
+    double ns;
+};
+
+static int rounds = 5;
+static uint64_t reps = 1000000;
+
+// f(i) is one call, reset() prepares the next batch of calls untimed
+template <typename F, typename R>
+static double measure(uint64_t batch, F f, R reset) {
+    double best = 1e30;
+    uint64_t num = (reps + batch - 1) / batch * batch;
+    for(int r = 0; r < rounds; r++) {
+        uint64_t ticks = 0, acc = 0;
+        for(uint64_t done = 0; done < num; done += batch) {
+            reset();
+            uint64_t t0 = latency::now();
+            for(uint64_t i = done; i < done + batch; i++) acc += f(i);
+            ticks += latency::now() - t0;
+        }
+        sink = acc;
+        best = std::min(best, ticks * latency::ns_per_tick() / num);
+    }
+    return best;
+}
+
+template <typename F>
+static double measure(F f) {
+    return measure(reps, f, [] {});
+}
+
+// n distinct keys in insertion order
+static std::vector<_key_t> fixture_keys(int n, bool random, std::mt19937_64 & e) {
+    std::vector<_key_t> keys;
+    if(random) {
+        while((int)keys.size() < n) {
+            _key_t k = e() >> 2;
+            if(std::find(keys.begin(), keys.end(), k) == keys.end()) keys.push_back(k);
+        }
+    } else {
+        for(int i = 0; i < n; i++) keys.push_back((i + 1) * 100);
+    }
+    std::shuffle(keys.begin(), keys.end(), e);
+    return keys;
+}
+
+// keys of the fixture to look up
+static std::vector<_key_t> hit_probes(const std::vector<_key_t> & keys, std::mt19937_64 & e) {
+    std::vector<_key_t> probes(PROBES);
+    for(int i = 0; i < PROBES; i++) probes[i] = keys[e() % keys.size()];
+    return probes;
+}
+
+// keys that are not in the fixture, to be inserted
+static std::vector<_key_t> new_keys(const std::vector<_key_t> & keys, bool random, std::mt19937_64 & e) {
+    std::vector<_key_t> probes(PROBES);
+    for(int i = 0; i < PROBES; i++) {
+        if(!random) {
+            probes[i] = keys[e() % keys.size()] + 50;
+            continue;
+        }
+        do {
+            probes[i] = e() >> 2;
+        } while(std::find(keys.begin(), keys.end(), probes[i]) != keys.end());
+    }
+    return probes;
+}
+
+// nodes are placed and constructed here, their class operator new is private in some trees
+template <typename N>
+static N * make_node() {
+    void * p;
+    if(posix_memalign(&p, 64, sizeof(N)) != 0) exit(-1);
+    return ::new (p) N;
+}
+
+template <typename N>
+static void fill_node(N * n, const std::vector<_key_t> & keys, bool inner) {
+    _key_t split_k;
+    N * split_node;
+    for(_key_t k : keys) n->store(k, (char *)k, split_k, split_node);
+    if(inner) n->leftmost_ptr = (char *)n; // never followed, get_child only returns it
+}
+
+static void bench_slotonly(int fill, bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    using namespace slotonly;
+    string pat = random ? "random" : "seq";
+    int count = std::max(1, CARDINALITY * fill / 100);
+
+    // permutations holding count slots, and count - 1 slots for PERMUT_ADD
+    static uint64_t perms[PERMUTS], short_perms[PERMUTS];
+    for(int j = 0; j < PERMUTS; j++) {
+        std::vector<int> slots(CARDINALITY);
+        for(int s = 0; s < CARDINALITY; s++) slots[s] = s;
+        std::shuffle(slots.begin(), slots.end(), e);
+        perms[j] = short_perms[j] = 0;
+        for(int i = 0; i < count; i++) PERMUT_ADD(perms[j], i, slots[i]);
+        for(int i = 0; i < count - 1; i++) PERMUT_ADD(short_perms[j], i, slots[i]);
+    }
+    std::vector<int> pos(PROBES);
+    for(int i = 0; i < PROBES; i++) pos[i] = e() % count;
+
+    res.push_back({"slotonly PERMUT_READ", pat, count, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)PERMUT_READ(perms[i % PERMUTS], pos[i % PROBES]);
+    })});
+    res.push_back({"slotonly PERMUT_ADD", pat, count, measure([&](uint64_t i) {
+        clobber();
+        uint64_t p = short_perms[i % PERMUTS];
+        PERMUT_ADD(p, pos[i % PROBES], CARDINALITY - 1);
+        return p;
+    })});
+    if(count < CARDINALITY) { // a full node never allocates
+        res.push_back({"slotonly PERMUT_ALLOC", pat, count, measure([&](uint64_t i) {
+            clobber();
+            return (uint64_t)PERMUT_ALLOC(perms[i % PERMUTS]);
+        })});
+    }
+
+    std::vector<_key_t> keys = fixture_keys(count, random, e);
+    Node * leaf = make_node<Node>();
+    for(_key_t k : keys) leaf->store(k, (char *)k);
+    std::vector<_key_t> probes = hit_probes(keys, e);
+    res.push_back({"slotonly linear_search", pat, count, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)leaf->linear_search(probes[i % PROBES]).rec.val;
+    })});
+    free(leaf);
+}
+
+static void bench_unsort(int fill, bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    using namespace btree_unsort;
+    string pat = random ? "random" : "seq";
+    int count = std::max(1, NODE_SIZE * fill / 100);
+
+    std::vector<_key_t> keys = fixture_keys(count, random, e);
+    std::vector<_key_t> probes = hit_probes(keys, e);
+    Node * leaf = make_node<Node>(), * inner = make_node<Node>();
+    fill_node(leaf, keys, false);
+    fill_node(inner, keys, true);
+
+    res.push_back({"btree_unsort get_child leaf", pat, count, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)leaf->get_child(probes[i % PROBES]);
+    })});
+    res.push_back({"btree_unsort get_child inner", pat, count, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)inner->get_child(probes[i % PROBES]);
+    })});
+    free(leaf);
+    free(inner);
+}
+
+static void bench_unsort_median(bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    using namespace btree_unsort;
+    Node * full = make_node<Node>();
+    fill_node(full, fixture_keys(NODE_SIZE, random, e), false);
+    res.push_back({"btree_unsort get_median", random ? "random" : "seq", NODE_SIZE, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)full->get_median();
+    })});
+    free(full);
+}
+
+static void bench_btree(int fill, bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    using namespace btree;
+    string pat = random ? "random" : "seq";
+    int count = std::max(1, NODE_SIZE * fill / 100);
+
+    std::vector<_key_t> keys = fixture_keys(count, random, e);
+    std::vector<_key_t> probes = hit_probes(keys, e);
+    std::vector<_key_t> inserts = new_keys(keys, random, e);
+    Node * leaf = make_node<Node>(), * inner = make_node<Node>();
+    fill_node(leaf, keys, false);
+    fill_node(inner, keys, true);
+
+    res.push_back({"btree Node::get_child leaf", pat, count, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)leaf->get_child(probes[i % PROBES]);
+    })});
+    res.push_back({"btree Node::get_child inner", pat, count, measure([&](uint64_t i) {
+        clobber();
+        return (uint64_t)inner->get_child(probes[i % PROBES]);
+    })});
+
+    std::vector<Node *> copies(COPIES);
+    for(Node * & c : copies) c = make_node<Node>();
+    _key_t split_k;
+    Node * split_node;
+    if(count < NODE_SIZE) {
+        res.push_back({"btree Node::store", pat, count, measure(COPIES, [&](uint64_t i) {
+            return (uint64_t)copies[i % COPIES]->store(inserts[i % PROBES], 0, split_k, split_node);
+        }, [&] {
+            for(Node * c : copies) memcpy((void *)c, leaf, sizeof(Node));
+        })});
+    }
+
+    for(Node * c : copies) free(c);
+    free(leaf);
+    free(inner);
+}
+
+static void bench_btree_split(bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    using namespace btree;
+    std::vector<_key_t> keys = fixture_keys(NODE_SIZE, random, e);
+    std::vector<_key_t> inserts = new_keys(keys, random, e);
+    std::vector<Node *> copies(COPIES);
+    for(Node * & c : copies) c = make_node<Node>();
+    _key_t split_k;
+
+    // every store into a full leaf splits it
+    Node * full = make_node<Node>();
+    fill_node(full, keys, false);
+    std::vector<Node *> splits(COPIES, (Node *)NULL);
+    res.push_back({"btree split", random ? "random" : "seq", NODE_SIZE, measure(COPIES, [&](uint64_t i) {
+        Node * c = copies[i % COPIES];
+        c->store(inserts[i % PROBES], 0, split_k, splits[i % COPIES]);
+        return (uint64_t)split_k;
+    }, [&] {
+        for(Node * & s : splits) {
+            free(s); // allocated with posix_memalign by Node::operator new, a leaf owns no children
+            s = NULL;
+        }
+        for(Node * c : copies) memcpy((void *)c, full, sizeof(Node));
+    })});
+    for(Node * s : splits) free(s);
+
+    for(Node * c : copies) free(c);
+    free(full);
+}
+
+// find through tree_api, on the engine itself and as a batch, on a tree of size records
+template <typename T>
+static void bench_dispatch(const char * name, int size, bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    const uint64_t BATCH = 64;
+    string pat = random ? "random" : "seq";
+    std::vector<_key_t> keys(size);
+    for(int i = 0; i < size; i++) keys[i] = random ? (_key_t)(e() >> 2) : (i + 1) * 100;
+    std::shuffle(keys.begin(), keys.end(), e);
+    std::vector<_key_t> probes = hit_probes(keys, e);
+
+    api_adapter<T> * adapter = new api_adapter<T>;
+    T & tree = adapter->engine();
+    for(_key_t k : keys) tree.insert(k, k);
+    tree_api * api = (tree_api *)adapter;
+    asm volatile("" : "+r"(api)); // hide the dynamic type, or the call may be devirtualized
+
+    _value_t v = 0;
+    res.push_back({string(name) + " find virtual", pat, size, measure([&](uint64_t i) {
+        api->find(probes[i % PROBES], v);
+        return (uint64_t)v;
+    })});
+    res.push_back({string(name) + " find static", pat, size, measure([&](uint64_t i) {
+        tree.find(probes[i % PROBES], v);
+        return (uint64_t)v;
+    })});
+
+    std::vector<_value_t> vals(BATCH);
+    uint64_t saved = reps;
+    reps = std::max<uint64_t>(1, reps / BATCH);
+    res.push_back({string(name) + " find_batch", pat, size, measure([&](uint64_t i) {
+        tree.find_batch(&probes[i * BATCH % PROBES], BATCH, vals.data());
+        return (uint64_t)vals[BATCH - 1];
+    }) / BATCH});
+    reps = saved;
+    delete api;
+}
+
+// find on string keys in btree_str and in std::map, the integer lines are the find static ones above
+static void bench_strings(int size, bool random, std::mt19937_64 & e, std::vector<result_t> & res) {
+    string pat = random ? "random" : "seq";
+    std::vector<string> keys(size);
+    char buf[32];
+    for(int i = 0; i < size; i++) {
+        snprintf(buf, sizeof(buf), "user%020lu", random ? (uint64_t)(e() >> 2) : (uint64_t)(i + 1) * 100);
+        keys[i] = buf;
+    }
+    std::shuffle(keys.begin(), keys.end(), e);
+    std::vector<string> probes(PROBES);
+    for(int i = 0; i < PROBES; i++) probes[i] = keys[e() % size];
+
+    btree_str::btree * tree = new btree_str::btree;
+    std::map<string, _value_t> m;
+    for(int i = 0; i < size; i++) {
+        tree->insert(keys[i], i);
+        m[keys[i]] = i;
+    }
+
+    _value_t v = 0;
+    res.push_back({"btree_str find", pat, size, measure([&](uint64_t i) {
+        tree->find(probes[i % PROBES], v);
+        return (uint64_t)v;
+    })});
+    res.push_back({"std::map<string> find", pat, size, measure([&](uint64_t i) {
+        return (uint64_t)m.find(probes[i % PROBES])->second;
+    })});
+    delete tree;
+}
+
+int main(int argc, char ** argv) {
+    cmdline::parser pars;
+    pars.add<string>("fill", 'f', "fill levels of the nodes in percent, comma separated", false, "25,50,75,100");
+    pars.add<string>("pattern", 'k', "key patterns of the nodes: seq, random or both", false, "both",
+                     cmdline::oneof<string>("seq", "random", "both"));
+    pars.add<int>("reps", 'r', "calls per round", false, 1000000);
+    pars.add<int>("rounds", 'R', "rounds, the best one is reported", false, 5);
+    pars.add<int>("seed", 's', "seed of the fixtures", false, 1);
+    pars.add<string>("filter", 'F', "only the primitives whose name contains this", false, "");
+    pars.add<string>("csv", 'c', "write the results as CSV to this file", false, "");
+    pars.parse_check(argc, argv);
+
+    reps = pars.get<int>("reps");
+    rounds = pars.get<int>("rounds");
+    std::mt19937_64 e(pars.get<int>("seed"));
+
+    std::vector<int> fills;
+    string f = pars.get<string>("fill");
+    for(size_t pos = 0; pos < f.size();) {
+        size_t end = f.find(',', pos);
+        if(end == string::npos) end = f.size();
+        int v = atoi(f.substr(pos, end - pos).c_str());
+        if(v < 1 || v > 100) {
+            printf("Invalid fill level %d\n", v);
+            exit(-1);
+        }
+        fills.push_back(v);
+        pos = end + 1;
+    }
+    std::vector<bool> patterns;
+    if(pars.get<string>("pattern") != "random") patterns.push_back(false);
+    if(pars.get<string>("pattern") != "seq") patterns.push_back(true);
+
+    std::vector<result_t> res;
+    for(bool random : patterns) {
+        for(int fill : fills) {
+            bench_slotonly(fill, random, e, res);
+            bench_unsort(fill, random, e, res);
+            bench_btree(fill, random, e, res);
+        }
+        bench_unsort_median(random, e, res);
+        bench_btree_split(random, e, res);
+        for(int size : {1024, 16384}) {
+            bench_dispatch<btree::btree>("btree", size, random, e, res);
+            bench_dispatch<btree::csb>("btree_csb", size, random, e, res);
+            bench_dispatch<btree_unsort::btree>("btree_unsort", size, random, e, res);
+            bench_dispatch<slotonly::wbtree>("slotonly", size, random, e, res);
+            bench_strings(size, random, e, res);
+        }
+    }
+
+    std::vector<result_t> out;
+    for(const result_t & r : res) {
+        if(r.prim.find(pars.get<string>("filter")) != string::npos) out.push_back(r);
+    }
+    std::stable_sort(out.begin(), out.end(), [](const result_t & a, const result_t & b) { return a.prim < b.prim; });
+
+    printf("%-30s %-7s %7s %10s\n", "primitive", "keys", "records", "ns/call");
+    for(const result_t & r : out) printf("%-30s %-7s %7d %10.2f\n", r.prim.c_str(), r.pattern.c_str(), r.fill, r.ns);
+
+    if(!pars.get<string>("csv").empty()) {
+        FILE * csv = fopen(pars.get<string>("csv").c_str(), "w");
+        if(csv == NULL) {
+            perror("fopen");
+            exit(-1);
+        }
+        fprintf(csv, "primitive,keys,records,ns_per_call\n");
+        for(const result_t & r : out) fprintf(csv, "%s,%s,%d,%.3f\n", r.prim.c_str(), r.pattern.c_str(), r.fill, r.ns);
+        fclose(csv);
+    }
+    return 0;
+}
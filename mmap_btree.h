@@ -0,0 +1,381 @@
+/*  mmap_btree.h - a file-backed btree whose nodes live in an mmaped region
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __MMAP_BTREE__
+#define __MMAP_BTREE__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <cstdio>
+
+#include "base.h"
+#include "btree.h"
+#include "mmap_region.h"
+
+namespace mmap_btree {
+using std::string;
+
+/*
+    Same node layout as btree::Node, but the child and sibling links are
+    offsets into the region instead of raw pointers. Reopening a tree is just
+    mapping the file again: nodes are paged in on first touch.
+
+    The image on disk is only consistent after a clean close (or sync() with
+    no operation in flight); this mode does not order its writes. A file that
+    was not closed cleanly is refused when it is opened again.
+*/
+const int PAGESIZE = btree::PAGESIZE;
+const int NODE_SIZE = btree::NODE_SIZE;
+
+// the slots of mmap_region::header_t::user used by the tree
+const int ROOT_SLOT = 0;
+
+struct Record {
+    _key_t key;
+    uint64_t val; // value in the leaf nodes, child offset in the inner nodes
+};
+
+class Node {
+    public:
+        uint64_t leftmost_off; // 0 means the node is a leaf node
+        uint64_t sibling_off;
+        uint64_t count;
+        char dummy[8];         // the total meta data is 32 bytes
+        Record recs[NODE_SIZE];
+    private:
+        void insert(_key_t k, uint64_t v) {
+            uint64_t i;
+            for(i = 0; i < count; i++) {
+                if(recs[i].key > k) {
+                    break;
+                }
+            }
+
+            memmove(&recs[i + 1], &recs[i], sizeof(Record) * (count - i));
+            recs[i] = {k, v};
+            count += 1;
+        }
+
+    public:
+        uint64_t get_child(_key_t key) { // same semantics as btree::Node::get_child
+            if(leftmost_off == 0) {
+                uint64_t i;
+                for(i = 0; i < count; i++) {
+                    if(recs[i].key >= key) {
+                        break;
+                    }
+                }
+
+                if(i < count && recs[i].key == key)
+                    return recs[i].val;
+                else
+                    return 0;
+            } else {
+                uint64_t i;
+                for(i = 0; i < count; i++) {
+                    if(recs[i].key > key) {
+                        break;
+                    }
+                }
+
+                if(i == 0)
+                    return leftmost_off;
+                else
+                    return recs[i - 1].val;
+            }
+        }
+
+        // split_node is allocated by the caller-provided region, its offset is split_off
+        bool store(mmap_region & r, _key_t k, uint64_t v, _key_t & split_k, uint64_t & split_off) {
+            if(count == NODE_SIZE) {
+                split_off = r.alloc();
+                Node * split_node = r.at<Node>(split_off);
+
+                uint64_t m = count / 2;
+                split_k = recs[m].key;
+                if(leftmost_off == 0) {
+                    split_node->count = count - m;
+                    memcpy(&(split_node->recs[0]), &(recs[m]), sizeof(Record) * (split_node->count));
+                } else {
+                    split_node->leftmost_off = recs[m].val;
+
+                    split_node->count = count - m - 1;
+                    memcpy(&(split_node->recs[0]), &(recs[m + 1]), sizeof(Record) * (split_node->count));
+                }
+                count = m;
+
+                split_node->sibling_off = sibling_off;
+                sibling_off = split_off;
+
+                if(split_k > k) {
+                    insert(k, v);
+                } else {
+                    split_node->insert(k, v);
+                }
+                return true;
+            } else {
+                insert(k, v);
+                return false;
+            }
+        }
+
+        bool lookup(_key_t k, uint64_t & v) { // the value of k in a leaf
+            for(uint64_t i = 0; i < count; i++) {
+                if(recs[i].key == k) {
+                    v = recs[i].val;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool update(_key_t k, uint64_t v) {
+            for(uint64_t i = 0; i < count; i++) {
+                if(recs[i].key == k) {
+                    recs[i].val = v;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool remove(_key_t k) {
+            int pos = -1;
+            for(int i = 0; i < count; i++) {
+                if(recs[i].key == k){
+                    pos = i;
+                    break;
+                }
+            }
+            if(pos >= 0) {
+                memmove(&recs[pos], &recs[pos + 1], sizeof(Record) * (count - pos - 1));
+                count -= 1;
+                return true;
+            }
+            return false;
+        }
+
+        int get_lrchild(_key_t k, uint64_t & left, uint64_t & right) {
+            int16_t i = 0;
+            for( ; i < count; i++) {
+                if(recs[i].key > k)
+                    break;
+            }
+
+            if(i == 0) {
+                left = 0;
+            } else if(i == 1) {
+                left = leftmost_off;
+            } else {
+                left = recs[i - 2].val;
+            }
+
+            if(i == count) {
+                right = 0;
+            } else {
+                right = recs[i].val;
+            }
+            return i;
+        }
+
+        static void merge(mmap_region & r, Node * left, uint64_t right_off, _key_t merge_key) {
+            Node * right = r.at<Node>(right_off);
+            if(left->leftmost_off != 0) {
+                left->recs[left->count++] = {merge_key, right->leftmost_off};
+            }
+            for(int i = 0; i < right->count; i++) {
+                left->recs[left->count++] = right->recs[i];
+            }
+            left->sibling_off = right->sibling_off;
+            r.free(right_off);
+        }
+
+        void print(mmap_region & r, string prefix) {
+            printf("%s[(%lu) ", prefix.c_str(), count);
+            for(int i = 0; i < count; i++) {
+                printf("(%ld, %ld) ", recs[i].key, (int64_t)recs[i].val);
+            }
+            printf("]\n");
+
+            if(leftmost_off != 0) {
+                r.at<Node>(leftmost_off)->print(r, prefix + "    ");
+                for(int i = 0; i < count; i++) {
+                    r.at<Node>(recs[i].val)->print(r, prefix + "    ");
+                }
+            }
+        }
+};
+
+static_assert(sizeof(Node) == PAGESIZE, "a node must fill exactly one block");
+
+class btree : public tree_base<btree, _key_t, _value_t> {
+    private:
+        mmap_region region;
+        uint64_t & root; // lives in the region header, so it survives a restart
+
+        inline Node * node(uint64_t off) {
+            return region.at<Node>(off);
+        }
+
+    public:
+        btree(const char * path) : region(path, PAGESIZE), root(region.header()->user[ROOT_SLOT]) {
+            if(region.was_dirty()) { // the tree has no recovery, a half done split may be in the file
+                fprintf(stderr, "mmap_btree: %s was not closed cleanly, it may be inconsistent\n", path);
+                exit(-1);
+            }
+            if(root == 0) {
+                root = region.alloc();
+            }
+        }
+
+        ~btree() {} // the region is synced and unmapped, the nodes stay in the file
+
+        void sync() {
+            region.sync();
+        }
+
+        bool find(_key_t key, _value_t &val) {
+            Node * cur = node(root);
+            while(cur->leftmost_off != 0) {
+                cur = node(cur->get_child(key));
+            }
+
+            uint64_t v;
+            if(!cur->lookup(key, v)) return false;
+
+            val = (_value_t)v;
+            return true;
+        }
+
+        void insert(_key_t key, _value_t val) {
+            _key_t split_k;
+            uint64_t split_off;
+            bool splitIf = insert_recursive(root, key, val, split_k, split_off);
+
+            if(splitIf) {
+                uint64_t new_root = region.alloc();
+                Node * n = node(new_root);
+                n->leftmost_off = root;
+                n->recs[0] = {split_k, split_off};
+                n->count = 1;
+                root = new_root;
+            }
+        }
+
+        bool update(_key_t key, _value_t value) {
+            Node * cur = node(root);
+            while(cur->leftmost_off != 0) {
+                cur = node(cur->get_child(key));
+            }
+            return cur->update(key, (uint64_t)value);
+        }
+
+        bool remove(_key_t key) {
+            Node * r = node(root);
+            if(r->leftmost_off == 0) {
+                return r->remove(key);
+            }
+            else {
+                uint64_t child = r->get_child(key);
+
+                bool removed = false;
+                bool shouldMrg = remove_recursive(child, key, removed);
+
+                if(shouldMrg) {
+                    merge_child(r, child, key);
+
+                    if(r->count == 0) { // the root is empty
+                        uint64_t old_root = root;
+                        root = r->leftmost_off;
+                        region.free(old_root);
+                    }
+                }
+
+                return removed;
+            }
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            Node * cur = node(root);
+            while(cur->leftmost_off != 0) {
+                cur = node(cur->get_child(start_key));
+            }
+
+            int cnt = 0;
+            uint64_t i = 0;
+            while(i < cur->count && cur->recs[i].key < start_key) i++;
+            while(cnt < num) {
+                for(; i < cur->count && cnt < num; i++) {
+                    vals[cnt++] = (_value_t)cur->recs[i].val;
+                }
+                if(cur->sibling_off == 0) break;
+                cur = node(cur->sibling_off);
+                i = 0;
+            }
+            return cnt;
+        }
+
+        void printAll() {
+            node(root)->print(region, string(""));
+        }
+
+    private:
+        bool insert_recursive(uint64_t off, _key_t k, _value_t v, _key_t &split_k, uint64_t &split_off) {
+            Node * n = node(off);
+            if(n->leftmost_off == 0) {
+                if(n->update(k, (uint64_t)v)) return false; // the key is in the tree, its value is replaced
+                return n->store(region, k, (uint64_t)v, split_k, split_off);
+            } else {
+                uint64_t child = n->get_child(k);
+
+                _key_t split_k_child;
+                uint64_t split_off_child;
+                bool splitIf = insert_recursive(child, k, v, split_k_child, split_off_child);
+
+                if(splitIf) {
+                    return n->store(region, split_k_child, split_off_child, split_k, split_off);
+                }
+                return false;
+            }
+        }
+
+        void merge_child(Node * n, uint64_t child, _key_t k) {
+            uint64_t leftsib = 0, rightsib = 0;
+            int pos = n->get_lrchild(k, leftsib, rightsib);
+            uint64_t child_cnt = node(child)->count;
+
+            if(leftsib != 0 && (child_cnt + node(leftsib)->count) < NODE_SIZE) {
+                _key_t merge_key = n->recs[pos - 1].key;
+                n->remove(merge_key);
+                Node::merge(region, node(leftsib), child, merge_key);
+            } else if (rightsib != 0 && (child_cnt + node(rightsib)->count) < NODE_SIZE) {
+                _key_t merge_key = n->recs[pos].key;
+                n->remove(merge_key);
+                Node::merge(region, node(child), rightsib, merge_key);
+            }
+        }
+
+        bool remove_recursive(uint64_t off, _key_t k, bool & removed) {
+            Node * n = node(off);
+            if(n->leftmost_off == 0) {
+                removed = n->remove(k);
+                return n->count <= NODE_SIZE / 3;
+            }
+            else {
+                uint64_t child = n->get_child(k);
+
+                bool shouldMrg = remove_recursive(child, k, removed);
+
+                if(shouldMrg) {
+                    merge_child(n, child, k);
+                    return n->count <= NODE_SIZE / 3;
+                }
+                return false;
+            }
+        }
+}; // class btree
+
+}; // namespace mmap_btree
+
+#endif
@@ -0,0 +1,183 @@
+/*  mmap_region.h - a file-backed memory region addressed by offsets
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __MMAP_REGION__
+#define __MMAP_REGION__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+    The whole file is mapped into one virtual address range that is reserved
+    up front, so growing the file never moves the base address and raw pointers
+    taken from the region stay valid for the lifetime of the mapping.
+
+    Layout: the first 4 KB page holds the header, followed by an optional meta
+    area owned by the user of the region (meta_size counts the header page too).
+    The rest of the file is cut into fixed size blocks (256 B or 512 B nodes,
+    so 16 or 8 blocks per page).
+    A block is addressed by its byte offset from the start of the file, offset 0
+    (the header) doubles as the NULL reference.
+*/
+class mmap_region {
+public:
+    static const uint64_t MAGIC = 0x4254524545524547; // "BTREEREG"
+    static const uint64_t HEADER_SIZE = 4096;
+    static const int USER_SLOTS = 8;
+
+    struct header_t {
+        uint64_t magic;
+        uint64_t block_size;
+        uint64_t file_size;   // bytes of the file that are mapped
+        uint64_t alloc_off;   // bump pointer, everything after it is unused
+        uint64_t free_head;   // singly linked list of freed blocks
+        uint64_t clean;       // set when the region is closed properly
+        uint64_t user[USER_SLOTS]; // root offset, tree height... owned by the tree
+        uint64_t meta_size;   // header page plus the user meta area, 0 in the files written before it was added
+    };
+
+private:
+    int fd;
+    char * base;
+    uint64_t reserved;
+    header_t * hdr;
+    bool created;
+    bool dirty; // the last user of the file did not close the region
+
+    void grow(uint64_t min_size) {
+        uint64_t old_size = hdr->file_size;
+        uint64_t new_size = old_size;
+        while(new_size < min_size) new_size *= 2;
+
+        if(new_size > reserved) {
+            fprintf(stderr, "mmap_region: reserved address range exhausted\n");
+            exit(-1);
+        }
+        if(ftruncate(fd, new_size) != 0) {
+            perror("mmap_region: ftruncate");
+            exit(-1);
+        }
+        void * p = mmap(base + old_size, new_size - old_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, fd, old_size);
+        if(p == MAP_FAILED) {
+            perror("mmap_region: mmap");
+            exit(-1);
+        }
+        hdr->file_size = new_size;
+    }
+
+public:
+    mmap_region(const char * path, uint64_t block_size, uint64_t meta_size = HEADER_SIZE,
+                uint64_t init_size = 1 << 20, uint64_t reserve = (uint64_t)1 << 40) : reserved(reserve), created(false), dirty(false) {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if(fd < 0) {
+            perror("mmap_region: open");
+            exit(-1);
+        }
+
+        struct stat st;
+        fstat(fd, &st);
+        uint64_t file_size = st.st_size;
+        if(file_size < HEADER_SIZE) { // a new file
+            created = true;
+            file_size = init_size < 2 * meta_size ? 2 * meta_size : init_size;
+            if(ftruncate(fd, file_size) != 0) {
+                perror("mmap_region: ftruncate");
+                exit(-1);
+            }
+        }
+
+        // reserve the address range, then map the file at its beginning
+        base = (char *) mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(base == MAP_FAILED) {
+            perror("mmap_region: reserve");
+            exit(-1);
+        }
+        if(mmap(base, file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            perror("mmap_region: mmap");
+            exit(-1);
+        }
+        hdr = (header_t *) base;
+
+        if(created) {
+            memset(hdr, 0, sizeof(header_t));
+            hdr->block_size = block_size;
+            hdr->meta_size = meta_size;
+            hdr->file_size = file_size;
+            hdr->alloc_off = meta_size;
+            hdr->magic = MAGIC;
+        } else if(hdr->magic != MAGIC || hdr->block_size != block_size
+                  || (hdr->meta_size == 0 ? HEADER_SIZE : hdr->meta_size) != meta_size) {
+            fprintf(stderr, "mmap_region: %s is not a region of %lu B blocks\n", path, block_size);
+            exit(-1);
+        } else {
+            hdr->file_size = file_size; // the file may have grown just before a crash
+            dirty = hdr->clean == 0;
+        }
+        hdr->clean = 0;
+    }
+
+    ~mmap_region() {
+        hdr->clean = 1;
+        msync(base, hdr->file_size, MS_SYNC);
+        munmap(base, reserved);
+        close(fd);
+    }
+
+    // true if the file was empty and the region has just been formatted
+    bool is_new() const { return created; }
+
+    // true if the region was not closed properly the last time, by a crash or a kill. A user
+    // without its own recovery must not trust the content then
+    bool was_dirty() const { return dirty; }
+
+    header_t * header() { return hdr; }
+
+    // the user meta area, right after the header in the first page
+    char * meta() const { return base + ((sizeof(header_t) + 63) & ~63UL); }
+
+    char * get_base() const { return base; }
+
+    uint64_t size() const { return hdr->file_size; }
+
+    template <typename T>
+    inline T * at(uint64_t off) const {
+        return off == 0 ? (T *) NULL : (T *)(base + off);
+    }
+
+    inline uint64_t offset(const void * ptr) const {
+        return ptr == NULL ? 0 : (const char *)ptr - base;
+    }
+
+    uint64_t alloc() {
+        uint64_t off = hdr->free_head;
+        if(off != 0) {
+            hdr->free_head = *(uint64_t *)(base + off);
+        } else {
+            off = hdr->alloc_off;
+            if(off + hdr->block_size > hdr->file_size)
+                grow(off + hdr->block_size);
+            hdr->alloc_off += hdr->block_size;
+        }
+        memset(base + off, 0, hdr->block_size);
+        return off;
+    }
+
+    void free(uint64_t off) {
+        *(uint64_t *)(base + off) = hdr->free_head;
+        hdr->free_head = off;
+    }
+
+    void sync() {
+        msync(base, hdr->file_size, MS_SYNC);
+    }
+};
+
+#endif //__MMAP_REGION__
@@ -0,0 +1,130 @@
+/*  perf.h - hardware and software event counters around a benchmark phase
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __PERF__
+#define __PERF__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+    The events are opened with perf_event_open in three groups, the events of
+    a group are always scheduled together so their ratios are exact. When the
+    PMU has too few counters the kernel multiplexes the groups, the values are
+    scaled by the fraction of time a group was running.
+
+    Only user space is counted, which kernel.perf_event_paranoid <= 2 allows
+    for our own process. An event that cannot be opened (no PMU in a VM, a
+    stricter paranoid level, seccomp) is reported as unavailable, the others
+    keep working. Threads created after the counters are opened are counted
+    too.
+*/
+namespace perf {
+
+struct event_t {
+    const char * name;
+    uint32_t type;
+    uint64_t config;
+    int group;
+};
+
+#define PERF_CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const event_t EVENTS[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0},
+    {"L1d-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), 1},
+    {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1},
+    {"dTLB-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), 1},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, 2},
+    {"ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 2},
+};
+
+const int EVENT_NUM = sizeof(EVENTS) / sizeof(event_t);
+const int GROUP_NUM = 3;
+
+class counters {
+    private:
+        int fds[EVENT_NUM];
+        int leaders[GROUP_NUM]; // the first event of a group that could be opened, -1 if none
+
+        static int open_event(const event_t & ev, int group_fd) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = ev.type;
+            attr.config = ev.config;
+            attr.disabled = group_fd < 0; // the leader starts and stops the group
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+        }
+
+    public:
+        counters() {
+            for(int g = 0; g < GROUP_NUM; g++) leaders[g] = -1;
+
+            int failed = 0, err = 0;
+            for(int i = 0; i < EVENT_NUM; i++) {
+                int g = EVENTS[i].group;
+                fds[i] = open_event(EVENTS[i], leaders[g]);
+                if(fds[i] < 0) {
+                    failed += 1;
+                    err = errno;
+                } else if(leaders[g] < 0) {
+                    leaders[g] = fds[i];
+                }
+            }
+            if(failed > 0) {
+                fprintf(stderr, "perf: %d of %d events are unavailable (%s), see kernel.perf_event_paranoid\n",
+                        failed, EVENT_NUM, strerror(err));
+            }
+        }
+
+        ~counters() {
+            for(int i = 0; i < EVENT_NUM; i++) {
+                if(fds[i] >= 0) close(fds[i]);
+            }
+        }
+
+        bool available(int i) const {
+            return fds[i] >= 0;
+        }
+
+        void start() {
+            for(int g = 0; g < GROUP_NUM; g++) {
+                if(leaders[g] < 0) continue;
+                ioctl(leaders[g], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(leaders[g], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+        }
+
+        void stop() {
+            for(int g = 0; g < GROUP_NUM; g++) {
+                if(leaders[g] >= 0) ioctl(leaders[g], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            }
+        }
+
+        // the count of event i since start(), scaled if it was multiplexed; false if it was never counted
+        bool value(int i, double & v) const {
+            if(fds[i] < 0) return false;
+
+            uint64_t buf[3]; // value, time enabled, time running
+            if(read(fds[i], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0) return false;
+            v = buf[2] < buf[1] ? (double)buf[0] * buf[1] / buf[2] : (double)buf[0];
+            return true;
+        }
+};
+
+}; // namespace perf
+
+#endif //__PERF__
@@ -0,0 +1,84 @@
+/*  persist.h - cache line flush and fence primitives for persistent memory
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __PERSIST__
+#define __PERSIST__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+    The flush instruction is selected at compile time:
+        -DPERSIST_CLWB        clwb + sfence
+        -DPERSIST_CLFLUSHOPT  clflushopt + sfence
+        (default)             emulation: no instruction is issued, the calls
+                              are only counted and reported to the tracer
+    The instructions are emitted with their raw encodings, so no -m flag is
+    needed to build the header.
+*/
+namespace persist {
+
+const int CACHE_LINE = 64;
+
+// observes every flush and fence, e.g. to emulate what survives a crash
+class tracer {
+public:
+    virtual ~tracer() {}
+    virtual void on_flush(const void * line) = 0; // called once per cache line
+    virtual void on_fence() = 0;
+};
+
+struct counters_t {
+    uint64_t flushes; // cache lines
+    uint64_t fences;
+};
+
+static inline tracer *& current_tracer() {
+    static tracer * t = NULL;
+    return t;
+}
+
+static inline counters_t & counters() {
+    static counters_t c = {0, 0};
+    return c;
+}
+
+static inline void set_tracer(tracer * t) {
+    current_tracer() = t;
+}
+
+static inline void flush(const void * addr, size_t len) {
+    uintptr_t line = (uintptr_t)addr & ~(uintptr_t)(CACHE_LINE - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    tracer * t = current_tracer();
+    for(; line < end; line += CACHE_LINE) {
+        #if defined(PERSIST_CLWB)
+            asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)line));
+        #elif defined(PERSIST_CLFLUSHOPT)
+            asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)line));
+        #endif
+        counters().flushes += 1;
+        if(t != NULL) t->on_flush((const void *)line);
+    }
+}
+
+static inline void fence() {
+    #if defined(PERSIST_CLWB) || defined(PERSIST_CLFLUSHOPT)
+        asm volatile("sfence" ::: "memory");
+    #else
+        asm volatile("" ::: "memory");
+    #endif
+    counters().fences += 1;
+    tracer * t = current_tracer();
+    if(t != NULL) t->on_fence();
+}
+
+// flush the range and wait until it is durable
+static inline void persist(const void * addr, size_t len) {
+    flush(addr, len);
+    fence();
+}
+
+}; // namespace persist
+
+#endif //__PERSIST__
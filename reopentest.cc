@@ -0,0 +1,208 @@
+/*  reopentest.cc - closes and reopens the file-backed trees
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+
+    Every case runs a few operations on a tree, closes it (or lets a child
+    process die with the tree open) and checks what the reopened tree holds
+    against a reference model. A case that fails prints what it expected.
+*/
+#include <iostream>
+#include <map>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "mmap_btree.h"
+#include "btree_unsort.h"
+#include "wal.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+
+typedef std::map<_key_t, _value_t> model_t;
+
+static int failed = 0;
+
+static void check(bool ok, const char * name) {
+    cout << (ok ? "ok      " : "FAILED  ") << name << endl;
+    failed += !ok;
+}
+
+// true if every key of m is found with its value
+template <typename T>
+static bool matches(T & tree, const model_t & m) {
+    for(auto & kv : m) {
+        _value_t v;
+        if(!tree.find(kv.first, v) || v != kv.second) {
+            cout << "    key " << kv.first << " expected " << kv.second << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// true if none of the keys of gone is found
+template <typename T>
+static bool absent(T & tree, const std::vector<_key_t> & gone) {
+    for(_key_t k : gone) {
+        _value_t v;
+        if(tree.find(k, v)) {
+            cout << "    key " << k << " was removed, found " << v << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// the exit status of f run in a child process
+template <typename F>
+static int in_child(F f) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        f();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void mmap_btree_cases(const string & file) {
+    model_t m;
+    for(_key_t k = 1; k <= 2000; k++) m[k] = k * 3;
+
+    remove(file.c_str());
+    {
+        mmap_btree::btree tree(file.c_str());
+        for(auto & kv : m) tree.insert(kv.first, kv.second);
+    }
+    {
+        mmap_btree::btree tree(file.c_str());
+        check(matches(tree, m), "mmap_btree: reopen after a clean close");
+    }
+
+    // a file of the first format has no meta_size, the bytes after the header are zero
+    uint64_t zero = 0;
+    int fd = open(file.c_str(), O_WRONLY);
+    check(pwrite(fd, &zero, sizeof(zero), offsetof(mmap_region::header_t, meta_size)) == sizeof(zero), "mmap_btree: clear meta_size");
+    close(fd);
+    {
+        mmap_btree::btree tree(file.c_str());
+        check(matches(tree, m), "mmap_btree: reopen a file without meta_size");
+    }
+
+    // inserts over a key, removes and keys that were never there
+    std::vector<_key_t> gone;
+    {
+        mmap_btree::btree tree(file.c_str());
+        for(_key_t k = 2; k <= 2000; k += 5) {
+            tree.insert(k, k * 10);
+            m[k] = k * 10;
+        }
+        bool all_removed = true;
+        for(_key_t k = 3; k <= 2000; k += 2) {
+            all_removed &= tree.remove(k);
+            m.erase(k);
+            gone.push_back(k);
+        }
+        check(all_removed, "mmap_btree: remove of a present key");
+        check(!tree.remove(3) && !tree.remove(100000) && !tree.update(100000, 1), "mmap_btree: update and remove of a missing key");
+        gone.push_back(100000);
+        check(matches(tree, m) && absent(tree, gone), "mmap_btree: the live tree after inserts over a key and removes");
+        check(tree.scan(0, 10000, std::vector<_value_t>(10000).data()) == (int)m.size(), "mmap_btree: one record per key");
+    }
+    {
+        mmap_btree::btree tree(file.c_str());
+        check(matches(tree, m) && absent(tree, gone), "mmap_btree: reopen after inserts over a key and removes");
+    }
+
+    // the child dies with the tree open, its writes reach the file but the region is not closed
+    int status = in_child([&] {
+        mmap_btree::btree * tree = new mmap_btree::btree(file.c_str());
+        tree->insert(5000, 1);
+        _exit(0);
+    });
+    check(status == 0, "mmap_btree: the child ran");
+    status = in_child([&] {
+        mmap_btree::btree tree(file.c_str());
+    });
+    check(status != 0, "mmap_btree: a file that was not closed is refused");
+
+    remove(file.c_str());
+}
+
+// the tree and the recovered one must agree after inserts, updates, inserts over a key and removes
+template <typename Tree>
+static void wal_cases(const string & prefix, const char * name, uint64_t checkpoint_every) {
+    model_t m;
+    std::vector<_key_t> gone;
+    string what = string("wal ") + name + (checkpoint_every ? " with checkpoints" : "");
+    {
+        wal::durable<Tree> tree(prefix, false, checkpoint_every);
+        for(_key_t k = 1; k <= 3000; k++) {
+            tree.insert(k, k);
+            m[k] = k;
+        }
+        for(_key_t k = 1; k <= 3000; k += 3) {
+            bool ok = tree.update(k, -k);
+            m[k] = -k;
+            if(!ok) {
+                check(false, (what + ": update of a present key").c_str());
+                break;
+            }
+        }
+        for(_key_t k = 2; k <= 3000; k += 5) {
+            tree.insert(k, k * 10);
+            m[k] = k * 10;
+        }
+        for(_key_t k = 3; k <= 3000; k += 4) {
+            tree.remove(k);
+            m.erase(k);
+            gone.push_back(k);
+        }
+        check(!tree.update(100000, 1) && !tree.remove(100000), (what + ": update and remove of a missing key").c_str());
+        check(matches(tree, m) && absent(tree, gone), (what + ": the live tree").c_str());
+    }
+    {
+        wal::durable<Tree> tree(prefix, false, checkpoint_every);
+        check(matches(tree, m) && absent(tree, gone), (what + ": reopen after updates and removes").c_str());
+    }
+}
+
+// remove the files of dir and dir itself
+static void clean_dir(const string & dir) {
+    DIR * d = opendir(dir.c_str());
+    if(d == NULL) return;
+    while(struct dirent * e = readdir(d)) {
+        string name = e->d_name;
+        if(name != "." && name != "..") remove((dir + "/" + name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+int main(int argc, char ** argv) {
+    string dir = argc > 1 ? argv[1] : "/tmp";
+    mmap_btree_cases(dir + "/reopentest.mmap");
+
+    string tmpl = dir + "/reopentest.XXXXXX";
+    if(mkdtemp(&tmpl[0]) == NULL) {
+        perror("mkdtemp");
+        exit(-1);
+    }
+    wal_cases<btree::btree>(tmpl + "/btree", "btree", 0);
+    wal_cases<btree::btree>(tmpl + "/btree_ckpt", "btree", 1000);
+    wal_cases<btree_unsort::btree>(tmpl + "/btree_unsort", "btree_unsort", 0);
+    wal_cases<btree_unsort::btree>(tmpl + "/btree_unsort_ckpt", "btree_unsort", 1000);
+    clean_dir(tmpl);
+
+    cout << (failed == 0 ? "all cases passed" : "some cases failed") << endl;
+    return failed == 0 ? 0 : 1;
+}
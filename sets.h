@@ -0,0 +1,437 @@
+/*  sets.h - the engines as sets of keys, leaves without the value column
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __SETS__
+#define __SETS__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+#include <algorithm>
+
+#include "base.h"
+#include "btree.h"
+#include "btree_unsort.h"
+#include "slotonly.h"
+
+/*
+    Membership sets: contains, insert, erase and scan over the keys. The
+    leaves keep the keys only, each engine's leaf discipline without the
+    value column:
+
+        sorted_leaf   the btree: sorted keys, binary search       29 keys in 256 B
+        unsort_leaf   the btree(unsort node): free slots in a bitmap,
+                      linear search, sorted when split or scanned  61 keys in 512 B
+        slot_leaf     slotonly: a permutation word orders the slots,
+                      binary search through it                   15 keys in 144 B
+
+    The permutation of slotonly holds 15 slot ids, so its leaf shrinks
+    instead of holding more keys. The inner nodes route with the keys and
+    need the child pointers: those of the btree, and of the btree(unsort
+    node) for its set (the inner nodes of slotonly are tied to its leaves,
+    that set routes with the ones of the btree).
+
+    A leaf starts with leftmost_ptr (always NULL) and sibling_ptr like the
+    inner nodes, so a node is a leaf if its first word is NULL. An erase
+    only takes the key out of its leaf, nodes are never merged.
+*/
+namespace sets {
+using std::string;
+
+template <typename K, int NODE_BYTES>
+struct sorted_leaf {
+    static constexpr int CAPACITY = (NODE_BYTES - 24) / sizeof(K);
+
+    char * leftmost_ptr;
+    char * sibling_ptr;
+    uint64_t count;
+    K keys[CAPACITY];
+
+    // the number of keys less than key
+    inline uint64_t rank(const K & key) const {
+        uint64_t i = 0;
+        for(uint64_t step = btree::top_step(CAPACITY); step > 0; step >>= 1) {
+            if(i + step <= count && keys[i + step - 1] < key) i += step;
+        }
+        return i;
+    }
+
+    bool contains(const K & key) const {
+        uint64_t i = rank(key);
+        return i < count && keys[i] == key;
+    }
+
+    // 1 if key is inserted, 0 if it was there, -1 if the leaf is full
+    int insert(const K & key) {
+        uint64_t i = rank(key);
+        if(i < count && keys[i] == key) return 0;
+        if(count == CAPACITY) return -1;
+        memmove(keys + i + 1, keys + i, sizeof(K) * (count - i));
+        keys[i] = key;
+        count += 1;
+        return 1;
+    }
+
+    bool erase(const K & key) {
+        uint64_t i = rank(key);
+        if(i == count || keys[i] != key) return false;
+        memmove(keys + i, keys + i + 1, sizeof(K) * (count - i - 1));
+        count -= 1;
+        return true;
+    }
+
+    // move the upper half into the empty leaf right, return its smallest key
+    K split(sorted_leaf * right) {
+        uint64_t m = count / 2;
+        right->count = count - m;
+        memcpy(right->keys, keys + m, sizeof(K) * right->count);
+        count = m;
+        return right->keys[0];
+    }
+
+    // the keys not less than start in order, num at most
+    int collect(const K & start, K * out, int num) const {
+        int n = 0;
+        for(uint64_t i = rank(start); i < count && n < num; i++) out[n++] = keys[i];
+        return n;
+    }
+
+    void print(string prefix) const {
+        std::cout << prefix << "[(" << count << ") ";
+        for(uint64_t i = 0; i < count; i++) std::cout << keys[i] << " ";
+        std::cout << "]" << std::endl;
+    }
+};
+
+template <typename K, int NODE_BYTES>
+struct unsort_leaf {
+    static constexpr int CAPACITY = std::min<int>(64, (NODE_BYTES - 24) / sizeof(K));
+    static constexpr uint64_t TOP = 0x8000000000000000; // the bit of slot 0
+
+    char * leftmost_ptr;
+    char * sibling_ptr;
+    uint64_t bitmap;
+    K keys[CAPACITY];
+
+    inline int size() const {
+        return __builtin_popcountll(bitmap);
+    }
+
+    // the slot of key, -1 if it is not in the leaf
+    int slot_of(const K & key) const {
+        uint64_t mask = TOP;
+        for(int i = 0; i < CAPACITY; i++, mask >>= 1) {
+            if((bitmap & mask) != 0 && keys[i] == key) return i;
+        }
+        return -1;
+    }
+
+    bool contains(const K & key) const {
+        return slot_of(key) >= 0;
+    }
+
+    int insert(const K & key) {
+        if(slot_of(key) >= 0) return 0;
+        if(size() == CAPACITY) return -1;
+        int slot = __builtin_clzll(~bitmap); // the first free slot
+        keys[slot] = key;
+        bitmap |= TOP >> slot;
+        return 1;
+    }
+
+    bool erase(const K & key) {
+        int slot = slot_of(key);
+        if(slot < 0) return false;
+        bitmap &= ~(TOP >> slot);
+        return true;
+    }
+
+    // the keys of the leaf in order
+    int sorted(K * out) const {
+        int n = 0;
+        uint64_t mask = TOP;
+        for(int i = 0; i < CAPACITY; i++, mask >>= 1) {
+            if((bitmap & mask) != 0) out[n++] = keys[i];
+        }
+        std::sort(out, out + n);
+        return n;
+    }
+
+    K split(unsort_leaf * right) {
+        K all[CAPACITY];
+        int n = sorted(all), m = n / 2;
+        memcpy(keys, all, sizeof(K) * m);
+        bitmap = m == 0 ? 0 : UINT64_MAX << (64 - m);
+        memcpy(right->keys, all + m, sizeof(K) * (n - m));
+        right->bitmap = UINT64_MAX << (64 - (n - m));
+        return all[m];
+    }
+
+    int collect(const K & start, K * out, int num) const {
+        K all[CAPACITY];
+        int n = sorted(all), j = std::lower_bound(all, all + n, start) - all, c = 0;
+        for(; j < n && c < num; j++) out[c++] = all[j];
+        return c;
+    }
+
+    void print(string prefix) const {
+        K all[CAPACITY];
+        int n = sorted(all);
+        std::cout << prefix << "[(" << n << ", " << std::hex << bitmap << std::dec << ") ";
+        for(int i = 0; i < n; i++) std::cout << all[i] << " ";
+        std::cout << "]" << std::endl;
+    }
+};
+
+template <typename K, int NODE_BYTES>
+struct slot_leaf {
+    static constexpr int CAPACITY = std::min<int>(slotonly::MAX_CARDINALITY, (NODE_BYTES - 24) / sizeof(K));
+
+    char * leftmost_ptr;
+    char * sibling_ptr;
+    uint64_t permutation; // the slot ids in key order, and their number
+    K keys[CAPACITY];
+
+    inline K key_at(int idx) const {
+        return keys[slotonly::PERMUT_READ(permutation, idx)];
+    }
+
+    // the number of keys less than key
+    int rank(const K & key) const {
+        int lo = 0, hi = slotonly::PERMUT_COUNT(permutation);
+        while(lo < hi) {
+            int mid = (lo + hi) / 2;
+            if(key_at(mid) < key) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    bool contains(const K & key) const {
+        int i = rank(key);
+        return i < slotonly::PERMUT_COUNT(permutation) && key_at(i) == key;
+    }
+
+    int insert(const K & key) {
+        int num = slotonly::PERMUT_COUNT(permutation), i = rank(key);
+        if(i < num && key_at(i) == key) return 0;
+        if(num == CAPACITY) return -1;
+        int slot = slotonly::PERMUT_ALLOC(permutation, CAPACITY);
+        keys[slot] = key;
+        slotonly::PERMUT_ADD(permutation, i, slot); // the key is in place before it is published
+        return 1;
+    }
+
+    bool erase(const K & key) {
+        int i = rank(key);
+        if(i == slotonly::PERMUT_COUNT(permutation) || key_at(i) != key) return false;
+        slotonly::PERMUT_DEL(permutation, i);
+        return true;
+    }
+
+    K split(slot_leaf * right) {
+        int num = slotonly::PERMUT_COUNT(permutation), m = num / 2;
+        right->permutation = 0;
+        for(int i = m; i < num; i++) { // the right leaf gets slots 0, 1, ... in order
+            right->keys[i - m] = key_at(i);
+            slotonly::PERMUT_ADD(right->permutation, i - m, i - m);
+        }
+        slotonly::PERMUT_DELRIGHT(permutation, m);
+        return right->keys[0];
+    }
+
+    int collect(const K & start, K * out, int num) const {
+        int n = 0, cnt = slotonly::PERMUT_COUNT(permutation);
+        for(int i = rank(start); i < cnt && n < num; i++) out[n++] = key_at(i);
+        return n;
+    }
+
+    void print(string prefix) const {
+        int cnt = slotonly::PERMUT_COUNT(permutation);
+        std::cout << prefix << "[(" << cnt << ") ";
+        for(int i = 0; i < cnt; i++) std::cout << key_at(i) << " ";
+        std::cout << "]" << std::endl;
+    }
+};
+
+// the set on leaves of type Leaf under inner nodes of type Inner (a node_t of btree or btree_unsort)
+template <typename Leaf, typename Inner, typename K>
+class set_t {
+    private:
+        char * root;
+        uint64_t num;
+
+        static inline bool is_leaf(const char * n) {
+            return *(char * const *)n == NULL; // leftmost_ptr
+        }
+
+        static Leaf * new_leaf() {
+            void * p;
+            if(posix_memalign(&p, 64, sizeof(Leaf)) != 0) {
+                perror("posix_memalign");
+                exit(-1);
+            }
+            memset(p, 0, sizeof(Leaf));
+            return (Leaf *)p;
+        }
+
+        Leaf * find_leaf(const K & key) const {
+            char * cur = root;
+            while(!is_leaf(cur)) cur = ((Inner *)cur)->get_child(key);
+            return (Leaf *)cur;
+        }
+
+        // 1 if key is inserted, a split of n leaves its separator and right node
+        int insert_recursive(char * n, const K & key, K & split_k, char * & split_node) {
+            if(is_leaf(n)) {
+                Leaf * l = (Leaf *)n;
+                int r = l->insert(key);
+                if(r >= 0) return r;
+
+                Leaf * right = new_leaf();
+                split_k = l->split(right);
+                right->sibling_ptr = l->sibling_ptr;
+                l->sibling_ptr = (char *)right;
+                (key < split_k ? l : right)->insert(key);
+                split_node = (char *)right;
+                return 2;
+            }
+
+            K child_k;
+            char * child_node;
+            int r = insert_recursive(((Inner *)n)->get_child(key), key, child_k, child_node);
+            if(r != 2) return r;
+            Inner * right;
+            if(!((Inner *)n)->store(child_k, child_node, split_k, right)) return 1;
+            split_node = (char *)right;
+            return 2;
+        }
+
+    public:
+        set_t() : root((char *)new_leaf()), num(0) {}
+
+        ~set_t() { // every level is a chain of sibling_ptr from its leftmost node
+            char * level = root;
+            while(level != NULL) {
+                char * next = is_leaf(level) ? NULL : *(char **)level;
+                for(char * n = level; n != NULL;) {
+                    char * sib = is_leaf(n) ? ((Leaf *)n)->sibling_ptr : ((Inner *)n)->sibling_ptr;
+                    free(n);
+                    n = sib;
+                }
+                level = next;
+            }
+        }
+
+        bool contains(K key) const {
+            return find_leaf(key)->contains(key);
+        }
+
+        // true if key was not in the set
+        bool insert(K key) {
+            K split_k;
+            char * split_node;
+            int r = insert_recursive(root, key, split_k, split_node);
+            if(r == 2) {
+                Inner * new_root = new Inner;
+                new_root->leftmost_ptr = root;
+                K k;
+                Inner * n;
+                new_root->store(split_k, split_node, k, n); // an empty node does not split
+                root = (char *)new_root;
+            }
+            num += r > 0;
+            return r > 0;
+        }
+
+        // true if key was in the set
+        bool erase(K key) {
+            bool found = find_leaf(key)->erase(key);
+            num -= found;
+            return found;
+        }
+
+        // the keys not less than start in order, num at most
+        int scan(K start, int n, K * keys) const {
+            Leaf * l = find_leaf(start);
+            int cnt = 0;
+            while(l != NULL && cnt < n) {
+                cnt += l->collect(start, keys + cnt, n - cnt);
+                l = (Leaf *)l->sibling_ptr;
+            }
+            return cnt;
+        }
+
+        uint64_t size() const {
+            return num;
+        }
+
+        // the levels of the tree, 1 for a single leaf
+        int height() const {
+            int h = 1;
+            for(char * n = root; !is_leaf(n); n = *(char **)n) h++;
+            return h;
+        }
+
+        // the leaves in key order, the print of an inner node would take the leaves for inner nodes
+        void printAll() {
+            char * n = root;
+            while(!is_leaf(n)) n = *(char **)n;
+            std::cout << "height " << height() << ", " << num << " keys" << std::endl;
+            for(; n != NULL; n = ((Leaf *)n)->sibling_ptr) ((Leaf *)n)->print("");
+        }
+};
+
+template <typename K = _key_t, int NODE_BYTES = btree::PAGESIZE>
+using btree_set = set_t<sorted_leaf<K, NODE_BYTES>, btree::node_t<K, _value_t, NODE_BYTES, std::less<K>>, K>;
+
+template <typename K = _key_t, int NODE_BYTES = btree_unsort::PAGESIZE>
+using unsort_set = set_t<unsort_leaf<K, NODE_BYTES>, btree_unsort::node_t<K, _value_t, NODE_BYTES, std::less<K>>, K>;
+
+template <typename K = _key_t, int NODE_BYTES = slotonly::PAGESIZE>
+using slotonly_set = set_t<slot_leaf<K, NODE_BYTES>, btree::node_t<K, _value_t, NODE_BYTES, std::less<K>>, K>;
+
+/*
+    A set behind the engine interface, so the drivers can load and query it
+    like the maps: the value of a key is the key itself, an update finds the
+    key and changes nothing.
+*/
+template <typename S>
+class as_map : public tree_base<as_map<S>, _key_t, _value_t> {
+    private:
+        S s;
+
+    public:
+        bool find(_key_t key, _value_t & value) {
+            if(!s.contains(key)) return false;
+            value = key;
+            return true;
+        }
+
+        void insert(_key_t key, _value_t value) {
+            s.insert(key);
+        }
+
+        bool update(_key_t key, _value_t value) {
+            return s.contains(key);
+        }
+
+        bool remove(_key_t key) {
+            return s.erase(key);
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            return s.scan(start_key, num, vals);
+        }
+
+        void printAll() {
+            s.printAll();
+        }
+};
+
+}; // namespace sets
+
+#endif //__SETS__
@@ -1,21 +1,26 @@
 /*  slotonly.h - btree of unordered tree node, but add a indirect array
     Copyright(c) 2020 Luo Yongping. All rights reserved.
 */
+#ifndef __SLOTONLY__
+#define __SLOTONLY__
 
 #include <stdio.h>
 #include <cmath>
 #include <iostream>
 #include <vector>
 #include <mutex>
+#include <functional>
 
 #include "base.h"
+#include "stats.h"
 
 namespace slotonly {
     using std::cout;
     using std::endl;
 
-    const int CARDINALITY = 14; // No bigger than 15 (due to that the \
-                    permutation is 64-bit long while each slot id is 4-bit long)
+    const int PAGESIZE = 256; // the default node bytes
+    const int MAX_CARDINALITY = 15; // the permutation is 64-bit long while each slot id is 4-bit long
+    const int CARDINALITY = 14; // of the default node
     const int UNDERFLOW_CARD = ceil((float)CARDINALITY / 2);
     
     
@@ -28,12 +33,12 @@ namespace slotonly {
         return (p & ((uint64_t)0xf << ((15 - idx) * 4))) >> ((15 - idx) * 4);
     }
 
-    static inline int8_t PERMUT_ALLOC(const uint64_t p) { // allocate a free slot id 
-        int8_t occupy[CARDINALITY] = {0};
+    static inline int8_t PERMUT_ALLOC(const uint64_t p, int card = CARDINALITY) { // allocate a free slot id 
+        int8_t occupy[MAX_CARDINALITY] = {0};
         for(int i = 0; i < PERMUT_COUNT(p); i++) {
             occupy[PERMUT_READ(p, i)] = 1; 
         }
-        for(int i = 0; i < CARDINALITY; i++) { // find a empty slot
+        for(int i = 0; i < card; i++) { // find a empty slot
             if(occupy[i] == 0) return i;
         }
         return 0;
@@ -66,19 +71,33 @@ namespace slotonly {
     }
 
     /* utility data type*/
-    struct Record {
-        _key_t key;
+    template <typename K>
+    struct record_t {
+        K key;
         char * val;
     };
 
+    template <typename K>
     struct res_t { // a result type use to pass info when split and search
         bool flag; 
-        Record rec;
+        record_t<K> rec;
         int8_t idx;
-        res_t(bool f, Record e, int8_t i = -1) : flag(f), rec(e), idx(i) {}
+        res_t(bool f, record_t<K> e, int8_t i = -1) : flag(f), rec(e), idx(i) {}
     };
 
-    class Node {
+    template <typename K, typename V, int NODE_BYTES, typename Compare>
+    class wbtree_t;
+
+    // a node of NODE_BYTES bytes, the permutation keeps the order of its unsorted records
+    template <typename K, typename V, int NODE_BYTES, typename Compare>
+    class node_t {
+    public:
+        typedef record_t<K> Record;
+        typedef slotonly::res_t<K> res_t;
+        static constexpr int CARDINALITY = (NODE_BYTES - 32) / sizeof(Record);
+        static constexpr int UNDERFLOW_CARD = (CARDINALITY + 1) / 2;
+        static_assert(CARDINALITY >= 3 && CARDINALITY <= MAX_CARDINALITY, "a permutation holds 15 slots at most");
+
     private:
         uint64_t permutation; // 8 bytes
         char * leftmost_ptr; // 8 bytes
@@ -86,16 +105,25 @@ namespace slotonly {
         uint64_t *unused;    // 8 bytes
         Record recs[CARDINALITY];
 
-        void insert_key(_key_t key, char * right) {
+        // the number of records whose key is not greater than key (UPPER) or less than key,
+        // a linear search over the permutation, unrolled for the compile-time fan-out
+        template <bool UPPER>
+        inline int8_t rank(const K & key) const {
             int8_t num = PERMUT_COUNT(permutation);
+            int8_t idx = 0;
+            #pragma GCC unroll 15 // a permutation holds 15 slots at most
+            for(int i = 0; i < CARDINALITY; i++) {
+                if(i == num || (UPPER ? key_less<Compare>(key, get_key(i)) : !key_less<Compare>(get_key(i), key))) break;
+                idx += 1;
+            }
+            return idx;
+        }
 
-            int8_t idx = 0, slot;
-            do {
-                slot = PERMUT_READ(permutation, idx); //find the first key in the node that geq key
-            } while (key > recs[slot].key && ++idx < num);
+        void insert_key(const K & key, char * right) {
+            int8_t idx = rank<false>(key); // the first key in the node that geq key
 
             // alloc a slot in the node
-            slot = PERMUT_ALLOC(permutation);
+            int8_t slot = PERMUT_ALLOC(permutation, CARDINALITY);
             recs[slot] = {key, right};
             // update the permutation array
             PERMUT_ADD(permutation, idx, slot);
@@ -105,10 +133,11 @@ namespace slotonly {
             PERMUT_DEL(permutation, idx);
         }
 
-        _key_t borrow(Node * sib, _key_t uplevel_splitkey, bool borrow_from_right) {
+        K borrow(node_t * sib, const K & uplevel_splitkey, bool borrow_from_right) {
+            STAT_ADD(SLOTONLY, BORROWS, 1);
             int8_t extra = leftmost_ptr != NULL ? 1 : 0;
             int8_t borrow_num = sib->card() - (sib->card() + card() + extra) / 2;
-            _key_t new_splitkey;
+            K new_splitkey;
             
             if(borrow_from_right) {
                 if(leftmost_ptr == NULL) { // borrow from right leaf siblings
@@ -152,7 +181,8 @@ namespace slotonly {
             }
         }
 
-        void merge(Node * sib, _key_t uplevel_splitkey, bool merge_with_right) {
+        void merge(node_t * sib, const K & uplevel_splitkey, bool merge_with_right) {
+            STAT_ADD(SLOTONLY, MERGES, 1);
         // the merge key is key from parent node
             if(merge_with_right) { // all the record in right siblings insert to current node
                 if(leftmost_ptr != NULL) {
@@ -178,19 +208,19 @@ namespace slotonly {
             }
         }
 
-        void get_siblings(int8_t idx, Node * &left, Node * &right) const{
+        void get_siblings(int8_t idx, node_t * &left, node_t * &right) const{
             if(idx == -1) {
-                left = (Node *)NULL;
+                left = (node_t *)NULL;
             } else if(idx == 0) {
-                left = (Node *) leftmost_ptr;
+                left = (node_t *) leftmost_ptr;
             } else {
-                left = (Node *) recs[PERMUT_READ(permutation, idx - 1)].val;
+                left = (node_t *) recs[PERMUT_READ(permutation, idx - 1)].val;
             }
 
-            right = idx + 1 < PERMUT_COUNT(permutation) ? (Node *) recs[PERMUT_READ(permutation, idx + 1)].val : NULL;
+            right = idx + 1 < PERMUT_COUNT(permutation) ? (node_t *) recs[PERMUT_READ(permutation, idx + 1)].val : NULL;
         }
 
-        inline _key_t get_key(int8_t idx) const{
+        inline K get_key(int8_t idx) const{
             int8_t slot = PERMUT_READ(permutation, idx);
             return recs[slot].key;
         }
@@ -200,14 +230,14 @@ namespace slotonly {
             return recs[slot].val;
         }
 
-        inline void update_key(int8_t idx, _key_t key) {
+        inline void update_key(int8_t idx, const K & key) {
             int8_t slot = PERMUT_READ(permutation, idx);
             recs[slot].key = key;
         }
 
-        inline void update_value(int8_t idx, _value_t value) {
+        inline void update_value(int8_t idx, V value) {
             int8_t slot = PERMUT_READ(permutation, idx);
-            recs[slot].val = (char *)value;
+            recs[slot].val = to_slot(value);
         }
 
         inline bool underflow() const{
@@ -219,9 +249,9 @@ namespace slotonly {
         }
 
     public:
-        friend class wbtree;
+        friend class wbtree_t<K, V, NODE_BYTES, Compare>;
         
-        Node() :permutation(0), leftmost_ptr(NULL), sibling_ptr(NULL) {}
+        node_t() :permutation(0), leftmost_ptr(NULL), sibling_ptr(NULL) {}
 
         void * operator new(size_t size) {
             #ifdef _WIN32
@@ -236,12 +266,12 @@ namespace slotonly {
         
         void operator delete(void * ptr) {
             if(ptr != NULL) {
-                Node * this_node = (Node *) ptr;
+                node_t * this_node = (node_t *) ptr;
                 if(this_node->leftmost_ptr != NULL) {
-                    delete (Node *)this_node->leftmost_ptr;
+                    delete (node_t *)this_node->leftmost_ptr;
                     for(int i = 0; i < PERMUT_COUNT(this_node->permutation); i++) {
-                        int8_t slot = PERMUT_READ(this_node->permutation, i++);
-                        delete (Node *)this_node->recs[slot].val;
+                        int8_t slot = PERMUT_READ(this_node->permutation, i);
+                        delete (node_t *)this_node->recs[slot].val;
                     }
                 } 
                 #ifdef _WIN32
@@ -252,25 +282,26 @@ namespace slotonly {
             }
         }
 
-        res_t store(_key_t key, char * right) {
+        res_t store(const K & key, char * right) {
         // if split, return with a true flag and return the split key along with the address of the new node
             int num_entries = PERMUT_COUNT(permutation);
 
             if(num_entries < CARDINALITY) {
                 insert_key(key, right);
 
-                return res_t(false, {0, NULL});
+                return res_t(false, {K(), NULL});
             } else { // split the node here 
-                Node * new_node = new Node();
+                STAT_SPLIT(SLOTONLY);
+                node_t * new_node = new node_t();
                 int8_t right_num = std::ceil((float)num_entries / 2);
                 int8_t m = num_entries - right_num;
 
                 int8_t slot = PERMUT_READ(permutation, m);
-                if(key >= recs[slot].key) { // make the split more even 
+                if(!key_less<Compare>(key, recs[slot].key)) { // make the split more even 
                     slot = PERMUT_READ(permutation, ++m);
                     right_num -= 1;
                 }
-                _value_t split_key = recs[slot].key;// record the splitkey
+                K split_key = recs[slot].key;// record the splitkey
                 
                 //copy records to the new node
                 if(leftmost_ptr != NULL) {
@@ -294,7 +325,7 @@ namespace slotonly {
                 PERMUT_DELRIGHT(permutation, num_entries - right_num);    
 
                 // insert the key-value after the splitting
-                if(key < split_key) {
+                if(key_less<Compare>(key, split_key)) {
                     insert_key(key, right);
                 } else {
                     new_node->insert_key(key, right);
@@ -304,61 +335,37 @@ namespace slotonly {
             }
         }
 
-        bool remove(_key_t key) {
-            int num = PERMUT_COUNT(permutation);
-
-            int8_t idx = 0, slot;
-            do {
-                slot = PERMUT_READ(permutation, idx); //find the first key in the node that geq key
-            } while (key > recs[slot].key && ++idx < num);
+        bool remove(const K & key) { // return true if the key was in the node
+            int8_t idx = rank<false>(key);
 
-            if(recs[slot].key == key) {
+            if(idx < card() && key_equal<Compare>(get_key(idx), key)) {
                 remove_key(idx);
-            } else {
-                printf("Key:%ld Not Found\n", key);
-            }
-
-            if(num > ceil((float)CARDINALITY / 2)) {
-                return false;
-            } else { // need to merge with siblings
                 return true;
             }
+            return false;
         }
 
-        res_t linear_search(_key_t key) const {
+        res_t linear_search(const K & key) const {
         // if found, return with a true flag, or with a false flag
             int8_t num = PERMUT_COUNT(permutation);
+            STAT_ADD(SLOTONLY, SEARCHES, 1);
 
             if(leftmost_ptr == NULL) { // leaf node
-                int8_t idx = 0, slot;
-                do {
-                    slot = PERMUT_READ(permutation, idx); //find the first key in the node that geq key
-                } while (key > recs[slot].key && ++idx < num);
-
-                Record rec = recs[slot];
-                
-                // find a record's key in the node equals key or till the last record
-                if(recs[slot].key == key) 
-                    return res_t(true, recs[slot], idx);
-                else 
-                    return res_t(false, {0, NULL}, idx);
-            } else { // inner node
-                if(num == 0 || key < recs[PERMUT_READ(permutation, 0)].key) {
+                int8_t idx = rank<false>(key); // the first key in the node that geq key
+                STAT_ADD(SLOTONLY, COMPARES, idx < num ? idx + 1 : num);
+
+                if(idx < num && key_equal<Compare>(get_key(idx), key))
+                    return res_t(true, recs[PERMUT_READ(permutation, idx)], idx);
+                else
+                    return res_t(false, {K(), NULL}, idx);
+            } else { // inner node, the last record whose key leq key
+                int8_t idx = rank<true>(key) - 1;
+                STAT_ADD(SLOTONLY, COMPARES, idx + 1 < num ? idx + 2 : num);
+
+                if(idx < 0) {
                     return res_t(true, {key, leftmost_ptr}, -1);
                 }
-                int8_t idx = 0, slot;
-                if(num == 1) {
-                    slot = PERMUT_READ(permutation, 0);
-                } else { // fix a bug here, in the following way, we can find the right slot
-                         // when num equls 1
-                    do { 
-                        slot = PERMUT_READ(permutation, idx + 1);
-                    } while (key >= recs[slot].key && ++idx < num - 1); // find the first record whose key gt key, the record before that is the target
-                    
-                    slot = PERMUT_READ(permutation, idx);
-                }
-                
-                return res_t(true, recs[slot], idx);
+                return res_t(true, recs[PERMUT_READ(permutation, idx)], idx);
             }
         }
 
@@ -377,10 +384,10 @@ namespace slotonly {
             cout << endl;
             
             if(leftmost_ptr != NULL && recursively) {
-                ((Node *)leftmost_ptr)->print(tree_depth, cur_depth + 1, true);
+                ((node_t *)leftmost_ptr)->print(tree_depth, cur_depth + 1, true);
                 for(int i = 0; i < PERMUT_COUNT(permutation); i++) {
                     int8_t slot = PERMUT_READ(permutation, i);
-                    ((Node *)recs[slot].val)->print(tree_depth, cur_depth + 1, true);
+                    ((node_t *)recs[slot].val)->print(tree_depth, cur_depth + 1, true);
                 }
             }
         }
@@ -395,14 +402,28 @@ namespace slotonly {
         }
     };
 
-    class wbtree : tree_api {
+    // keys are trivially copyable and ordered by Compare, values fit in the pointer slot of a record
+    template <typename K = _key_t, typename V = _value_t, int NODE_BYTES = PAGESIZE, typename Compare = std::less<K>>
+    class wbtree_t : public tree_base<wbtree_t<K, V, NODE_BYTES, Compare>, K, V> {
+    public:
+        typedef node_t<K, V, NODE_BYTES, Compare> Node;
+        typedef record_t<K> Record;
+        typedef slotonly::res_t<K> res_t;
+        static constexpr int CARDINALITY = Node::CARDINALITY;
+        static constexpr int UNDERFLOW_CARD = Node::UNDERFLOW_CARD;
+
     private:
         int8_t tree_height;
         Node * root;
 
-        res_t insert_recursive(Node * n, _key_t k, _value_t v) {
+        res_t insert_recursive(Node * n, const K & k, char * v) {
             if(n->leftmost_ptr == NULL) {
-                return n->store(k, (char *)v);
+                res_t find_res = n->linear_search(k);
+                if(find_res.flag == true) { // the key is in the tree, its value is replaced
+                    n->recs[PERMUT_READ(n->permutation, find_res.idx)].val = v;
+                    return res_t(false, {K(), NULL});
+                }
+                return n->store(k, v);
             } else {
                 res_t find_res = n->linear_search(k); // find the child node
 
@@ -411,46 +432,48 @@ namespace slotonly {
                 if(insert_res.flag == true) { // splitting cascades to Node n
                     return n->store(insert_res.rec.key, insert_res.rec.val);
                 } else {
-                    return res_t(false, {0, NULL});
+                    return res_t(false, {K(), NULL});
                 }
             }
         }
 
-        bool remove_recursive(Node * n, _key_t k) {
+        // return true if n needs to merge with siblings
+        bool remove_recursive(Node * n, const K & k, bool & removed) {
             if(n->leftmost_ptr == NULL) { //leaf node
-                return n->remove(k);
+                removed = n->remove(k);
+                return removed && n->underflow();
             } else { //inner node
                 res_t find_res = n->linear_search(k);
                 Node * child = (Node *)find_res.rec.val;
 
-                bool isUnderflow = remove_recursive(child, k);
+                bool isUnderflow = remove_recursive(child, k, removed);
                 if(isUnderflow == true) { // the child node has splitted
                     Node * leftchild, *rightchild;
                     n->get_siblings(find_res.idx, leftchild, rightchild);
 
                     if(leftchild != NULL && leftchild->card() > UNDERFLOW_CARD) {
-                        _key_t cur_key = n->get_key(find_res.idx);
-                        _key_t new_key = child->borrow(leftchild, cur_key, false);
+                        K cur_key = n->get_key(find_res.idx);
+                        K new_key = child->borrow(leftchild, cur_key, false);
                         
                         n->update_key(find_res.idx, new_key);
 
                         return false;
                     } else if(rightchild != NULL && rightchild->card() > UNDERFLOW_CARD) {
-                        _key_t right_key = n->get_key(find_res.idx + 1);
-                        _key_t new_key = child->borrow(rightchild, right_key, true);
+                        K right_key = n->get_key(find_res.idx + 1);
+                        K new_key = child->borrow(rightchild, right_key, true);
                         
                         n->update_key(find_res.idx + 1, new_key);
 
                         return false;
                     } else if (leftchild != NULL){
-                        _key_t cur_key = n->get_key(find_res.idx);
+                        K cur_key = n->get_key(find_res.idx);
                         child->merge(leftchild, cur_key, false);
                         child->clear();
 
                         n->remove_key(find_res.idx);
                         return n->underflow();
                     } else { // if child has no left sibling, it must have a right sibling
-                        _key_t right_key = n->get_key(find_res.idx + 1);
+                        K right_key = n->get_key(find_res.idx + 1);
                         child->merge(rightchild, right_key, true);
                         rightchild->clear();;
 
@@ -464,26 +487,29 @@ namespace slotonly {
         }
 
     public:
-        wbtree() {
+        wbtree_t() {
             root = new Node();
             tree_height = 1;
         }
 
-        ~wbtree() {
+        ~wbtree_t() {
             delete root; //Node deconstrution will automatically free the child node
         }
     
-        bool find(_key_t k, _value_t &v) {
+        bool find(K k, V &v) {
+            STAT_ADD(SLOTONLY, FINDS, 1);
             Node * cur = root;
             
             while(cur->leftmost_ptr != NULL) {
+                STAT_ADD(SLOTONLY, FIND_NODES, 1);
                 res_t find_res = cur->linear_search(k);
                 cur = (Node *)find_res.rec.val;
             }
 
+            STAT_ADD(SLOTONLY, FIND_NODES, 1);
             res_t find_res = cur->linear_search(k);
             if(find_res.flag == true) {
-                v = (_value_t)find_res.rec.val;
+                v = from_slot<V>(find_res.rec.val);
                 return true;
             } else {
                 return false;
@@ -491,9 +517,10 @@ namespace slotonly {
         }
         
 
-        void insert(_key_t k, _value_t v) {
+        void insert(K k, V v) {
         // if tree level in the threshold, return false, else return the splited new root
-            res_t insert_res = insert_recursive(root, k, v);
+            STAT_INSERT(SLOTONLY);
+            res_t insert_res = insert_recursive(root, k, to_slot(v));
 
             if(insert_res.flag == true) { // splitting cascades to the root node
                 Node * new_root = new Node();
@@ -505,12 +532,13 @@ namespace slotonly {
                 root = new_root;
 
                 tree_height += 1;
+                STAT_ADD(SLOTONLY, ROOT_GROWS, 1);
             }
 
             return ;
         }
 
-        bool update(_key_t k, _value_t v) {
+        bool update(K k, V v) {
             Node * cur = root;
                 
             while(cur->leftmost_ptr != NULL) {
@@ -526,42 +554,41 @@ namespace slotonly {
             return false;
         }
 
-        bool remove(_key_t k) {
-        // if no more record, return false
+        bool remove(K k) {
+        // return false if the key is not in the tree
+            STAT_ADD(SLOTONLY, REMOVES, 1);
             if(root->leftmost_ptr == NULL) { // root node is a leaf node
-                root->remove(k);
-                
-                return root->card() > 0;
+                return root->remove(k);
             } else {
                 res_t find_res = root->linear_search(k);
                 
                 Node * child = (Node *)find_res.rec.val;
-                Node * leftchild, *rightchild;
 
-                bool isUnderflow = remove_recursive(child, k);
+                bool removed = false;
+                bool isUnderflow = remove_recursive(child, k, removed);
                 if(isUnderflow == true) {
                     Node * leftchild, *rightchild;
                     root->get_siblings(find_res.idx, leftchild, rightchild);
 
                     if(leftchild != NULL && leftchild->card() > UNDERFLOW_CARD) {
-                        _key_t cur_key = root->get_key(find_res.idx);
-                        _key_t new_key = child->borrow(leftchild, cur_key, false);
+                        K cur_key = root->get_key(find_res.idx);
+                        K new_key = child->borrow(leftchild, cur_key, false);
 
                         root->update_key(find_res.idx, new_key);
 
                     } else if(rightchild != NULL && rightchild->card() > UNDERFLOW_CARD) {
-                        _key_t right_key = root->get_key(find_res.idx + 1);
-                        _key_t new_key = child->borrow(rightchild, right_key, true);
+                        K right_key = root->get_key(find_res.idx + 1);
+                        K new_key = child->borrow(rightchild, right_key, true);
 
                         root->update_key(find_res.idx + 1, new_key);
                     } else if (leftchild != NULL){
-                        _key_t cur_key = root->get_key(find_res.idx);
+                        K cur_key = root->get_key(find_res.idx);
                         child->merge(leftchild, cur_key, false);
                         child->clear();
 
                         root->remove_key(find_res.idx);
                     } else if(rightchild != NULL){
-                        _key_t right_key = root->get_key(find_res.idx + 1);
+                        K right_key = root->get_key(find_res.idx + 1);
                         child->merge(rightchild, right_key, true);
                         rightchild->clear();
                         root->remove_key(find_res.idx + 1);
@@ -569,10 +596,14 @@ namespace slotonly {
                     
                     //if root has no key, make the only child be the root
                     if(root->card() == 0) { // that is able to recover
+                        Node * old_root = root;
                         root = (Node *) root->leftmost_ptr;
+                        old_root->clear(); // frees the node alone, its leftmost_ptr is cleared first
+                        tree_height -= 1;
+                        STAT_ADD(SLOTONLY, ROOT_SHRINKS, 1);
                     }
                 }
-                return true;
+                return removed;
             }
         }
 
@@ -580,4 +611,12 @@ namespace slotonly {
             root->print(tree_height, 0, true);
         }
     };
-};
\ No newline at end of file
+
+    // the default geometry, the tree behind the benchmark drivers
+    typedef record_t<_key_t> Record;
+    typedef node_t<_key_t, _value_t, PAGESIZE, std::less<_key_t>> Node;
+    typedef wbtree_t<> wbtree;
+    static_assert(Node::CARDINALITY == CARDINALITY, "the default node holds CARDINALITY records");
+};
+
+#endif
@@ -0,0 +1,633 @@
+/*  slotonly_pm.h - crash consistent slotonly btree on a persistent (DAX-like) mmaped file
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __SLOTONLY_PM__
+#define __SLOTONLY_PM__
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "slotonly.h"
+#include "persist.h"
+#include "mmap_region.h"
+
+/*
+    The same wB+tree-style node as slotonly.h: a record is written into a free
+    slot and becomes visible only when the 8-byte permutation word is updated.
+    Persistence ordering:
+        insert without split: persist the record, then persist the permutation
+        remove / update:      persist the permutation / the value
+    Both commit with one atomic 8-byte store, so no log is needed for them.
+
+    Splits, borrows and merges touch several nodes. They run as a small
+    transaction: the before-image of every node is copied into an undo log in
+    the meta area of the file before the node is modified; the root, height and
+    allocator state are saved when the transaction begins. Reopening the file
+    rolls back a transaction that did not commit.
+*/
+namespace slotonly_pm {
+    using std::string;
+    using slotonly::CARDINALITY;
+    using slotonly::UNDERFLOW_CARD;
+    using slotonly::PERMUT_COUNT;
+    using slotonly::PERMUT_READ;
+    using slotonly::PERMUT_ALLOC;
+    using slotonly::PERMUT_ADD;
+    using slotonly::PERMUT_DEL;
+    using slotonly::PERMUT_DELRIGHT;
+    using slotonly::PERMUT_DELLEFT;
+
+    const int PAGESIZE = 256;
+    const int LOG_CAPACITY = 240; // node images the undo log can hold
+    const uint64_t META_SIZE = mmap_region::HEADER_SIZE + LOG_CAPACITY * PAGESIZE;
+
+    // the slots of mmap_region::header_t::user used by the tree
+    const int ROOT_SLOT = 0;
+    const int HEIGHT_SLOT = 1;
+
+    struct Record {
+        _key_t key;
+        uint64_t val; // value in the leaf nodes, child offset in the inner nodes
+    };
+
+    struct res_t {
+        bool flag;
+        Record rec;
+        int8_t idx;
+        res_t(bool f, Record e, int8_t i = -1) : flag(f), rec(e), idx(i) {}
+    };
+
+    struct undo_log_t {
+        uint64_t active;    // a transaction is running
+        uint64_t root;      // the state of the tree when it began
+        uint64_t height;
+        uint64_t alloc_off;
+        uint64_t free_head;
+        uint64_t count;     // valid node images
+        uint64_t offs[LOG_CAPACITY];
+    };
+
+    class pool { // the node allocator and the undo log of the tree
+    private:
+        mmap_region region;
+        undo_log_t * log;
+        std::vector<uint64_t> logged; // nodes whose before-image is in the log
+        std::vector<uint64_t> fresh;  // nodes allocated by the running transaction
+        bool in_tx;
+
+        inline char * image(uint64_t i) {
+            return region.get_base() + mmap_region::HEADER_SIZE + i * PAGESIZE;
+        }
+
+        inline bool touched(uint64_t off) const {
+            for(uint64_t o : logged) if(o == off) return true;
+            for(uint64_t o : fresh) if(o == off) return true;
+            return false;
+        }
+
+    public:
+        pool(const char * path) : region(path, PAGESIZE, META_SIZE), in_tx(false) {
+            log = (undo_log_t *) region.meta();
+            recover();
+        }
+
+        mmap_region & get_region() { return region; }
+
+        uint64_t & root() { return region.header()->user[ROOT_SLOT]; }
+
+        uint64_t & height() { return region.header()->user[HEIGHT_SLOT]; }
+
+        template <typename T>
+        inline T * at(uint64_t off) const { return region.at<T>(off); }
+
+        void begin() {
+            if(in_tx) return;
+
+            mmap_region::header_t * h = region.header();
+            log->root = h->user[ROOT_SLOT];
+            log->height = h->user[HEIGHT_SLOT];
+            log->alloc_off = h->alloc_off;
+            log->free_head = h->free_head;
+            log->count = 0;
+            persist::persist(log, offsetof(undo_log_t, offs));
+
+            log->active = 1;
+            persist::persist(&log->active, sizeof(uint64_t));
+            in_tx = true;
+        }
+
+        void log_node(uint64_t off) { // must be called before the node is modified
+            begin();
+            if(touched(off)) return;
+
+            uint64_t i = log->count;
+            if(i == LOG_CAPACITY) {
+                fprintf(stderr, "slotonly_pm: undo log overflow\n");
+                exit(-1);
+            }
+            memcpy(image(i), region.at<char>(off), PAGESIZE);
+            log->offs[i] = off;
+            persist::flush(image(i), PAGESIZE);
+            persist::flush(&log->offs[i], sizeof(uint64_t));
+            persist::fence();
+
+            log->count = i + 1;
+            persist::persist(&log->count, sizeof(uint64_t));
+            logged.push_back(off);
+        }
+
+        uint64_t alloc() {
+            begin();
+            uint64_t head = region.header()->free_head;
+            if(head != 0) log_node(head); // its first word holds the free list link
+
+            uint64_t off = region.alloc();
+            fresh.push_back(off);
+            return off;
+        }
+
+        void free(uint64_t off) {
+            log_node(off);
+            region.free(off);
+        }
+
+        void commit() {
+            if(!in_tx) return;
+
+            for(uint64_t off : logged) persist::flush(region.at<char>(off), PAGESIZE);
+            for(uint64_t off : fresh) persist::flush(region.at<char>(off), PAGESIZE);
+            persist::flush(region.header(), sizeof(mmap_region::header_t));
+            persist::fence();
+
+            log->active = 0;
+            persist::persist(&log->active, sizeof(uint64_t));
+
+            logged.clear();
+            fresh.clear();
+            in_tx = false;
+        }
+
+        void recover() { // roll back the transaction that was cut by a crash
+            if(log->active == 0) return;
+
+            for(uint64_t i = 0; i < log->count; i++) {
+                memcpy(region.at<char>(log->offs[i]), image(i), PAGESIZE);
+                persist::flush(region.at<char>(log->offs[i]), PAGESIZE);
+            }
+            mmap_region::header_t * h = region.header();
+            h->user[ROOT_SLOT] = log->root;
+            h->user[HEIGHT_SLOT] = log->height;
+            h->alloc_off = log->alloc_off;
+            h->free_head = log->free_head;
+            persist::flush(h, sizeof(mmap_region::header_t));
+            persist::fence();
+
+            log->active = 0;
+            persist::persist(&log->active, sizeof(uint64_t));
+        }
+    };
+
+    static_assert(sizeof(mmap_region::header_t) <= 128 && 128 + sizeof(undo_log_t) <= mmap_region::HEADER_SIZE,
+                  "the undo log must fit in the header page");
+
+    class Node {
+    private:
+        uint64_t permutation; // 8 bytes
+        uint64_t leftmost_off; // 8 bytes
+        uint64_t sibling_off; // 8 bytes
+        uint64_t unused;    // 8 bytes
+        Record recs[CARDINALITY];
+
+        inline int8_t lower_bound(_key_t key) const { // the first idx whose key geq key
+            int8_t num = PERMUT_COUNT(permutation);
+            int8_t idx = 0;
+            while(idx < num && key > recs[PERMUT_READ(permutation, idx)].key) idx++;
+            return idx;
+        }
+
+        void insert_key(_key_t key, uint64_t right) {
+            int8_t idx = lower_bound(key);
+
+            // write the record into a free slot, it is invisible until the permutation says so
+            int8_t slot = PERMUT_ALLOC(permutation);
+            recs[slot] = {key, right};
+            persist::persist(&recs[slot], sizeof(Record));
+
+            // commit with a single 8-byte store
+            uint64_t p = permutation;
+            PERMUT_ADD(p, idx, slot);
+            permutation = p;
+            persist::persist(&permutation, sizeof(uint64_t));
+        }
+
+        void remove_key(int8_t idx) {
+            uint64_t p = permutation;
+            PERMUT_DEL(p, idx);
+            permutation = p;
+            persist::persist(&permutation, sizeof(uint64_t));
+        }
+
+        _key_t borrow(Node * sib, _key_t uplevel_splitkey, bool borrow_from_right) {
+            int8_t extra = leftmost_off != 0 ? 1 : 0;
+            int8_t borrow_num = sib->card() - (sib->card() + card() + extra) / 2;
+            _key_t new_splitkey;
+
+            if(borrow_from_right) {
+                if(leftmost_off == 0) {
+                    for(int i = 0; i < borrow_num; i++) {
+                        int8_t slot = PERMUT_READ(sib->permutation, i);
+                        insert_key(sib->recs[slot].key, sib->recs[slot].val);
+                    }
+                    new_splitkey = sib->get_key(borrow_num);
+                } else {
+                    insert_key(uplevel_splitkey, sib->leftmost_off);
+                    for(int i = 0; i < borrow_num - 1; i++) {
+                        int8_t slot = PERMUT_READ(sib->permutation, i);
+                        insert_key(sib->recs[slot].key, sib->recs[slot].val);
+                    }
+                    new_splitkey = sib->get_key(borrow_num - 1);
+                    sib->leftmost_off = sib->get_value(borrow_num - 1);
+                }
+                PERMUT_DELLEFT(sib->permutation, borrow_num - 1);
+                return new_splitkey;
+            } else {
+                int8_t borrow_start_idx = sib->card() - borrow_num;
+                if(leftmost_off == 0) {
+                    for(int i = sib->card() - 1; i >= borrow_start_idx; i--) {
+                        int8_t slot = PERMUT_READ(sib->permutation, i);
+                        insert_key(sib->recs[slot].key, sib->recs[slot].val);
+                    }
+                    new_splitkey = sib->get_key(borrow_start_idx);
+                } else {
+                    insert_key(uplevel_splitkey, leftmost_off);
+                    for(int i = sib->card() - 1; i >= borrow_start_idx + 1; i--) {
+                        int8_t slot = PERMUT_READ(sib->permutation, i);
+                        insert_key(sib->recs[slot].key, sib->recs[slot].val);
+                    }
+                    new_splitkey = sib->get_key(borrow_start_idx);
+                    leftmost_off = sib->get_value(borrow_start_idx);
+                }
+                PERMUT_DELRIGHT(sib->permutation, borrow_start_idx);
+                return new_splitkey;
+            }
+        }
+
+        void merge(Node * sib, _key_t uplevel_splitkey, bool merge_with_right) {
+            if(merge_with_right) {
+                if(leftmost_off != 0) {
+                    insert_key(uplevel_splitkey, sib->leftmost_off);
+                }
+                for(int i = 0; i < PERMUT_COUNT(sib->permutation); i++) {
+                    int8_t slot = PERMUT_READ(sib->permutation, i);
+                    insert_key(sib->recs[slot].key, sib->recs[slot].val);
+                }
+                sibling_off = sib->sibling_off;
+            } else {
+                if(leftmost_off != 0) {
+                    sib->insert_key(uplevel_splitkey, leftmost_off);
+                }
+                for(int i = 0; i < PERMUT_COUNT(permutation); i++) {
+                    int8_t slot = PERMUT_READ(permutation, i);
+                    sib->insert_key(recs[slot].key, recs[slot].val);
+                }
+                sib->sibling_off = sibling_off;
+            }
+        }
+
+        void get_siblings(int8_t idx, uint64_t &left, uint64_t &right) const {
+            if(idx == -1) {
+                left = 0;
+            } else if(idx == 0) {
+                left = leftmost_off;
+            } else {
+                left = recs[PERMUT_READ(permutation, idx - 1)].val;
+            }
+
+            right = idx + 1 < PERMUT_COUNT(permutation) ? recs[PERMUT_READ(permutation, idx + 1)].val : 0;
+        }
+
+        inline _key_t get_key(int8_t idx) const {
+            return recs[PERMUT_READ(permutation, idx)].key;
+        }
+
+        inline uint64_t get_value(int8_t idx) const {
+            return recs[PERMUT_READ(permutation, idx)].val;
+        }
+
+        inline void update_key(int8_t idx, _key_t key) {
+            _key_t * p = &recs[PERMUT_READ(permutation, idx)].key;
+            *p = key;
+            persist::persist(p, sizeof(_key_t));
+        }
+
+        inline void update_value(int8_t idx, uint64_t value) {
+            uint64_t * p = &recs[PERMUT_READ(permutation, idx)].val;
+            *p = value;
+            persist::persist(p, sizeof(uint64_t));
+        }
+
+        inline bool underflow() const {
+            return PERMUT_COUNT(permutation) < CARDINALITY / 2;
+        }
+
+        inline bool full() const {
+            return PERMUT_COUNT(permutation) == CARDINALITY;
+        }
+
+        inline int8_t card() const {
+            return PERMUT_COUNT(permutation);
+        }
+
+    public:
+        friend class wbtree;
+
+        res_t store(pool & p, _key_t key, uint64_t right) {
+            int num_entries = PERMUT_COUNT(permutation);
+
+            if(num_entries < CARDINALITY) {
+                insert_key(key, right);
+
+                return res_t(false, {0, 0});
+            } else { // split, the caller has logged this node
+                uint64_t new_off = p.alloc();
+                Node * new_node = p.at<Node>(new_off);
+                int8_t right_num = std::ceil((float)num_entries / 2);
+                int8_t m = num_entries - right_num;
+
+                int8_t slot = PERMUT_READ(permutation, m);
+                if(key >= recs[slot].key) {
+                    slot = PERMUT_READ(permutation, ++m);
+                    right_num -= 1;
+                }
+                _key_t split_key = recs[slot].key;
+
+                if(leftmost_off != 0) {
+                    new_node->leftmost_off = recs[slot].val;
+                    m += 1;
+                }
+                int8_t new_slot = 0;
+                do {
+                    slot = PERMUT_READ(permutation, m++);
+                    new_node->recs[new_slot] = recs[slot];
+                    PERMUT_ADD(new_node->permutation, new_slot, new_slot);
+                    new_slot += 1;
+                } while (m < num_entries);
+
+                if(leftmost_off == 0) {
+                    new_node->sibling_off = sibling_off;
+                }
+
+                sibling_off = new_off;
+                PERMUT_DELRIGHT(permutation, num_entries - right_num);
+
+                if(key < split_key) {
+                    insert_key(key, right);
+                } else {
+                    new_node->insert_key(key, right);
+                }
+
+                return res_t(true, {split_key, new_off});
+            }
+        }
+
+        bool remove(_key_t key) { // return true if the key was in the node
+            int8_t idx = lower_bound(key);
+
+            if(idx < card() && get_key(idx) == key) {
+                remove_key(idx);
+                return true;
+            }
+            return false;
+        }
+
+        res_t linear_search(_key_t key) const {
+            int8_t num = PERMUT_COUNT(permutation);
+
+            if(leftmost_off == 0) { // leaf node
+                int8_t idx = lower_bound(key);
+                if(idx < num && get_key(idx) == key)
+                    return res_t(true, recs[PERMUT_READ(permutation, idx)], idx);
+                else
+                    return res_t(false, {0, 0}, idx);
+            } else { // inner node, the last record whose key leq key
+                if(num == 0 || key < get_key(0)) {
+                    return res_t(true, {key, leftmost_off}, -1);
+                }
+                int8_t idx = 0;
+                while(idx + 1 < num && key >= get_key(idx + 1)) idx++;
+
+                return res_t(true, recs[PERMUT_READ(permutation, idx)], idx);
+            }
+        }
+
+        void print(const pool & p, const int8_t tree_depth, int8_t cur_depth) const {
+            string prefix = "";
+            for(int i = 0; i < cur_depth; i++) {
+                prefix += "  ";
+            }
+            printf("%sNode(%d) Left:%lu Sibling:%lu Permutation: 0x%016lx ", prefix.c_str(),
+                   tree_depth - cur_depth, leftmost_off, sibling_off, permutation);
+            for(int i = 0; i < PERMUT_COUNT(permutation); i++) {
+                int8_t slot = PERMUT_READ(permutation, i);
+                printf("(%ld,%lu) ", recs[slot].key, recs[slot].val);
+            }
+            printf("\n");
+
+            if(leftmost_off != 0) {
+                p.at<Node>(leftmost_off)->print(p, tree_depth, cur_depth + 1);
+                for(int i = 0; i < PERMUT_COUNT(permutation); i++) {
+                    p.at<Node>(get_value(i))->print(p, tree_depth, cur_depth + 1);
+                }
+            }
+        }
+    };
+
+    static_assert(sizeof(Node) == PAGESIZE, "a node must fill exactly one block");
+
+    class wbtree : public tree_base<wbtree, _key_t, _value_t> {
+    private:
+        pool p;
+
+        inline Node * node(uint64_t off) {
+            return p.at<Node>(off);
+        }
+
+        res_t insert_recursive(uint64_t off, _key_t k, _value_t v) {
+            Node * n = node(off);
+            if(n->leftmost_off == 0) {
+                res_t find_res = n->linear_search(k);
+                if(find_res.flag == true) { // the key is in the tree, its value is replaced
+                    n->update_value(find_res.idx, (uint64_t)v);
+                    return res_t(false, {0, 0});
+                }
+
+                if(n->full()) p.log_node(off); // the leaf splits
+
+                return n->store(p, k, (uint64_t)v);
+            } else {
+                res_t find_res = n->linear_search(k);
+
+                res_t insert_res = insert_recursive(find_res.rec.val, k, v);
+
+                if(insert_res.flag == true) { // splitting cascades to Node n
+                    p.log_node(off);
+                    return n->store(p, insert_res.rec.key, insert_res.rec.val);
+                } else {
+                    return res_t(false, {0, 0});
+                }
+            }
+        }
+
+        // rebalance the child of n at find_res.idx, return true if n underflows
+        bool rebalance(uint64_t n_off, const res_t & find_res) {
+            Node * n = node(n_off);
+            uint64_t child_off = find_res.rec.val;
+            Node * child = node(child_off);
+            uint64_t left_off, right_off;
+            n->get_siblings(find_res.idx, left_off, right_off);
+            Node * leftchild = node(left_off), * rightchild = node(right_off);
+
+            p.log_node(n_off);
+            p.log_node(child_off);
+            if(leftchild != NULL && leftchild->card() > UNDERFLOW_CARD) {
+                p.log_node(left_off);
+                _key_t new_key = child->borrow(leftchild, n->get_key(find_res.idx), false);
+                n->update_key(find_res.idx, new_key);
+                return false;
+            } else if(rightchild != NULL && rightchild->card() > UNDERFLOW_CARD) {
+                p.log_node(right_off);
+                _key_t new_key = child->borrow(rightchild, n->get_key(find_res.idx + 1), true);
+                n->update_key(find_res.idx + 1, new_key);
+                return false;
+            } else if(leftchild != NULL) {
+                p.log_node(left_off);
+                child->merge(leftchild, n->get_key(find_res.idx), false);
+                p.free(child_off);
+                n->remove_key(find_res.idx);
+                return n->underflow();
+            } else if(rightchild != NULL) {
+                p.log_node(right_off);
+                child->merge(rightchild, n->get_key(find_res.idx + 1), true);
+                p.free(right_off);
+                n->remove_key(find_res.idx + 1);
+                return n->underflow();
+            }
+            return false;
+        }
+
+        // return true if the node at off needs to merge with siblings
+        bool remove_recursive(uint64_t off, _key_t k, bool & removed) {
+            Node * n = node(off);
+            if(n->leftmost_off == 0) {
+                removed = n->remove(k);
+                return removed && n->underflow();
+            } else {
+                res_t find_res = n->linear_search(k);
+
+                bool isUnderflow = remove_recursive(find_res.rec.val, k, removed);
+                if(isUnderflow == true) {
+                    return rebalance(off, find_res);
+                }
+                return false;
+            }
+        }
+
+    public:
+        wbtree(const char * path) : p(path) {
+            if(p.root() == 0) {
+                p.begin();
+                p.root() = p.alloc();
+                p.height() = 1;
+                p.commit();
+            }
+        }
+
+        ~wbtree() {} // the nodes stay in the file
+
+        pool & get_pool() { return p; }
+
+        bool find(_key_t k, _value_t &v) {
+            Node * cur = node(p.root());
+
+            while(cur->leftmost_off != 0) {
+                res_t find_res = cur->linear_search(k);
+                cur = node(find_res.rec.val);
+            }
+
+            res_t find_res = cur->linear_search(k);
+            if(find_res.flag == true) {
+                v = (_value_t)find_res.rec.val;
+                return true;
+            } else {
+                return false;
+            }
+        }
+
+        void insert(_key_t k, _value_t v) {
+            res_t insert_res = insert_recursive(p.root(), k, v);
+
+            if(insert_res.flag == true) { // splitting cascades to the root node
+                uint64_t new_root = p.alloc();
+                Node * n = node(new_root);
+                n->leftmost_off = p.root();
+                n->store(p, insert_res.rec.key, insert_res.rec.val);
+
+                p.root() = new_root;
+                p.height() += 1;
+            }
+            p.commit();
+        }
+
+        bool update(_key_t k, _value_t v) {
+            Node * cur = node(p.root());
+
+            while(cur->leftmost_off != 0) {
+                res_t find_res = cur->linear_search(k);
+                cur = node(find_res.rec.val);
+            }
+
+            res_t find_res = cur->linear_search(k);
+            if(find_res.flag == true) {
+                cur->update_value(find_res.idx, (uint64_t)v);
+                return true;
+            }
+            return false;
+        }
+
+        bool remove(_key_t k) {
+            uint64_t root_off = p.root();
+            Node * root = node(root_off);
+            if(root->leftmost_off == 0) {
+                return root->remove(k);
+            } else {
+                res_t find_res = root->linear_search(k);
+
+                bool removed = false;
+                bool isUnderflow = remove_recursive(find_res.rec.val, k, removed);
+                if(isUnderflow == true) {
+                    rebalance(root_off, find_res);
+
+                    if(root->card() == 0) { // make the only child be the root
+                        p.root() = root->leftmost_off;
+                        p.height() -= 1;
+                        p.free(root_off);
+                    }
+                }
+                p.commit();
+                return removed;
+            }
+        }
+
+        void printAll() {
+            node(p.root())->print(p, p.height(), 0);
+        }
+    };
+}; // namespace slotonly_pm
+
+#endif
@@ -0,0 +1,226 @@
+/*  stats.h - opt-in counters on the hot paths of the trees
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __STATS__
+#define __STATS__
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/*
+    Built with -DBTREE_STATS, the btree, btree(unsort node) and slotonly
+    count what their hot paths do: nodes visited per lookup, node searches
+    and their key comparisons, splits by level (0 is the leaves), merges,
+    borrows and root growth/shrink. Without it the STAT_* macros expand to
+    nothing and the trees compile exactly as before.
+
+    The counters are per engine and per thread: every thread increments its
+    own block without atomic read-modify-writes, blocks of exited threads
+    are folded into one. total(), each_thread() and dump() read them while
+    the trees run; reset() only while they do not.
+
+    A split cascade of one insert goes up from the leaf level by level, so
+    the i-th split since the insert began is at level i.
+*/
+namespace stats {
+
+enum engine_t {BTREE, BTREE_UNSORT, SLOTONLY, ENGINE_NUM};
+
+static const char * ENGINE_NAMES[] = {"btree", "btree_unsort", "slotonly"};
+
+enum counter_t {
+    FINDS, INSERTS, REMOVES,
+    FIND_NODES,         // nodes visited by the finds
+    SEARCHES, COMPARES, // node searches (get_child, linear_search) and the keys they compared
+    SPLITS, MERGES, BORROWS,
+    ROOT_GROWS, ROOT_SHRINKS,
+    COUNTER_NUM
+};
+
+static const char * COUNTER_NAMES[] = {"finds", "inserts", "removes", "find_nodes", "searches", "compares",
+                                       "splits", "merges", "borrows", "root_grows", "root_shrinks"};
+
+const int MAX_LEVEL = 16;
+
+#ifdef BTREE_STATS
+    const bool ENABLED = true;
+#else
+    const bool ENABLED = false;
+#endif
+
+struct counters_t {
+    uint64_t c[COUNTER_NUM];
+    uint64_t splits_at[MAX_LEVEL]; // the last level also holds the splits above it
+
+    void add(const counters_t & o) {
+        for(int i = 0; i < COUNTER_NUM; i++) c[i] += o.c[i];
+        for(int i = 0; i < MAX_LEVEL; i++) splits_at[i] += o.splits_at[i];
+    }
+};
+
+struct block_t {
+    int tid;
+    std::atomic<uint64_t> c[ENGINE_NUM][COUNTER_NUM];
+    std::atomic<uint64_t> splits_at[ENGINE_NUM][MAX_LEVEL];
+    int cascade[ENGINE_NUM]; // splits since the current insert began
+
+    counters_t read(int e) const {
+        counters_t r;
+        for(int i = 0; i < COUNTER_NUM; i++) r.c[i] = c[e][i].load(std::memory_order_relaxed);
+        for(int i = 0; i < MAX_LEVEL; i++) r.splits_at[i] = splits_at[e][i].load(std::memory_order_relaxed);
+        return r;
+    }
+
+    void clear() {
+        for(int e = 0; e < ENGINE_NUM; e++) {
+            for(int i = 0; i < COUNTER_NUM; i++) c[e][i].store(0, std::memory_order_relaxed);
+            for(int i = 0; i < MAX_LEVEL; i++) splits_at[e][i].store(0, std::memory_order_relaxed);
+            cascade[e] = 0;
+        }
+    }
+};
+
+struct registry_t {
+    std::mutex mtx;
+    std::vector<block_t *> live;
+    counters_t exited[ENGINE_NUM];
+    int next_tid;
+};
+
+static inline registry_t & registry() {
+    static registry_t r = {};
+    return r;
+}
+
+// the block of the calling thread, registered on first use
+class thread_block {
+    public:
+        block_t * b;
+
+        thread_block() : b(new block_t) {
+            b->clear();
+            registry_t & r = registry();
+            std::lock_guard<std::mutex> lk(r.mtx);
+            b->tid = r.next_tid++;
+            r.live.push_back(b);
+        }
+
+        ~thread_block() {
+            registry_t & r = registry();
+            std::lock_guard<std::mutex> lk(r.mtx);
+            for(int e = 0; e < ENGINE_NUM; e++) r.exited[e].add(b->read(e));
+            for(size_t i = 0; i < r.live.size(); i++) {
+                if(r.live[i] == b) r.live.erase(r.live.begin() + i);
+            }
+            delete b;
+        }
+};
+
+static inline block_t & local() {
+    static thread_local thread_block t;
+    return *t.b;
+}
+
+static inline void add(engine_t e, counter_t k, uint64_t n) {
+    std::atomic<uint64_t> & a = local().c[e][k];
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline void begin_insert(engine_t e) {
+    add(e, INSERTS, 1);
+    local().cascade[e] = 0;
+}
+
+static inline void split(engine_t e) {
+    block_t & b = local();
+    int level = b.cascade[e] < MAX_LEVEL - 1 ? b.cascade[e]++ : MAX_LEVEL - 1;
+    add(e, SPLITS, 1);
+    std::atomic<uint64_t> & a = b.splits_at[e][level];
+    a.store(a.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// call f(tid, counters) for every live thread that touched engine e
+template <typename F>
+void each_thread(engine_t e, F f) {
+    registry_t & r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    for(block_t * b : r.live) {
+        counters_t c = b->read(e);
+        if(c.c[FINDS] + c.c[INSERTS] + c.c[REMOVES] + c.c[SEARCHES] > 0) f(b->tid, c);
+    }
+}
+
+// the counters of engine e over all threads, the exited ones included
+static inline counters_t total(engine_t e) {
+    counters_t t = {};
+    each_thread(e, [&](int, const counters_t & c) { t.add(c); });
+    std::lock_guard<std::mutex> lk(registry().mtx);
+    t.add(registry().exited[e]);
+    return t;
+}
+
+static inline void reset() {
+    registry_t & r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    for(block_t * b : r.live) b->clear();
+    for(int e = 0; e < ENGINE_NUM; e++) r.exited[e] = counters_t{};
+}
+
+static inline void print(FILE * f, const char * who, const counters_t & c) {
+    double ops = c.c[FINDS] + c.c[INSERTS] + c.c[REMOVES];
+    fprintf(f, "    %-8s finds %lu, inserts %lu, removes %lu", who, c.c[FINDS], c.c[INSERTS], c.c[REMOVES]);
+    if(c.c[FINDS] > 0) fprintf(f, ", nodes/find %.2f", (double)c.c[FIND_NODES] / c.c[FINDS]);
+    if(c.c[SEARCHES] > 0) fprintf(f, ", compares/search %.2f", (double)c.c[COMPARES] / c.c[SEARCHES]);
+    if(ops > 0) fprintf(f, ", searches/op %.2f", c.c[SEARCHES] / ops);
+    fprintf(f, "\n    %-8s splits %lu", "", c.c[SPLITS]);
+    if(c.c[SPLITS] > 0) {
+        fprintf(f, " (by level");
+        for(int i = 0; i < MAX_LEVEL; i++) {
+            if(c.splits_at[i] > 0) fprintf(f, " %d:%lu", i, c.splits_at[i]);
+        }
+        fprintf(f, ")");
+    }
+    fprintf(f, ", merges %lu, borrows %lu, root grows %lu, root shrinks %lu\n", c.c[MERGES], c.c[BORROWS],
+            c.c[ROOT_GROWS], c.c[ROOT_SHRINKS]);
+}
+
+// print the counters of every engine that was used, per thread if more than one thread used it
+static inline void dump(FILE * f) {
+    if(!ENABLED) {
+        fprintf(f, "stats: built without -DBTREE_STATS\n");
+        return;
+    }
+    for(int e = 0; e < ENGINE_NUM; e++) {
+        std::vector<std::pair<int, counters_t>> threads;
+        each_thread((engine_t)e, [&](int tid, const counters_t & c) { threads.push_back({tid, c}); });
+        counters_t t = total((engine_t)e);
+        if(t.c[FINDS] + t.c[INSERTS] + t.c[REMOVES] + t.c[SEARCHES] == 0) continue;
+
+        fprintf(f, "stats %s\n", ENGINE_NAMES[e]);
+        if(threads.size() > 1) {
+            for(auto & th : threads) {
+                char who[32];
+                snprintf(who, sizeof(who), "thread %d", th.first);
+                print(f, who, th.second);
+            }
+        }
+        print(f, "total", t);
+    }
+}
+
+}; // namespace stats
+
+#ifdef BTREE_STATS
+    #define STAT_ADD(engine, counter, n) stats::add(stats::engine, stats::counter, (n))
+    #define STAT_INSERT(engine) stats::begin_insert(stats::engine)
+    #define STAT_SPLIT(engine) stats::split(stats::engine)
+#else
+    #define STAT_ADD(engine, counter, n) do {} while(0)
+    #define STAT_INSERT(engine) do {} while(0)
+    #define STAT_SPLIT(engine) do {} while(0)
+#endif
+
+#endif //__STATS__
@@ -1,110 +1,358 @@
+/*  test.cc - YCSB style benchmark of the trees
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+
+    Every selected tree is loaded with --records records, then the selected
+    workloads run one after another on it (like YCSB, D and E keep the records
+    they insert). Each run phase starts with --warmup untimed operations. The
+    operations are generated before the timer starts.
+
+        workload  mix                                   default distribution
+        a         50% read, 50% update                  zipfian
+        b         95% read, 5% update                   zipfian
+        c         100% read                             zipfian
+        d         95% read, 5% insert                   latest
+        e         95% scan, 5% insert                   zipfian
+        f         50% read, 50% read-modify-write       zipfian
+
+    Unless --no-latency is given, every operation is timed with latency::now()
+    and p50/p99/p99.9/max are reported per operation type. Unless --no-perf is
+    given, the hardware counters of perf.h run around each phase and are
+    reported per operation; the unavailable ones are left out.
+
+    --record writes every operation a tree receives, the load included, to a
+    trace (trace.h). --trace replays a trace instead of the workloads, closed
+    loop or open loop at the recorded pace times --speed; use --records 0 to
+    replay on an empty tree.
+
+    The workloads call the engines directly (the static path of bench.h), so
+    find can be inlined into the loop; --virtual goes through tree_api for
+    every operation instead, as the trace replay and the wrapped trees do.
+
+    --node-bytes runs the in-memory trees 1-3 once per node size instead of
+    with their default geometry.
+*/
 #include <iostream>
-#include <fstream>
 #include <cstdint>
 #include <cstdlib>
+#include <cmath>
 #include <vector>
 #include <random>
-#include <ctime>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
 
-#include "btree.h"
-#include "btree_unsort.h"
-#include "slotonly.h"
+#include "bench.h"
+#include "perf.h"
 #include "cmdline.h"
 
 using std::cout;
 using std::endl;
-using std::ifstream;
-
-double put_throughput(tree_api *tree, std::vector<_key_t> keys) {
-    auto start = seconds();
-    for(int i = 0; i < keys.size(); i += 1) {
-        _key_t key = keys[i];
-        //cout << key << endl;
-        tree->insert((_key_t)key, (_value_t)key);
-    } 
-    //tree->printAll();
-
-    auto end = seconds();
-    return double(end - start);
+
+struct result_t {
+    string tree;
+    string keys;
+    string phase; // "load" or the workload name
+    string dist;
+    uint64_t ops;
+    double secs;
+    latency::summary_t lat[OP_TYPES]; // count is 0 for the types not in the mix
+    double perf[perf::EVENT_NUM];     // per operation, NAN if the event was not counted
+    double heap_per_key, file_per_key; // after the load phase, 0 in the other phases
+    uint64_t missed;                   // updates that found no key
+};
+
+// run is the static path of the tree (bench.h), NULL to make a virtual call per operation
+// returns the updates that found no key
+static uint64_t exec_ops(tree_api * tree, batch_fn run, const op_t * ops, uint64_t num, latency::histogram * hist) {
+    if(run != NULL) return run(tree, ops, num, hist);
+    if(hist != NULL) return run_ops<true>(tree, ops, num, hist);
+    return run_ops<false>(tree, ops, num, NULL);
 }
 
-double get_throughput(tree_api *tree, std::vector<_key_t> keys) {
-    auto start = seconds();
-    _value_t val;
-    for(int i = 0; i < keys.size(); i++) {
-        _key_t key = keys[i];
-        if(!tree->find(key, val)) {
-            cout << key << " "<< 0 << endl;
-        } 
-        //cout << key << " " << val << endl;
+// run(hist) executes the num operations of a phase and times them into hist unless it is NULL,
+// the latencies and counters go to r; pc may be NULL
+template <typename F>
+static void run_phase(uint64_t num, bool timed, perf::counters * pc, result_t & r, F run) {
+    std::vector<latency::histogram> hist(timed ? OP_TYPES : 0);
+    if(pc != NULL) pc->start();
+    uint64_t start = latency::clock_ns();
+    run(timed ? hist.data() : NULL);
+    r.secs = (latency::clock_ns() - start) / 1e9;
+    if(pc != NULL) pc->stop();
+
+    for(int i = 0; i < perf::EVENT_NUM; i++) {
+        double v;
+        r.perf[i] = pc != NULL && pc->value(i, v) ? v / num : NAN;
+    }
+
+    for(int t = 0; t < OP_TYPES; t++) {
+        r.lat[t] = timed ? latency::summarize(hist[t]) : latency::summary_t{0, 0, 0, 0, 0};
     }
-    auto end = seconds();
-    return double(end - start);
 }
 
-double update_throughput(tree_api *tree, std::vector<_key_t> keys) {
-    auto start = seconds();
-    for(int i = 0; i < keys.size(); i += 1) {
-        _key_t key = keys[i];
-        tree->update((_key_t)key, (_value_t)key - 1); 
-    } 
-    auto end = seconds();
-    return double(end - start);
+static void report(const result_t & r) {
+    printf("%-18s %-18s %-5s %-8s %10lu ops %9.3f s %9.3f Mops/s\n", r.tree.c_str(), r.keys.c_str(), r.phase.c_str(), r.dist.c_str(),
+           r.ops, r.secs, r.ops / r.secs / 1e6);
+    for(int t = 0; t < OP_TYPES; t++) {
+        const latency::summary_t & l = r.lat[t];
+        if(l.count == 0) continue;
+        printf("    %-7s %10lu ops  p50 %9.0f ns  p99 %9.0f ns  p99.9 %9.0f ns  max %11.0f ns\n", OP_NAMES[t], l.count,
+               l.p50, l.p99, l.p999, l.max);
+    }
+
+    bool any = false;
+    for(int i = 0; i < perf::EVENT_NUM; i++) {
+        if(std::isnan(r.perf[i])) continue;
+        printf("%s %s %.2f", any ? "," : "    per op", perf::EVENTS[i].name, r.perf[i]);
+        any = true;
+    }
+    if(!std::isnan(r.perf[0]) && !std::isnan(r.perf[1])) printf(", IPC %.2f", r.perf[1] / r.perf[0]);
+    if(any) printf("\n");
+    if(r.missed > 0) printf("    %lu updates found no key and changed nothing, their times are not updates\n", r.missed);
+    if(r.phase == "load") {
+        printf("    memory %.1f B/key heap", r.heap_per_key);
+        if(r.file_per_key > 0) printf(", %.1f B/key files", r.file_per_key);
+        printf("\n");
+    }
+    fflush(stdout);
 }
 
-double del_throughput(tree_api *tree, std::vector<_key_t> keys) {
-    auto start = seconds();
-    _value_t val;
-    for(int i = 0; i < keys.size(); i++) {
-        _key_t key = keys[i];
-        cout << key << endl;
-        // if(key == 594) {
-        //     int a =0;
-        // }
-        tree->remove(key);
-        //tree->printAll();
+static void write_json(const string & path, const std::vector<result_t> & results) {
+    FILE * f = fopen(path.c_str(), "w");
+    if(f == NULL) {
+        perror("fopen");
+        exit(-1);
     }
-    auto end = seconds();
-    return double(end - start);
+    fprintf(f, "[\n");
+    for(size_t i = 0; i < results.size(); i++) {
+        const result_t & r = results[i];
+        fprintf(f, "  {\"tree\": \"%s\", \"keys\": \"%s\", \"phase\": \"%s\", \"dist\": \"%s\", \"ops\": %lu, \"seconds\": %.6f, \"mops\": %.6f, \"latency_ns\": {",
+                r.tree.c_str(), r.keys.c_str(), r.phase.c_str(), r.dist.c_str(), r.ops, r.secs, r.ops / r.secs / 1e6);
+        bool first = true;
+        for(int t = 0; t < OP_TYPES; t++) {
+            const latency::summary_t & l = r.lat[t];
+            if(l.count == 0) continue;
+            fprintf(f, "%s\"%s\": {\"count\": %lu, \"p50\": %.0f, \"p99\": %.0f, \"p99.9\": %.0f, \"max\": %.0f}",
+                    first ? "" : ", ", OP_NAMES[t], l.count, l.p50, l.p99, l.p999, l.max);
+            first = false;
+        }
+        fprintf(f, "}, \"perf_per_op\": {");
+        first = true;
+        for(int e = 0; e < perf::EVENT_NUM; e++) {
+            if(std::isnan(r.perf[e])) continue;
+            fprintf(f, "%s\"%s\": %.4f", first ? "" : ", ", perf::EVENTS[e].name, r.perf[e]);
+            first = false;
+        }
+        fprintf(f, "}, \"missed_updates\": %lu", r.missed);
+        if(r.phase == "load") fprintf(f, ", \"heap_bytes_per_key\": %.1f, \"file_bytes_per_key\": %.1f", r.heap_per_key, r.file_per_key);
+        fprintf(f, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
 }
 
+static void write_csv(const string & path, const std::vector<result_t> & results) {
+    FILE * f = fopen(path.c_str(), "w");
+    if(f == NULL) {
+        perror("fopen");
+        exit(-1);
+    }
+    // one row per phase and op type, the latency columns are empty with --no-latency,
+    // the counters (per operation of the phase) are empty when they were not counted
+    fprintf(f, "tree,keys,phase,dist,ops,seconds,mops,op,op_count,p50_ns,p99_ns,p999_ns,max_ns");
+    for(int e = 0; e < perf::EVENT_NUM; e++) fprintf(f, ",%s", perf::EVENTS[e].name);
+    fprintf(f, ",heap_bytes_per_key,file_bytes_per_key\n");
+    for(const result_t & r : results) {
+        string counters;
+        char buf[64];
+        for(int e = 0; e < perf::EVENT_NUM; e++) {
+            if(std::isnan(r.perf[e])) buf[0] = 0;
+            else snprintf(buf, sizeof(buf), "%.4f", r.perf[e]);
+            counters += string(",") + buf;
+        }
+        if(r.phase == "load") snprintf(buf, sizeof(buf), ",%.1f,%.1f", r.heap_per_key, r.file_per_key);
+        else snprintf(buf, sizeof(buf), ",,");
+        counters += buf; // the memory columns
+
+        bool any = false;
+        for(int t = 0; t < OP_TYPES; t++) {
+            const latency::summary_t & l = r.lat[t];
+            if(l.count == 0) continue;
+            fprintf(f, "%s,%s,%s,%s,%lu,%.6f,%.6f,%s,%lu,%.0f,%.0f,%.0f,%.0f%s\n", r.tree.c_str(), r.keys.c_str(), r.phase.c_str(),
+                    r.dist.c_str(), r.ops, r.secs, r.ops / r.secs / 1e6, OP_NAMES[t], l.count, l.p50, l.p99, l.p999, l.max, counters.c_str());
+            any = true;
+        }
+        if(!any) {
+            fprintf(f, "%s,%s,%s,%s,%lu,%.6f,%.6f,,,,,,%s\n", r.tree.c_str(), r.keys.c_str(), r.phase.c_str(), r.dist.c_str(), r.ops, r.secs,
+                    r.ops / r.secs / 1e6, counters.c_str());
+        }
+    }
+    fclose(f);
+}
 
 int main(int argc, char ** argv) {
     cmdline::parser pars;
-    pars.add<int>("scale", 's', "number of records to insert", false, 100);
-    pars.add<int>("tree", 't', "the tree type", true, 1, cmdline::range(1, 4));
+    pars.add<string>("tree", 't', "the tree types, a comma separated list of 1-19 or all", false, "1");
+    pars.add<int>("records", 'n', "number of records to load", false, 100000);
+    pars.add<int>("ops", 'o', "number of operations of each workload", false, 100000);
+    pars.add<int>("warmup", 'w', "untimed operations before each workload", false, 10000);
+    pars.add<string>("workload", 'W', "the workloads to run in order, letters of a-f", false, "abcdef");
+    pars.add<string>("dist", 'd', "the request distribution, empty for the default of each workload", false, "",
+                     cmdline::oneof<string>("", "uniform", "zipfian", "latest"));
+    pars.add<double>("theta", 'z', "skew of the zipfian and latest distributions", false, 0.99);
+    pars.add<int>("scan", 'l', "maximum length of a scan", false, 100);
+    pars.add<int>("seed", 's', "seed of the workload generator", false, 1);
+    pars.add<string>("node-bytes", 'B', "node sizes of the trees 1-3 to sweep, a comma separated list of 128-4096, empty for their default", false, "");
+    pars.add<string>("keys", 'k', "the key sets, a comma separated list of ycsb, dense, clustered, skewed, lognormal or SOSD files", false, "ycsb");
+    pars.add<string>("dir", 'D', "directory for the files of the file-backed trees", false, "/tmp");
+    pars.add<int>("pool", 'p', "pages of 4 KB in the buffer pool of the disk-resident tree", false, 16384);
+    pars.add("sync", '\0', "the trees with a write-ahead log wait for fsync on every operation");
+    pars.add("no-latency", '\0', "do not time the single operations, for the lowest overhead throughput");
+    pars.add("no-perf", '\0', "do not open the hardware counters");
+    pars.add("virtual", '\0', "call the trees through the virtual tree_api instead of their static interface");
+    pars.add<string>("trace", 'T', "replay this trace instead of the workloads", false, "");
+    pars.add<string>("loop", '\0', "replay the trace closed loop or open loop at its recorded pace", false, "closed",
+                     cmdline::oneof<string>("closed", "open"));
+    pars.add<double>("speed", '\0', "open loop replays the trace this many times faster than recorded", false, 1.0);
+    pars.add<string>("record", 'r', "record the operations into this trace, suffixed by the tree name if there are several", false, "");
+    pars.add<string>("json", 'j', "write the results as JSON to this file", false, "");
+    pars.add<string>("csv", 'c', "write the results as CSV to this file", false, "");
     pars.parse_check(argc, argv);
 
-    int test_scale = pars.get<int>("scale");
-    int tree_id = pars.get<int>("tree");
+    std::vector<int> trees = parse_trees(pars.get<string>("tree"));
+    std::vector<std::pair<int, int>> runs; // (tree, node bytes), 0 bytes is the default geometry
+    for(int id : trees) {
+        if(pars.get<string>("node-bytes").empty()) {
+            runs.push_back({id, 0});
+            continue;
+        }
+        for(const string & b : split(pars.get<string>("node-bytes"))) {
+            tree_api * probe = make_sized_tree(id, atoi(b.c_str()));
+            if(probe == NULL) {
+                printf("%s cannot have %s-byte nodes\n", ENGINES[id - 1].name, b.c_str());
+                exit(-1);
+            }
+            delete probe;
+            runs.push_back({id, atoi(b.c_str())});
+        }
+    }
+    uint64_t records = pars.get<int>("records");
+    uint64_t op_num = pars.get<int>("ops");
+    uint64_t warmup = pars.get<int>("warmup");
+    string workloads = pars.get<string>("workload");
+    trace::reader * replay_trace = NULL;
+    bool open_loop = pars.get<string>("loop") == "open";
+    if(!pars.get<string>("trace").empty()) {
+        replay_trace = new trace::reader(pars.get<string>("trace").c_str());
+        if(open_loop && !replay_trace->has_time()) {
+            printf("%s has no timestamps, it can only be replayed closed loop\n", pars.get<string>("trace").c_str());
+            exit(-1);
+        }
+        workloads = "";
+    }
+    for(char c : workloads) {
+        if(c < 'a' || c > 'f') {
+            printf("Invalid workload %c\n", c);
+            exit(-1);
+        }
+    }
 
-    tree_api * tree;
-    switch(tree_id) {
-        case 1: {tree = (tree_api *) new btree::btree; break; }
-        case 2: tree = (tree_api *) new btree_unsort::btree; break;
-        case 3: tree = (tree_api *) new slotonly::wbtree; break;
-        default: printf("Invalid tree type\n"); exit(-1);
+    string dir = pars.get<string>("dir") + "/btree-bench.XXXXXX";
+    if(mkdtemp(&dir[0]) == NULL) {
+        perror("mkdtemp");
+        exit(-1);
     }
-    std::vector<_key_t> keys(test_scale);
-    std::default_random_engine e1(get_seed());
-    std::uniform_int_distribution<_key_t> dist(0, 100000);
-    for(int i = 0; i < test_scale; i++) {
-        //keys[i] = dist(e1);
-        keys[i] = i;
+
+    bool timed = !pars.exist("no-latency");
+    perf::counters * pc = pars.exist("no-perf") ? NULL : new perf::counters;
+    std::vector<result_t> results;
+    std::vector<string> specs = split(pars.get<string>("keys"));
+    uint64_t needed = records; // the generated key sets get enough keys for every insert
+    for(char c : workloads) {
+        if(WORKLOADS[c - 'a'].insert > 0) needed += warmup + op_num;
     }
-    std::shuffle(keys.begin(), keys.end(), e1);
-    
-    cout << "put workload" << endl;
-    put_throughput(tree, keys);
+    for(const string & spec : specs) {
+        keyset ks(spec, needed, pars.get<int>("seed"));
+        if(records > ks.size()) {
+            printf("the key set %s has only %lu keys\n", ks.name().c_str(), ks.size());
+            exit(-1);
+        }
+
+        for(const std::pair<int, int> & run : runs) {
+            int id = run.first;
+            string name = ENGINES[id - 1].name;
+            if(run.second > 0) name += "-" + std::to_string(run.second);
+            uint64_t heap_before = heap_bytes();
+            stats::reset();
+            batch_fn static_run = NULL;
+            batch_fn * want = pars.exist("virtual") ? NULL : &static_run;
+            tree_api * tree = run.second > 0 ? make_sized_tree(id, run.second, want)
+                                             : make_tree(id, dir + "/" + name, pars.get<int>("pool"), pars.exist("sync"), want);
+            _value_t probe;
+            bool can_scan = tree->scan(0, 1, &probe) >= 0;
+            if(!pars.get<string>("record").empty()) {
+                string path = pars.get<string>("record") + (runs.size() > 1 ? "." + name : "") +
+                              (specs.size() > 1 ? "." + ks.name() : "");
+                tree = (tree_api *) new trace::recorder(tree, path.c_str());
+                static_run = NULL;
+            }
 
-    cout << "get workload" << endl;
-    get_throughput(tree, keys);
+            std::mt19937_64 e(pars.get<int>("seed"));
+            zipfian zipf(pars.get<double>("theta"));
 
-    std::shuffle(keys.begin(), keys.end(), e1);
-    
-    del_throughput(tree, keys);
-    cout << "finish the test" << endl;
+            std::vector<op_t> load(records);
+            for(uint64_t i = 0; i < records; i++) load[i] = {OP_INSERT, 0, ks.key(i)};
+            uint64_t inserted = records;
 
-    delete tree;
+            result_t r = {name, ks.name(), "load", "", records};
+            if(records > 0) {
+                run_phase(records, timed, pc, r, [&](latency::histogram * h) { exec_ops(tree, static_run, load.data(), records, h); });
+                std::vector<op_t>().swap(load);
+                r.heap_per_key = ((double)heap_bytes() - heap_before) / records;
+                r.file_per_key = (double)dir_bytes(dir) / records;
+                results.push_back(r);
+                report(r);
+            }
+            std::vector<op_t>().swap(load);
+
+            for(char c : workloads) {
+                const workload_t & w = WORKLOADS[c - 'a'];
+                string dist = pars.get<string>("dist").empty() ? w.dist : pars.get<string>("dist");
+                if(w.scan > 0 && !can_scan) {
+                    printf("%-18s %-18s %-5c skipped, the tree cannot scan\n", name.c_str(), ks.name().c_str(), c);
+                    continue;
+                }
+
+                std::vector<op_t> ops = gen_ops(w, dist, warmup + op_num, inserted, pars.get<int>("scan"), ks, zipf, e);
+                run_ops<false>(tree, ops.data(), warmup, NULL);
+
+                r = {name, ks.name(), string(1, c), dist, op_num};
+                run_phase(op_num, timed, pc, r, [&](latency::histogram * h) { r.missed = exec_ops(tree, static_run, ops.data() + warmup, op_num, h); });
+                results.push_back(r);
+                report(r);
+            }
+
+            if(replay_trace != NULL) {
+                uint64_t num = replay_trace->count();
+                r = {name, ks.name(), "trace", pars.get<string>("loop"), num};
+                run_phase(num, timed, pc, r, [&](latency::histogram * h) {
+                    if(h != NULL) replay<true>(tree, replay_trace->records(), num, open_loop, pars.get<double>("speed"), h);
+                    else replay<false>(tree, replay_trace->records(), num, open_loop, pars.get<double>("speed"), NULL);
+                });
+                results.push_back(r);
+                report(r);
+            }
+
+            if(stats::ENABLED) stats::dump(stdout);
+            delete tree;
+            clean_dir(dir);
+        }
+    }
+    rmdir(dir.c_str());
+    delete pc;
+    delete replay_trace;
+
+    if(!pars.get<string>("json").empty()) write_json(pars.get<string>("json"), results);
+    if(!pars.get<string>("csv").empty()) write_csv(pars.get<string>("csv"), results);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,159 +1,374 @@
+/*  test2.cc - multi-threaded benchmark of the trees
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
 
+    For every point of the scaling curve (1, 2, 4, ... threads up to the usable
+    cores, or --threads) the selected tree is built behind a reader-writer lock
+    (see bench.h), loaded and warmed up by the main thread, then one YCSB
+    workload runs on all the threads. The operations of all threads are
+    generated as one stream and dealt round-robin, so inserted keys never
+    collide. Every thread is pinned to a core, copies its operations into
+    memory it touched first and waits on a start barrier; it reports its own
+    throughput and latency percentiles.
 
+    With libnuma (HAVE_NUMA, set by the Makefile when numa.h is found) the
+    cores can be restricted to some nodes, filled node by node or round-robin
+    across nodes, and the tree memory can be bound to a node or interleaved.
+*/
 #include <iostream>
-#include <fstream>
 #include <vector>
-#include <cstring>
 #include <thread>
-#include <random>
+#include <atomic>
 #include <algorithm>
+#include <sched.h>
+#include <pthread.h>
+#ifdef HAVE_NUMA
+    #include <numa.h>
+#endif
 
-#include "btree.h"
-#include "btree_unsort.h"
-#include "slotonly.h"
-
-#define DEBUG true
+#include "bench.h"
+#include "cmdline.h"
 
 using std::cout;
 using std::endl;
-using mykey_t = int64_t;
-using myvalue_t = int64_t;
-
-mykey_t * keys;
-int * insert_order;
-
-template <typename BTreeType>
-void put_throughput(BTreeType &tree, uint32_t scale, uint32_t req_cnt, uint32_t thread_id) {
-    thread_local std::default_random_engine rd(thread_id);
-    thread_local std::uniform_int_distribution<uint32_t> dist(0, scale);
-    
-    int offset = thread_id * req_cnt;
-    for(int i = 1; i <= req_cnt; i += 1) {
-        mykey_t key = keys[insert_order[offset + i]];
-        tree.insert((mykey_t)key, (myvalue_t)key);
-    }
 
-    cout << thread_id << " finish insert " << endl;
+class spin_barrier {
+    private:
+        std::atomic<int> arrived;
+        int total;
+
+    public:
+        spin_barrier(int n) : arrived(0), total(n) {}
+
+        void wait() {
+            arrived.fetch_add(1);
+            while(arrived.load() < total) std::this_thread::yield(); // threads may outnumber the cores
+        }
+};
+
+struct core_t {
+    int cpu;
+    int node;
+};
+
+struct thread_result_t {
+    core_t core;
+    uint64_t ops;
+    uint64_t missed; // updates that found no key
+    uint64_t start_ns, end_ns;
+    std::vector<latency::histogram> hist; // per op type
+};
+
+static std::vector<int> parse_list(const string & s) {
+    std::vector<int> l;
+    for(const string & item : split(s)) l.push_back(atoi(item.c_str()));
+    return l;
+}
+
+static int node_of(int cpu) {
+    #ifdef HAVE_NUMA
+        if(numa_available() >= 0) return numa_node_of_cpu(cpu);
+    #endif
+    return 0;
 }
 
-template <typename BTreeType>
-void get_throughput(BTreeType &tree, uint32_t scale, uint32_t req_cnt, uint32_t thread_id) {
-    thread_local std::default_random_engine rd(thread_id);
-    thread_local std::uniform_int_distribution<uint32_t> dist(0, scale);
-    int64_t val;
-    uint32_t notfound = 0;
-
-    for(int i = 1; i <= req_cnt; i++) {
-        mykey_t key = keys[dist(rd)];
-        if(!tree.find(key, val)) {
-            notfound++;
-        } 
+// the cores the threads are placed on, in the order threads take them
+static std::vector<core_t> usable_cores(const std::vector<int> & nodes, bool scatter) {
+    cpu_set_t set;
+    sched_getaffinity(0, sizeof(set), &set);
+
+    std::vector<core_t> cores;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(!CPU_ISSET(cpu, &set)) continue;
+        int node = node_of(cpu);
+        if(nodes.empty() || std::find(nodes.begin(), nodes.end(), node) != nodes.end())
+            cores.push_back({cpu, node});
     }
+    std::stable_sort(cores.begin(), cores.end(), [](const core_t & a, const core_t & b) { return a.node < b.node; });
 
-    cout << thread_id << " finish get " << notfound << endl;
+    if(scatter) { // round-robin across the nodes
+        std::vector<core_t> out;
+        std::vector<size_t> next;
+        std::vector<int> node_ids;
+        for(const core_t & c : cores) {
+            if(node_ids.empty() || node_ids.back() != c.node) node_ids.push_back(c.node);
+        }
+        for(size_t n = 0; n < node_ids.size(); n++) {
+            size_t i = 0;
+            while(cores[i].node != node_ids[n]) i++;
+            next.push_back(i);
+        }
+        while(out.size() < cores.size()) {
+            for(size_t n = 0; n < node_ids.size(); n++) {
+                if(next[n] < cores.size() && cores[next[n]].node == node_ids[n]) out.push_back(cores[next[n]++]);
+            }
+        }
+        cores.swap(out);
+    }
+    return cores;
 }
 
-template <typename BTreeType>
-void del_throughput(BTreeType &tree, uint32_t scale, uint32_t req_cnt, uint32_t thread_id) {
-    thread_local std::default_random_engine rd(thread_id);
-    thread_local std::uniform_int_distribution<uint32_t> dist(0, scale);
-    
-    for(int i = 0; i < req_cnt; i++) {
-        mykey_t key = keys[dist(rd)];
-        tree.remove(key);
-        //cout << thread_id << " " << key << endl;
-    }
-    cout << thread_id << " finish delete " << endl;
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
 
-template <typename BTreeType>
-void update_throughput(BTreeType &tree, uint32_t scale, uint32_t req_cnt, uint32_t thread_id) {
-    thread_local std::default_random_engine rd(thread_id);
-    thread_local std::uniform_int_distribution<uint32_t> dist(0, scale);
+// place the memory allocated from now on, policy is default, local, interleave or a node id
+static void set_memory_policy(const string & policy, const std::vector<int> & nodes) {
+    if(policy == "default") return;
+    #ifdef HAVE_NUMA
+        if(numa_available() < 0) {
+            printf("NUMA is not available, --mem %s is ignored\n", policy.c_str());
+            return;
+        }
+        if(policy == "local") {
+            numa_set_localalloc();
+        } else if(policy == "interleave") {
+            bitmask * mask = numa_allocate_nodemask();
+            if(nodes.empty()) copy_bitmask_to_bitmask(numa_all_nodes_ptr, mask);
+            for(int n : nodes) numa_bitmask_setbit(mask, n);
+            numa_set_interleave_mask(mask);
+            numa_free_nodemask(mask);
+        } else {
+            bitmask * mask = numa_allocate_nodemask();
+            numa_bitmask_setbit(mask, atoi(policy.c_str()));
+            numa_set_membind(mask);
+            numa_free_nodemask(mask);
+        }
+    #else
+        printf("built without libnuma, --mem %s is ignored\n", policy.c_str());
+    #endif
+}
 
-    for(int i = 1; i <= req_cnt; i++) {
-        mykey_t key = keys[dist(rd)]; 
-        tree.update(key, key * 2);
-        //cout << thread_id << " " << key << endl;
-    }
+static void worker(int tid, tree_api * tree, const std::vector<op_t> * all, int threads, bool do_pin,
+                   spin_barrier * ready, thread_result_t * res) {
+    if(do_pin) pin(res->core.cpu);
 
-    cout << " finish update " << endl;
+    // the ops and histograms of the thread are first touched here, i.e. on its own node
+    std::vector<op_t> ops;
+    for(size_t i = tid; i < all->size(); i += threads) ops.push_back((*all)[i]);
+    res->hist.resize(OP_TYPES);
+
+    ready->wait();
+    res->start_ns = latency::clock_ns();
+    res->missed = run_ops<true>(tree, ops.data(), ops.size(), res->hist.data());
+    res->end_ns = latency::clock_ns();
+    res->ops = ops.size();
 }
 
-template <typename BTreeType>
-void exp1(BTreeType &tree, uint32_t scale, uint32_t req_cnt, uint32_t thread_id) {
-    put_throughput(tree, scale, req_cnt, thread_id);
+struct hits_t {
+    uint64_t finds, updates, removes;
+};
+
+// the finds, updates and removes of ops that found their key, on the calling thread
+static hits_t count_hits(tree_api * tree, const std::vector<op_t> & ops) {
+    hits_t h = {0, 0, 0};
+    _value_t val;
+    for(size_t i = 0; i < ops.size(); i++) {
+        const op_t & op = ops[i];
+        switch(op.type) {
+            case OP_READ: h.finds += tree->find(op.key, val); break;
+            case OP_UPDATE: h.updates += tree->update(op.key, (_value_t)i); break;
+            case OP_INSERT: tree->insert(op.key, (_value_t)op.key); break;
+            case OP_REMOVE: h.removes += tree->remove(op.key); break;
+            default: break;
+        }
+    }
+    return h;
+}
 
-    //get_throughput(tree, scale, req_cnt, thread_id);
+// every tree loads the same records and runs the same finds, updates, inserts and removes over
+// the loaded keys and as many absent ones; the hits of each tree must be those of the first.
+// Returns the number of trees that disagree
+static int check_hits(uint64_t records, uint64_t op_num, const string & keys, int seed, const string & dir, int pool) {
+    keyset ks(keys, 2 * records, seed);
+    if(2 * records > ks.size()) {
+        printf("the key set %s has only %lu keys\n", ks.name().c_str(), ks.size());
+        exit(-1);
+    }
+    static const op_type TYPES[] = {OP_READ, OP_UPDATE, OP_INSERT, OP_REMOVE};
+    std::mt19937_64 e(seed);
+    std::uniform_int_distribution<uint64_t> idx(0, 2 * records - 1);
+    std::vector<op_t> ops(op_num);
+    for(op_t & op : ops) op = {TYPES[e() % 4], 0, ks.key(idx(e))};
 
-    //update_throughput(tree, scale, req_cnt, thread_id);
+    printf("%lu records, %lu finds, updates, inserts and removes over %lu keys\n", records, op_num, 2 * records);
+    printf("%-18s %12s %12s %12s\n", "tree", "find hits", "update hits", "remove hits");
+    hits_t ref = {0, 0, 0};
+    int differ = 0;
+    for(int i = 0; i < ENGINE_NUM; i++) {
+        tree_api * tree = make_tree(ENGINES[i].id, dir + "/" + ENGINES[i].name, pool, false);
+        for(uint64_t r = 0; r < records; r++) tree->insert(ks.key(r), (_value_t)ks.key(r));
+        hits_t h = count_hits(tree, ops);
+        delete tree;
+        clean_dir(dir);
 
-    del_throughput(tree, scale, req_cnt, thread_id);
+        if(i == 0) ref = h;
+        bool same = h.finds == ref.finds && h.updates == ref.updates && h.removes == ref.removes;
+        differ += !same;
+        printf("%-18s %12lu %12lu %12lu%s\n", ENGINES[i].name, h.finds, h.updates, h.removes, same ? "" : "  differs");
+    }
+    return differ;
 }
 
+static void print_latency(const char * who, const std::vector<latency::histogram> & hist) {
+    for(int t = 0; t < OP_TYPES; t++) {
+        if(hist[t].count() == 0) continue;
+        latency::summary_t l = latency::summarize(hist[t]);
+        printf("    %-10s %-7s %10lu ops  p50 %9.0f ns  p99 %9.0f ns  p99.9 %9.0f ns  max %11.0f ns\n", who, OP_NAMES[t],
+               l.count, l.p50, l.p99, l.p999, l.max);
+    }
+}
 
 int main(int argc, char ** argv) {
-    uint32_t scale = 10000;
-    uint32_t thread_cnt = 1;
-    int test_id = 1;
-
-    if (argc > 1) scale = atoi(argv[1]);
-    if(argc > 2) thread_cnt = atoi(argv[2]);
-    if(argc > 3) test_id = atoi(argv[3]);
-
-    #ifdef DEBUG
-        cout << "SCALE:" << scale << endl;
-        cout << "Threads: " << thread_cnt << endl;
-        cout << "Test load type: " << test_id << endl;
-    #endif
-    
-    keys = new mykey_t[scale];
-    insert_order = new int[scale];
-    uint32_t steps = 100;
-    for(int i = 0; i < scale; i++) {
-        keys[i] = i * steps;
-        insert_order[i] = i;
+    cmdline::parser pars;
+    pars.add<int>("tree", 't', "the tree type, 1-19", false, 1, cmdline::range(1, ENGINE_NUM));
+    pars.add<int>("records", 'n', "number of records to load", false, 100000);
+    pars.add<int>("ops", 'o', "number of operations per thread", false, 100000);
+    pars.add<int>("warmup", 'w', "untimed operations by the main thread before the threads start", false, 10000);
+    pars.add<string>("workload", 'W', "the workload, one of a-f", false, "a",
+                     cmdline::oneof<string>("a", "b", "c", "d", "e", "f"));
+    pars.add<string>("dist", 'd', "the request distribution, empty for the default of the workload", false, "",
+                     cmdline::oneof<string>("", "uniform", "zipfian", "latest"));
+    pars.add<double>("theta", 'z', "skew of the zipfian and latest distributions", false, 0.99);
+    pars.add<int>("scan", 'l', "maximum length of a scan", false, 100);
+    pars.add<int>("seed", 's', "seed of the workload generator", false, 1);
+    pars.add<string>("threads", 'T', "comma separated thread counts, empty for 1, 2, 4, ... up to the cores", false, "");
+    pars.add("no-pin", '\0', "do not pin the threads to cores");
+    pars.add<string>("nodes", 'N', "use only the cores of these NUMA nodes, comma separated", false, "");
+    pars.add<string>("place", 'P', "fill the cores node by node (compact) or round-robin across nodes (scatter)", false,
+                     "compact", cmdline::oneof<string>("compact", "scatter"));
+    pars.add<string>("mem", 'm', "memory of the tree: default, local, interleave or a node id", false, "default");
+    pars.add<string>("keys", 'k', "the key set: ycsb, dense, clustered, skewed, lognormal or a SOSD file", false, "ycsb");
+    pars.add<string>("dir", 'D', "directory for the files of the file-backed trees", false, "/tmp");
+    pars.add<int>("pool", 'p', "pages of 4 KB in the buffer pool of the disk-resident tree", false, 16384);
+    pars.add("sync", '\0', "the trees with a write-ahead log wait for fsync on every operation");
+    pars.add<string>("csv", 'c', "write the curve as CSV to this file", false, "");
+    pars.add("check", '\0', "instead of the curve, compare the hits of all the trees on one workload with removes");
+    pars.parse_check(argc, argv);
+
+    int tree_id = pars.get<int>("tree");
+    string name = ENGINES[tree_id - 1].name;
+    uint64_t records = pars.get<int>("records");
+    uint64_t op_num = pars.get<int>("ops");
+    const workload_t & w = WORKLOADS[pars.get<string>("workload")[0] - 'a'];
+    string dist = pars.get<string>("dist").empty() ? w.dist : pars.get<string>("dist");
+    bool do_pin = !pars.exist("no-pin");
+
+    std::vector<int> nodes = parse_list(pars.get<string>("nodes"));
+    std::vector<core_t> cores = usable_cores(nodes, pars.get<string>("place") == "scatter");
+    if(cores.empty()) {
+        printf("no usable core\n");
+        exit(-1);
+    }
+
+    std::vector<int> curve = parse_list(pars.get<string>("threads"));
+    if(curve.empty()) {
+        for(int t = 1; t < (int)cores.size(); t *= 2) curve.push_back(t);
+        curve.push_back(cores.size());
+    }
+
+    string dir = pars.get<string>("dir") + "/btree-bench.XXXXXX";
+    if(mkdtemp(&dir[0]) == NULL) {
+        perror("mkdtemp");
+        exit(-1);
     }
-    std::shuffle(insert_order, insert_order + scale - 1, std::default_random_engine(99));
-
-    tree_api * tree;
-
-    auto start = seconds();
-    
-    std::vector<std::thread> threads;
-    for(int i = 0; i < thread_cnt; i++) {
-        switch(test_id){
-        case 1:
-            threads.push_back(std::thread(put_throughput<decltype(tree)>, std::ref(tree), scale, scale / thread_cnt, i));
-            break;
-        case 2:
-            threads.push_back(std::thread(get_throughput<decltype(tree)>, std::ref(tree), scale, scale / thread_cnt, i));
-            break;
-        case 3:
-            threads.push_back(std::thread(update_throughput<decltype(tree)>, std::ref(tree), scale, scale / thread_cnt, i));
-            break;
-        case 4:
-            threads.push_back(std::thread(del_throughput<decltype(tree)>, std::ref(tree), scale, scale / thread_cnt, i));
-            break;
-        case 5:
-            threads.push_back(std::thread(exp1<decltype(tree)>, std::ref(tree), scale, scale / thread_cnt, i));
-            break;
-        default:
-            cout << "Not a valid test load type (1-4)" << endl;
-            return 0;
+    if(pars.exist("check")) {
+        int differ = check_hits(records, op_num, pars.get<string>("keys"), pars.get<int>("seed"), dir, pars.get<int>("pool"));
+        rmdir(dir.c_str());
+        return differ == 0 ? 0 : 1;
+    }
+    if(do_pin) pin(cores[0].cpu); // the main thread loads the tree
+    set_memory_policy(pars.get<string>("mem"), nodes);
+
+    FILE * csv = NULL;
+    if(!pars.get<string>("csv").empty()) {
+        csv = fopen(pars.get<string>("csv").c_str(), "w");
+        if(csv == NULL) {
+            perror("fopen");
+            exit(-1);
         }
+        fprintf(csv, "tree,keys,workload,dist,threads,thread,cpu,node,ops,seconds,mops,p50_ns,p99_ns,p999_ns,max_ns\n");
+    }
+
+    uint64_t needed = records + pars.get<int>("warmup") + op_num * *std::max_element(curve.begin(), curve.end());
+    keyset ks(pars.get<string>("keys"), w.insert > 0 ? needed : records, pars.get<int>("seed"));
+    if(records > ks.size()) {
+        printf("the key set %s has only %lu keys\n", ks.name().c_str(), ks.size());
+        exit(-1);
     }
 
-    for(int i = 0; i < thread_cnt; i++) {
-        threads[i].join();
-    } // waiting for all the thread to stop
+    printf("%s, %s keys, workload %c (%s), %lu records, %lu ops per thread, %lu usable cores\n", name.c_str(),
+           ks.name().c_str(), w.name, dist.c_str(), records, op_num, cores.size());
+    for(int threads : curve) {
+        stats::reset();
+        tree_api * tree = make_concurrent_tree(tree_id, dir + "/" + name, pars.get<int>("pool"), pars.exist("sync"));
+        std::mt19937_64 e(pars.get<int>("seed"));
+        zipfian zipf(pars.get<double>("theta"));
 
-    auto end = seconds();
+        std::vector<op_t> load(records);
+        for(uint64_t i = 0; i < records; i++) load[i] = {OP_INSERT, 0, ks.key(i)};
+        run_ops<false>(tree, load.data(), records, NULL);
+        std::vector<op_t>().swap(load);
 
-    cout << "Time Elapse: " << end - start << endl;
+        uint64_t inserted = records;
+        std::vector<op_t> warm = gen_ops(w, dist, pars.get<int>("warmup"), inserted, pars.get<int>("scan"), ks, zipf, e);
+        run_ops<false>(tree, warm.data(), warm.size(), NULL);
+        std::vector<op_t> ops = gen_ops(w, dist, op_num * threads, inserted, pars.get<int>("scan"), ks, zipf, e);
 
-    delete keys;
-    delete insert_order;
+        spin_barrier ready(threads);
+        std::vector<thread_result_t> res(threads);
+        std::vector<std::thread> workers;
+        for(int t = 0; t < threads; t++) {
+            res[t].core = cores[t % cores.size()];
+            workers.push_back(std::thread(worker, t, tree, &ops, threads, do_pin, &ready, &res[t]));
+        }
+        for(std::thread & th : workers) th.join();
+
+        uint64_t first = UINT64_MAX, last = 0, total = 0, missed = 0;
+        std::vector<latency::histogram> all(OP_TYPES);
+        for(const thread_result_t & r : res) {
+            first = std::min(first, r.start_ns);
+            last = std::max(last, r.end_ns);
+            total += r.ops;
+            missed += r.missed;
+            for(int t = 0; t < OP_TYPES; t++) all[t].merge(r.hist[t]);
+        }
+        double secs = (last - first) / 1e9;
+        printf("threads %3d %10lu ops %9.3f s %9.3f Mops/s\n", threads, total, secs, total / secs / 1e6);
+        if(missed > 0) printf("    %lu updates found no key and changed nothing, their times are not updates\n", missed);
+
+        for(int t = 0; t < threads; t++) {
+            const thread_result_t & r = res[t];
+            double tsecs = (r.end_ns - r.start_ns) / 1e9;
+            printf("  thread %3d cpu %3d node %d %9.3f Mops/s\n", t, r.core.cpu, r.core.node, r.ops / tsecs / 1e6);
+            char who[32];
+            snprintf(who, sizeof(who), "thread %d", t);
+            print_latency(who, r.hist);
+        }
+        print_latency("all", all);
+        if(stats::ENABLED) stats::dump(stdout);
+
+        if(csv != NULL) {
+            for(int t = -1; t < threads; t++) { // -1 is the row of all threads
+                latency::histogram h;
+                const std::vector<latency::histogram> & src = t < 0 ? all : res[t].hist;
+                for(int o = 0; o < OP_TYPES; o++) h.merge(src[o]);
+                latency::summary_t l = latency::summarize(h);
+                uint64_t ops_t = t < 0 ? total : res[t].ops;
+                double secs_t = t < 0 ? secs : (res[t].end_ns - res[t].start_ns) / 1e9;
+                fprintf(csv, "%s,%s,%c,%s,%d,%s,%d,%d,%lu,%.6f,%.6f,%.0f,%.0f,%.0f,%.0f\n", name.c_str(), ks.name().c_str(), w.name, dist.c_str(),
+                        threads, t < 0 ? "all" : std::to_string(t).c_str(), t < 0 ? -1 : res[t].core.cpu,
+                        t < 0 ? -1 : res[t].core.node, ops_t, secs_t, ops_t / secs_t / 1e6, l.p50, l.p99, l.p999, l.max);
+            }
+        }
+
+        delete tree;
+        clean_dir(dir);
+    }
+    rmdir(dir.c_str());
+    if(csv != NULL) fclose(csv);
 
     return 0;
 }
@@ -0,0 +1,215 @@
+/*  trace.h - record the operations on a tree into a binary trace and map it back for replay
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __TRACE__
+#define __TRACE__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "base.h"
+#include "latency.h"
+
+/*
+    A trace is a 32-byte header followed by fixed-size 24-byte records, so a
+    replayer walks the mapped file as an array without parsing anything:
+
+        header  magic "BTTRACE1", version, flags, record count
+        record  op (1 byte), 3 bytes padding, timestamp delta (4 bytes),
+                key (8 bytes), value (8 bytes)
+
+    The value of a scan record is the number of records it asked for. With
+    HAS_TIME, the delta is the nanoseconds since the previous record
+    (saturated at 4.29 s), otherwise it is 0. The count is written when the
+    recorder is closed; a trace whose recorder died early has count 0, and
+    its complete records are still used.
+*/
+namespace trace {
+
+enum op_code : uint8_t {FIND, INSERT, UPDATE, REMOVE, SCAN, OP_CODES};
+
+const uint64_t MAGIC = 0x3145434152545442ULL; // "BTTRACE1"
+const uint32_t VERSION = 1;
+const uint32_t HAS_TIME = 1;
+
+struct header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+struct record_t {
+    op_code op;
+    uint8_t pad[3];
+    uint32_t delta; // ns since the previous record
+    _key_t key;
+    _value_t value;
+};
+
+static_assert(sizeof(header_t) == 32 && sizeof(record_t) == 24, "the trace layout is fixed");
+
+// forwards every operation to the wrapped tree (which it deletes) and appends it to the trace
+class recorder : tree_api {
+    private:
+        static const int BUF_RECORDS = 4096;
+
+        tree_api * tree;
+        int fd;
+        bool timed;
+        uint64_t count, last_ns;
+        std::vector<record_t> buf;
+        std::mutex mtx; // the wrapped tree may be shared by threads
+
+        void flush() {
+            size_t len = buf.size() * sizeof(record_t);
+            if(len > 0 && write(fd, buf.data(), len) != (ssize_t)len) {
+                perror("write trace");
+                exit(-1);
+            }
+            buf.clear();
+        }
+
+        void append(op_code op, _key_t key, _value_t value) {
+            std::lock_guard<std::mutex> lk(mtx);
+            record_t r;
+            memset(&r, 0, sizeof(r));
+            r.op = op;
+            r.key = key;
+            r.value = value;
+            if(timed) {
+                uint64_t now = latency::clock_ns();
+                uint64_t d = now - last_ns;
+                r.delta = d > UINT32_MAX ? UINT32_MAX : d;
+                last_ns = now;
+            }
+            buf.push_back(r);
+            count += 1;
+            if(buf.size() == BUF_RECORDS) flush();
+        }
+
+    public:
+        recorder(tree_api * t, const char * path, bool timestamps = true) : tree(t), timed(timestamps), count(0) {
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0) {
+                perror("open trace");
+                exit(-1);
+            }
+            header_t h = {MAGIC, VERSION, timestamps ? HAS_TIME : 0, 0, 0};
+            if(write(fd, &h, sizeof(h)) != sizeof(h)) {
+                perror("write trace");
+                exit(-1);
+            }
+            buf.reserve(BUF_RECORDS);
+            last_ns = latency::clock_ns();
+        }
+
+        ~recorder() {
+            flush();
+            if(pwrite(fd, &count, sizeof(count), offsetof(header_t, count)) != sizeof(count)) perror("write trace");
+            close(fd);
+            delete tree;
+        }
+
+        uint64_t recorded() {
+            return count;
+        }
+
+        bool find(_key_t key, _value_t & value) {
+            append(FIND, key, 0);
+            return tree->find(key, value);
+        }
+
+        void insert(_key_t key, _value_t value) {
+            append(INSERT, key, value);
+            tree->insert(key, value);
+        }
+
+        bool update(_key_t key, _value_t value) {
+            append(UPDATE, key, value);
+            return tree->update(key, value);
+        }
+
+        bool remove(_key_t key) {
+            append(REMOVE, key, 0);
+            return tree->remove(key);
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            append(SCAN, start_key, num);
+            return tree->scan(start_key, num, vals);
+        }
+
+        void printAll() {
+            tree->printAll();
+        }
+};
+
+// a trace mapped read-only, records() is usable as long as the reader lives
+class reader {
+    private:
+        void * addr;
+        size_t len;
+        const header_t * head;
+        uint64_t num;
+
+    public:
+        reader(const char * path) : addr(NULL), len(0) {
+            int fd = open(path, O_RDONLY);
+            if(fd < 0) {
+                perror("open trace");
+                exit(-1);
+            }
+            struct stat st;
+            fstat(fd, &st);
+            len = st.st_size;
+            if(len < sizeof(header_t)) {
+                printf("%s is not a trace\n", path);
+                exit(-1);
+            }
+            addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if(addr == MAP_FAILED) {
+                perror("mmap trace");
+                exit(-1);
+            }
+            madvise(addr, len, MADV_SEQUENTIAL);
+
+            head = (const header_t *)addr;
+            if(head->magic != MAGIC || head->version != VERSION) {
+                printf("%s is not a trace of version %u\n", path, VERSION);
+                exit(-1);
+            }
+            uint64_t in_file = (len - sizeof(header_t)) / sizeof(record_t);
+            num = head->count == 0 || head->count > in_file ? in_file : head->count;
+        }
+
+        ~reader() {
+            munmap(addr, len);
+        }
+
+        bool has_time() const {
+            return head->flags & HAS_TIME;
+        }
+
+        uint64_t count() const {
+            return num;
+        }
+
+        const record_t * records() const {
+            return (const record_t *)((const char *)addr + sizeof(header_t));
+        }
+};
+
+}; // namespace trace
+
+#endif //__TRACE__
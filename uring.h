@@ -0,0 +1,146 @@
+/*  uring.h - a minimal io_uring submission/completion ring for page reads
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __URING__
+#define __URING__
+
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+    Talks to the kernel with the raw system calls, liburing is not needed.
+    If the kernel refuses to set up a ring (too old, or io_uring disabled),
+    ok() is false and the caller falls back to pread.
+*/
+namespace uring {
+
+class ring {
+    private:
+        int ring_fd;
+        unsigned entries;
+        unsigned to_submit; // prepared but not yet handed to the kernel
+
+        unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+        unsigned * cq_head, * cq_tail, * cq_mask;
+        io_uring_sqe * sqes;
+        io_uring_cqe * cqes;
+
+        void * sq_ptr, * cq_ptr;
+        size_t sq_len, cq_len, sqes_len;
+
+    public:
+        ring(unsigned depth) : ring_fd(-1), entries(0), to_submit(0), sqes(NULL), cqes(NULL), sq_ptr(NULL), cq_ptr(NULL) {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            int fd = syscall(__NR_io_uring_setup, depth, &p);
+            if(fd < 0) return;
+
+            sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            if(p.features & IORING_FEAT_SINGLE_MMAP) {
+                sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+            }
+            sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if(sq_ptr == MAP_FAILED) {
+                close(fd);
+                return;
+            }
+            if(p.features & IORING_FEAT_SINGLE_MMAP) {
+                cq_ptr = sq_ptr;
+            } else {
+                cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                if(cq_ptr == MAP_FAILED) {
+                    munmap(sq_ptr, sq_len);
+                    close(fd);
+                    return;
+                }
+            }
+            sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if(sqes == MAP_FAILED) {
+                if(cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+                munmap(sq_ptr, sq_len);
+                close(fd);
+                return;
+            }
+
+            char * sq = (char *)sq_ptr, * cq = (char *)cq_ptr;
+            sq_head = (unsigned *)(sq + p.sq_off.head);
+            sq_tail = (unsigned *)(sq + p.sq_off.tail);
+            sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+            sq_array = (unsigned *)(sq + p.sq_off.array);
+            cq_head = (unsigned *)(cq + p.cq_off.head);
+            cq_tail = (unsigned *)(cq + p.cq_off.tail);
+            cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+            cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+            entries = p.sq_entries;
+            ring_fd = fd;
+        }
+
+        ~ring() {
+            if(ring_fd < 0) return;
+            munmap(sqes, sqes_len);
+            if(cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+            munmap(sq_ptr, sq_len);
+            close(ring_fd);
+        }
+
+        bool ok() {
+            return ring_fd >= 0;
+        }
+
+        unsigned depth() {
+            return entries;
+        }
+
+        // queue a read, false if the submission queue is full
+        bool read(int fd, void * buf, unsigned len, uint64_t off, uint64_t data) {
+            unsigned tail = *sq_tail;
+            if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries) return false;
+
+            unsigned idx = tail & *sq_mask;
+            io_uring_sqe * sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(io_uring_sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)buf;
+            sqe->len = len;
+            sqe->off = off;
+            sqe->user_data = data;
+            sq_array[idx] = idx;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            to_submit += 1;
+            return true;
+        }
+
+        // hand the queued reads to the kernel and wait until at least wait_nr completions are posted
+        int submit(unsigned wait_nr = 0) {
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                              wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if(ret > 0) to_submit -= ret;
+            return ret;
+        }
+
+        // call f(user_data, res) on every posted completion, return their number
+        template <typename F>
+        unsigned reap(F f) {
+            unsigned head = *cq_head, n = 0;
+            while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe * cqe = &cqes[head & *cq_mask];
+                f(cqe->user_data, cqe->res);
+                head += 1;
+                n += 1;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            return n;
+        }
+};
+
+}; // namespace uring
+
+#endif //__URING__
@@ -0,0 +1,345 @@
+/*  value_log.h - variable-size values in an append-only log, the tree keeps their offsets
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __VALUE_LOG__
+#define __VALUE_LOG__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "base.h"
+#include "btree_csb.h"
+
+/*
+    The values are appended to a log of SEGMENT-byte segments and the tree
+    maps a key to the offset of its value, segment id * SEGMENT + position.
+    A record of the log is the key it was written for, the length and the
+    bytes, 8-byte aligned:
+
+        record  key (8 bytes), len (4 bytes), unused (4 bytes), the value
+
+    A find returns a view into the log, nothing is copied. An insert over a
+    key, an update and a remove leave the old record dead in its segment.
+    When the dead bytes exceed MAX_DEAD of the log, the sealed segment with
+    the fewest live bytes becomes the victim: every write then moves up to
+    MOVES records of it to the head of the log (a record is live if the
+    tree still maps its key to its offset) and the segment is freed once
+    it is passed. The trees are single threaded, so the compaction runs in
+    these small steps with the writes instead of on a thread of its own;
+    a write creates one dead record and moves several, so the log stays
+    near its bound.
+
+    A view is valid until the next write of the store, which may move the
+    value and free its segment.
+*/
+namespace vlog {
+using std::string;
+using std::string_view;
+
+struct rec_t {
+    _key_t key;
+    uint32_t len;
+    uint32_t unused;
+
+    const char * data() const {
+        return (const char *)(this + 1);
+    }
+};
+
+class value_log {
+    public:
+        static constexpr uint64_t SEGMENT = 1 << 22;
+
+    private:
+        struct segment_t {
+            char * data;   // NULL if the segment is free
+            uint64_t used;
+            uint64_t live;
+        };
+
+        std::vector<segment_t> segs;
+        std::vector<uint32_t> free_ids;
+        uint32_t head;
+        uint64_t total_live;
+
+        static inline uint64_t rec_bytes(uint64_t len) {
+            return (sizeof(rec_t) + len + 7) & ~(uint64_t)7;
+        }
+
+        void new_head() {
+            if(free_ids.empty()) {
+                head = segs.size();
+                segs.push_back({NULL, 0, 0});
+            } else {
+                head = free_ids.back();
+                free_ids.pop_back();
+            }
+            char * d = (char *)malloc(SEGMENT);
+            if(d == NULL) {
+                perror("malloc");
+                exit(-1);
+            }
+            segs[head] = {d, 0, 0};
+        }
+
+    public:
+        value_log() : total_live(0) {
+            new_head();
+        }
+
+        ~value_log() {
+            for(segment_t & s : segs) free(s.data);
+        }
+
+        value_log(const value_log &) = delete;
+        value_log & operator=(const value_log &) = delete;
+
+        // the offset of the new record of key with the bytes of v
+        uint64_t append(_key_t key, string_view v) {
+            uint64_t need = rec_bytes(v.size());
+            if(need > SEGMENT) {
+                printf("a value of %lu bytes does not fit a segment\n", v.size());
+                exit(-1);
+            }
+            if(segs[head].used + need > SEGMENT) new_head();
+
+            segment_t & s = segs[head];
+            rec_t * r = (rec_t *)(s.data + s.used);
+            r->key = key;
+            r->len = v.size();
+            r->unused = 0;
+            memcpy((char *)r->data(), v.data(), v.size());
+
+            uint64_t off = (uint64_t)head * SEGMENT + s.used;
+            s.used += need;
+            s.live += need;
+            total_live += need;
+            return off;
+        }
+
+        inline const rec_t * rec(uint64_t off) const {
+            return (const rec_t *)(segs[off / SEGMENT].data + off % SEGMENT);
+        }
+
+        inline string_view at(uint64_t off) const {
+            const rec_t * r = rec(off);
+            return string_view(r->data(), r->len);
+        }
+
+        // the record at off is dead
+        void kill(uint64_t off) {
+            uint64_t n = rec_bytes(rec(off)->len);
+            segs[off / SEGMENT].live -= n;
+            total_live -= n;
+        }
+
+        // the offset right after the record at off, in the same segment
+        inline uint64_t next(uint64_t off) const {
+            return off + rec_bytes(rec(off)->len);
+        }
+
+        // the offset where segment id ends
+        inline uint64_t end(uint32_t id) const {
+            return (uint64_t)id * SEGMENT + segs[id].used;
+        }
+
+        // the sealed segment with the fewest live bytes, -1 if there is none
+        int victim() const {
+            int v = -1;
+            for(uint32_t i = 0; i < segs.size(); i++) {
+                if(i == head || segs[i].data == NULL) continue;
+                if(v < 0 || segs[i].live < segs[v].live) v = i;
+            }
+            return v;
+        }
+
+        void release(uint32_t id) {
+            total_live -= segs[id].live;
+            free(segs[id].data);
+            segs[id] = {NULL, 0, 0};
+            free_ids.push_back(id);
+        }
+
+        // bytes of the segments in use
+        uint64_t bytes() const {
+            return (segs.size() - free_ids.size()) * SEGMENT;
+        }
+
+        // bytes of the live records
+        uint64_t live() const {
+            return total_live;
+        }
+};
+
+/*
+    A tree of offsets and the log of the values. Tree maps _key_t to
+    _value_t and must find, insert over a key, update and remove exactly,
+    as every engine of tree_api does: btree::csb by default.
+*/
+template <typename Tree = btree::csb>
+class store_t {
+    public:
+        static constexpr double MAX_DEAD = 0.5; // of the log bytes
+        static constexpr int MOVES = 8;         // records of the victim moved by a write
+
+    private:
+        Tree index;
+        value_log log;
+        int victim;      // the segment being compacted, -1 if none
+        uint64_t cursor; // its next record
+
+        // one step of the compaction, after a write
+        void compact_step() {
+            if(victim < 0) {
+                if(log.bytes() - log.live() <= MAX_DEAD * log.bytes()) return;
+                victim = log.victim();
+                if(victim < 0) return;
+                cursor = (uint64_t)victim * value_log::SEGMENT;
+            }
+
+            uint64_t end = log.end(victim);
+            for(int i = 0; i < MOVES && cursor < end; i++) {
+                const rec_t * r = log.rec(cursor);
+                _value_t cur;
+                if(index.find(r->key, cur) && (uint64_t)cur == cursor) {
+                    uint64_t off = log.append(r->key, string_view(r->data(), r->len)); // never into the victim
+                    log.kill(cursor);
+                    index.update(r->key, (_value_t)off);
+                }
+                cursor = log.next(cursor);
+            }
+            if(cursor == end) {
+                log.release(victim);
+                victim = -1;
+            }
+        }
+
+    public:
+        store_t() : victim(-1), cursor(0) {}
+
+        // val views the value in the log until the next write
+        bool find(_key_t key, string_view & val) {
+            _value_t off;
+            if(!index.find(key, off)) return false;
+            val = log.at(off);
+            return true;
+        }
+
+        // insert key or replace its value
+        void insert(_key_t key, string_view val) {
+            _value_t old;
+            bool found = index.find(key, old);
+            uint64_t off = log.append(key, val);
+            if(found) {
+                log.kill(old);
+                index.update(key, (_value_t)off);
+            } else {
+                index.insert(key, (_value_t)off);
+            }
+            compact_step();
+        }
+
+        bool update(_key_t key, string_view val) {
+            _value_t old;
+            if(!index.find(key, old)) return false;
+            log.kill(old);
+            index.update(key, (_value_t)log.append(key, val));
+            compact_step();
+            return true;
+        }
+
+        bool remove(_key_t key) {
+            _value_t old;
+            if(!index.find(key, old)) return false;
+            log.kill(old);
+            index.remove(key);
+            compact_step();
+            return true;
+        }
+
+        // the values of the keys not less than start in key order, num at most
+        int scan(_key_t start_key, int num, string_view * vals) {
+            std::vector<_value_t> offs(num);
+            int n = index.scan(start_key, num, offs.data());
+            for(int i = 0; i < n; i++) vals[i] = log.at(offs[i]);
+            return n;
+        }
+
+        // bytes of the log segments and of the live values in them
+        uint64_t log_bytes() const {
+            return log.bytes();
+        }
+
+        uint64_t live_bytes() const {
+            return log.live();
+        }
+
+        void printAll() {
+            index.printAll();
+        }
+};
+
+/*
+    The store behind the engine interface, for the drivers: a value becomes
+    a payload of 100-500 bytes (the length depends on the key) that starts
+    with the 8 bytes of the value, a find reads them back.
+*/
+template <typename Tree = btree::csb>
+class as_map : public tree_base<as_map<Tree>, _key_t, _value_t> {
+    private:
+        static constexpr int MAX_PAYLOAD = 500;
+
+        store_t<Tree> s;
+        char buf[MAX_PAYLOAD];
+
+        string_view payload(_key_t key, _value_t value) {
+            memcpy(buf, &value, sizeof(value));
+            return string_view(buf, 100 + (uint64_t)key * 0x9e3779b97f4a7c15ULL % 401);
+        }
+
+    public:
+        as_map() {
+            memset(buf, 'v', sizeof(buf));
+        }
+
+        bool find(_key_t key, _value_t & value) {
+            string_view v;
+            if(!s.find(key, v)) return false;
+            memcpy(&value, v.data(), sizeof(value));
+            return true;
+        }
+
+        void insert(_key_t key, _value_t value) {
+            s.insert(key, payload(key, value));
+        }
+
+        bool update(_key_t key, _value_t value) {
+            return s.update(key, payload(key, value));
+        }
+
+        bool remove(_key_t key) {
+            return s.remove(key);
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            std::vector<string_view> views(num);
+            int n = s.scan(start_key, num, views.data());
+            for(int i = 0; i < n; i++) memcpy(&vals[i], views[i].data(), sizeof(_value_t));
+            return n;
+        }
+
+        void printAll() {
+            s.printAll();
+        }
+};
+
+typedef store_t<> store;
+
+}; // namespace vlog
+
+#endif //__VALUE_LOG__
@@ -0,0 +1,642 @@
+/*  wal.h - write-ahead log with group commit and checkpoints for the in-memory trees
+    Copyright(c) 2020 Luo Yongping. All rights reserved.
+*/
+#ifndef __WAL__
+#define __WAL__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "base.h"
+#include "btree.h"
+
+/*
+    durable<Tree> wraps btree::btree or btree_unsort::btree:
+        - every modification is applied to the tree and appended to the log
+          under one lock, so the log order is the apply order
+        - the log is written with group commit: the first waiter writes and
+          fdatasyncs everything appended so far, the others wait for it
+        - a checkpoint streams the tree in key order into <path>.ckpt.<gen> and
+          empties <path>.log
+        - an incremental checkpoint (trees with for_each_dirty, i.e. btree::btree)
+          only writes the leaves modified since the previous checkpoint, with the
+          key range each of them covers, into <path>.delta.<gen>
+        - <path>.manifest names the base checkpoint and the deltas on top of it,
+          it is replaced atomically after the new file is durable
+        - on startup the base, the deltas (each one replaces the key ranges it
+          covers) and the valid prefix of the log are merged into one sorted
+          run that is handed to Tree::bulk_load
+*/
+namespace wal {
+using std::string;
+
+enum op_type : uint8_t { OP_INSERT = 1, OP_UPDATE = 2, OP_REMOVE = 3 };
+
+struct log_rec {
+    uint32_t crc; // over the rest of the record
+    uint8_t op;
+    uint8_t pad[3];
+    _key_t key;
+    _value_t val;
+};
+
+static uint32_t crc32(const void * data, size_t len, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool inited = [] {
+        for(uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for(int j = 0; j < 8; j++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)inited;
+
+    const uint8_t * p = (const uint8_t *)data;
+    crc = ~crc;
+    for(size_t i = 0; i < len; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static inline uint32_t rec_crc(const log_rec & r) {
+    return crc32((const char *)&r + sizeof(uint32_t), sizeof(log_rec) - sizeof(uint32_t));
+}
+
+static void write_all(int fd, const void * data, size_t len) {
+    const char * p = (const char *)data;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            perror("wal: write");
+            exit(-1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+class log_writer {
+    private:
+        int fd;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<log_rec> buf; // appended, not written yet
+        uint64_t next_lsn;        // lsn of the last appended record
+        uint64_t durable_lsn;
+        bool flushing;
+        uint64_t syncs;
+
+    public:
+        log_writer(const string & path) : next_lsn(0), durable_lsn(0), flushing(false), syncs(0) {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+            if(fd < 0) {
+                perror("wal: open");
+                exit(-1);
+            }
+            lseek(fd, 0, SEEK_END);
+        }
+
+        ~log_writer() {
+            commit(last_lsn());
+            close(fd);
+        }
+
+        uint64_t append(uint8_t op, _key_t k, _value_t v) {
+            log_rec r;
+            r.op = op;
+            r.pad[0] = r.pad[1] = r.pad[2] = 0;
+            r.key = k;
+            r.val = v;
+            r.crc = rec_crc(r);
+
+            std::lock_guard<std::mutex> lk(mtx);
+            buf.push_back(r);
+            return ++next_lsn;
+        }
+
+        void commit(uint64_t lsn) { // return when lsn is durable
+            std::unique_lock<std::mutex> lk(mtx);
+            while(durable_lsn < lsn) {
+                if(flushing) { // another thread is the leader of this group
+                    cv.wait(lk);
+                    continue;
+                }
+                flushing = true;
+                std::vector<log_rec> batch;
+                batch.swap(buf);
+                uint64_t upto = next_lsn;
+                lk.unlock();
+
+                write_all(fd, batch.data(), batch.size() * sizeof(log_rec));
+                fdatasync(fd);
+
+                lk.lock();
+                durable_lsn = upto;
+                flushing = false;
+                syncs += 1;
+                cv.notify_all();
+            }
+        }
+
+        void reset() { // drop the log content, everything appended so far is in a checkpoint
+            std::unique_lock<std::mutex> lk(mtx);
+            while(flushing) cv.wait(lk);
+
+            buf.clear();
+            if(ftruncate(fd, 0) != 0) {
+                perror("wal: ftruncate");
+                exit(-1);
+            }
+            lseek(fd, 0, SEEK_SET);
+            fdatasync(fd);
+            durable_lsn = next_lsn;
+            cv.notify_all();
+        }
+
+        uint64_t last_lsn() {
+            std::lock_guard<std::mutex> lk(mtx);
+            return next_lsn;
+        }
+
+        uint64_t sync_count() {
+            std::lock_guard<std::mutex> lk(mtx);
+            return syncs;
+        }
+};
+
+// read the valid prefix of a log, truncate the torn tail and apply it to the overlay
+// (key -> {present, value}); return the number of valid records
+static uint64_t replay_log(const string & path, std::map<_key_t, std::pair<bool, _value_t>> & overlay) {
+    int fd = open(path.c_str(), O_RDWR);
+    if(fd < 0) return 0;
+
+    const size_t BATCH = 4096;
+    std::vector<log_rec> recs(BATCH);
+    uint64_t valid = 0;
+    bool torn = false;
+    while(!torn) {
+        ssize_t n = read(fd, recs.data(), BATCH * sizeof(log_rec));
+        if(n <= 0) break;
+
+        size_t cnt = n / sizeof(log_rec);
+        if(cnt * sizeof(log_rec) != (size_t)n) torn = true;
+        for(size_t i = 0; i < cnt; i++) {
+            const log_rec & r = recs[i];
+            if(rec_crc(r) != r.crc) {
+                torn = true;
+                break;
+            }
+            if(r.op == OP_REMOVE) {
+                overlay[r.key] = {false, 0};
+            } else {
+                overlay[r.key] = {true, r.val};
+            }
+            valid += 1;
+        }
+    }
+
+    if(ftruncate(fd, valid * sizeof(log_rec)) != 0) {
+        perror("wal: ftruncate");
+        exit(-1);
+    }
+    close(fd);
+    return valid;
+}
+
+static const uint64_t CKPT_MAGIC = 0x434b505442545245; // "ERTBTPKC"
+
+// streaming serializer, the records are buffered by stdio and never materialized
+class checkpoint_writer {
+    private:
+        FILE * f;
+        uint64_t count;
+        uint32_t crc;
+
+    public:
+        checkpoint_writer(const string & path) : count(0), crc(0) {
+            f = fopen(path.c_str(), "wb");
+            if(f == NULL) {
+                perror("wal: fopen");
+                exit(-1);
+            }
+            setvbuf(f, NULL, _IOFBF, 1 << 20);
+            fwrite(&CKPT_MAGIC, sizeof(uint64_t), 1, f);
+        }
+
+        void add(_key_t k, _value_t v) {
+            std::pair<_key_t, _value_t> kv(k, v);
+            fwrite(&kv, sizeof(kv), 1, f);
+            crc = crc32(&kv, sizeof(kv), crc);
+            count += 1;
+        }
+
+        void finish() { // trailer, then make the file durable
+            uint64_t trailer[2] = {count, crc};
+            fwrite(trailer, sizeof(trailer), 1, f);
+            fflush(f);
+            fsync(fileno(f));
+            fclose(f);
+        }
+};
+
+// load a checkpoint in key order, false if it does not exist or is damaged
+static bool read_checkpoint(const string & path, std::vector<std::pair<_key_t, _value_t>> & kvs) {
+    FILE * f = fopen(path.c_str(), "rb");
+    if(f == NULL) return false;
+
+    struct stat st;
+    fstat(fileno(f), &st);
+    uint64_t magic = 0, trailer[2];
+    size_t body = st.st_size - sizeof(uint64_t) - sizeof(trailer);
+    bool ok = st.st_size >= (off_t)(sizeof(uint64_t) + sizeof(trailer))
+              && fread(&magic, sizeof(uint64_t), 1, f) == 1 && magic == CKPT_MAGIC
+              && body % sizeof(std::pair<_key_t, _value_t>) == 0;
+    if(ok) {
+        kvs.resize(body / sizeof(std::pair<_key_t, _value_t>));
+        ok = fread(kvs.data(), sizeof(std::pair<_key_t, _value_t>), kvs.size(), f) == kvs.size()
+             && fread(trailer, sizeof(trailer), 1, f) == 1
+             && trailer[0] == kvs.size() && trailer[1] == crc32(kvs.data(), body);
+    }
+    fclose(f);
+    if(!ok) kvs.clear();
+    return ok;
+}
+
+static const uint64_t DELTA_MAGIC = 0x41544c4445455254; // "TREEDLTA"
+
+struct delta_leaf {
+    _key_t low;
+    _key_t high;
+    uint64_t open_high; // the leaf covers [low, +inf)
+    uint64_t count;     // followed by count key-value pairs
+};
+
+// the leaves of an incremental checkpoint, they must be added in key order
+class delta_writer {
+    private:
+        FILE * f;
+        uint64_t leaves;
+        uint32_t crc;
+
+        void put(const void * data, size_t len) {
+            fwrite(data, len, 1, f);
+            crc = crc32(data, len, crc);
+        }
+
+    public:
+        delta_writer(const string & path) : leaves(0), crc(0) {
+            f = fopen(path.c_str(), "wb");
+            if(f == NULL) {
+                perror("wal: fopen");
+                exit(-1);
+            }
+            setvbuf(f, NULL, _IOFBF, 1 << 20);
+            fwrite(&DELTA_MAGIC, sizeof(uint64_t), 1, f);
+        }
+
+        template <typename Record>
+        void add_leaf(_key_t low, _key_t high, bool open_high, const Record * recs, uint64_t count) {
+            delta_leaf l = {low, high, open_high, count};
+            put(&l, sizeof(l));
+            for(uint64_t i = 0; i < count; i++) {
+                std::pair<_key_t, _value_t> kv(recs[i].key, (_value_t)recs[i].val);
+                put(&kv, sizeof(kv));
+            }
+            leaves += 1;
+        }
+
+        void finish() {
+            uint64_t trailer[2] = {leaves, crc};
+            fwrite(trailer, sizeof(trailer), 1, f);
+            fflush(f);
+            fsync(fileno(f));
+            fclose(f);
+        }
+};
+
+// replace the key ranges covered by the leaves of a delta in the sorted run kvs,
+// false (and kvs untouched) if the delta is damaged
+static bool merge_delta(const string & path, std::vector<std::pair<_key_t, _value_t>> & kvs) {
+    FILE * f = fopen(path.c_str(), "rb");
+    if(f == NULL) return false;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    struct stat st;
+    fstat(fileno(f), &st);
+    uint64_t magic = 0, trailer[2], leaves = 0;
+    uint32_t crc = 0;
+    off_t body_end = st.st_size - sizeof(trailer);
+    bool ok = body_end >= (off_t)sizeof(uint64_t) && fread(&magic, sizeof(uint64_t), 1, f) == 1 && magic == DELTA_MAGIC;
+
+    std::vector<std::pair<_key_t, _value_t>> out;
+    out.reserve(kvs.size());
+    size_t i = 0;
+    while(ok && ftello(f) < body_end) {
+        delta_leaf l;
+        if(fread(&l, sizeof(l), 1, f) != 1) { ok = false; break; }
+        crc = crc32(&l, sizeof(l), crc);
+
+        for(; i < kvs.size() && kvs[i].first < l.low; i++) out.push_back(kvs[i]);
+        for(; i < kvs.size() && (l.open_high || kvs[i].first < l.high); i++); // dropped, the leaf replaces them
+
+        for(uint64_t j = 0; j < l.count; j++) {
+            std::pair<_key_t, _value_t> kv;
+            if(fread(&kv, sizeof(kv), 1, f) != 1) { ok = false; break; }
+            crc = crc32(&kv, sizeof(kv), crc);
+            out.push_back(kv);
+        }
+        leaves += 1;
+    }
+    ok = ok && fread(trailer, sizeof(trailer), 1, f) == 1 && trailer[0] == leaves && trailer[1] == crc;
+    fclose(f);
+
+    if(ok) {
+        for(; i < kvs.size(); i++) out.push_back(kvs[i]);
+        kvs.swap(out);
+    }
+    return ok;
+}
+
+// trees that stamp their nodes with btree::current_epoch() and can list the dirty leaves
+struct dirty_probe {
+    template <typename... Args>
+    void operator()(Args...) const {}
+};
+
+template <typename T, typename = void>
+struct has_dirty_tracking : std::false_type {};
+
+template <typename T>
+struct has_dirty_tracking<T, decltype(std::declval<T &>().for_each_dirty(0, dirty_probe()), void())> : std::true_type {};
+
+template <typename Tree>
+class durable : tree_api {
+    private:
+        Tree tree;
+        std::mutex tree_mtx;
+        string path, log_path, manifest_path;
+        log_writer * log;
+        bool sync_commit;       // every operation waits for its record to be durable
+        uint64_t ckpt_every;    // operations between two checkpoints, 0 disables them
+        uint64_t since_ckpt;
+        bool incremental;       // periodic checkpoints only write the dirty leaves
+        std::thread flusher;
+        std::atomic<bool> stop;
+
+        // the current manifest
+        uint64_t gen;
+        string base_file;
+        std::vector<string> delta_files;
+        uint64_t last_ckpt;     // epoch of the last checkpoint, 0 means the next one must be full
+
+        static const size_t MAX_DELTAS = 16; // then the deltas are folded into a new base
+
+        void read_manifest() {
+            gen = 0;
+            FILE * f = fopen(manifest_path.c_str(), "r");
+            if(f == NULL) return;
+
+            char kind[16], name[4096];
+            while(fscanf(f, "%15s %4095s", kind, name) == 2) {
+                if(strcmp(kind, "gen") == 0) gen = strtoull(name, NULL, 10);
+                else if(strcmp(kind, "base") == 0) base_file = name;
+                else if(strcmp(kind, "delta") == 0) delta_files.push_back(name);
+            }
+            fclose(f);
+        }
+
+        void write_manifest(const string & new_base, const std::vector<string> & new_deltas) {
+            string tmp = manifest_path + ".tmp";
+            FILE * f = fopen(tmp.c_str(), "w");
+            if(f == NULL) {
+                perror("wal: fopen");
+                exit(-1);
+            }
+            fprintf(f, "gen %lu\n", gen);
+            if(!new_base.empty()) fprintf(f, "base %s\n", new_base.c_str());
+            for(const string & d : new_deltas) fprintf(f, "delta %s\n", d.c_str());
+            fflush(f);
+            fsync(fileno(f));
+            fclose(f);
+            if(rename(tmp.c_str(), manifest_path.c_str()) != 0) {
+                perror("wal: rename");
+                exit(-1);
+            }
+
+            // the files that are not referenced anymore
+            if(base_file != new_base) ::remove(base_file.c_str());
+            for(const string & d : delta_files) {
+                if(std::find(new_deltas.begin(), new_deltas.end(), d) == new_deltas.end()) ::remove(d.c_str());
+            }
+            base_file = new_base;
+            delta_files = new_deltas;
+        }
+
+        void recover() {
+            read_manifest();
+
+            std::vector<std::pair<_key_t, _value_t>> base;
+            if(!base_file.empty()) read_checkpoint(base_file, base);
+            for(const string & d : delta_files) {
+                if(!merge_delta(d, base)) fprintf(stderr, "wal: damaged delta %s is skipped\n", d.c_str());
+            }
+
+            std::map<_key_t, std::pair<bool, _value_t>> overlay;
+            replay_log(log_path, overlay);
+
+            // merge the two sorted runs, the log wins
+            std::vector<std::pair<_key_t, _value_t>> merged;
+            merged.reserve(base.size() + overlay.size());
+            auto it = overlay.begin();
+            for(const auto & kv : base) {
+                for(; it != overlay.end() && it->first < kv.first; ++it) {
+                    if(it->second.first) merged.push_back({it->first, it->second.second});
+                }
+                if(it != overlay.end() && it->first == kv.first) {
+                    if(it->second.first) merged.push_back({it->first, it->second.second});
+                    ++it;
+                } else {
+                    merged.push_back(kv);
+                }
+            }
+            for(; it != overlay.end(); ++it) {
+                if(it->second.first) merged.push_back({it->first, it->second.second});
+            }
+
+            tree.bulk_load(merged.data(), merged.size());
+            last_ckpt = 0; // the log part of the content is in no checkpoint file yet
+        }
+
+        void checkpoint_locked() {
+            gen += 1;
+            string file = path + ".ckpt." + std::to_string(gen);
+            checkpoint_writer w(file);
+            tree.for_each([&](_key_t k, _value_t v) { w.add(k, v); });
+            w.finish();
+            if constexpr (has_dirty_tracking<Tree>::value) {
+                last_ckpt = btree::advance_epoch();
+            }
+
+            write_manifest(file, std::vector<string>());
+            log->reset();
+            since_ckpt = 0;
+        }
+
+        void incremental_locked() {
+            if constexpr (has_dirty_tracking<Tree>::value) {
+                if(last_ckpt != 0 && delta_files.size() < MAX_DELTAS) {
+                    gen += 1;
+                    string file = path + ".delta." + std::to_string(gen);
+                    delta_writer w(file);
+                    tree.for_each_dirty(last_ckpt, [&](_key_t low, _key_t high, bool open_high, auto recs, uint64_t count) {
+                        w.add_leaf(low, high, open_high, recs, count);
+                    });
+                    w.finish();
+                    last_ckpt = btree::advance_epoch();
+
+                    std::vector<string> deltas = delta_files;
+                    deltas.push_back(file);
+                    write_manifest(base_file, deltas);
+                    log->reset();
+                    since_ckpt = 0;
+                    return;
+                }
+            }
+            checkpoint_locked();
+        }
+
+        // called with tree_mtx held, after the operation is applied
+        uint64_t log_op(uint8_t op, _key_t k, _value_t v) {
+            uint64_t lsn = log->append(op, k, v);
+            if(ckpt_every > 0 && ++since_ckpt >= ckpt_every) {
+                if(incremental) incremental_locked();
+                else checkpoint_locked();
+            }
+            return lsn;
+        }
+
+        void wait_durable(uint64_t lsn) {
+            if(sync_commit) log->commit(lsn);
+        }
+
+    public:
+        // without sync_commit a background thread commits a group every flush_us microseconds
+        durable(const string & file_prefix, bool sync = true, uint64_t checkpoint_every = 0,
+                bool incremental_ckpt = true, int flush_us = 1000)
+            : path(file_prefix), log_path(file_prefix + ".log"), manifest_path(file_prefix + ".manifest"),
+              sync_commit(sync), ckpt_every(checkpoint_every), since_ckpt(0), incremental(incremental_ckpt),
+              stop(false), gen(0), last_ckpt(0) {
+            recover();
+            log = new log_writer(log_path);
+
+            if(!sync_commit) {
+                flusher = std::thread([this, flush_us] {
+                    while(!stop.load()) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(flush_us));
+                        log->commit(log->last_lsn());
+                    }
+                });
+            }
+        }
+
+        ~durable() {
+            if(flusher.joinable()) {
+                stop.store(true);
+                flusher.join();
+            }
+            delete log;
+        }
+
+        bool find(_key_t key, _value_t & value) {
+            std::lock_guard<std::mutex> lk(tree_mtx);
+            return tree.find(key, value);
+        }
+
+        void insert(_key_t key, _value_t value) {
+            uint64_t lsn;
+            {
+                std::lock_guard<std::mutex> lk(tree_mtx);
+                tree.insert(key, value);
+                lsn = log_op(OP_INSERT, key, value);
+            }
+            wait_durable(lsn);
+        }
+
+        bool update(_key_t key, _value_t value) {
+            uint64_t lsn;
+            {
+                std::lock_guard<std::mutex> lk(tree_mtx);
+                if(!tree.update(key, value)) return false;
+                lsn = log_op(OP_UPDATE, key, value);
+            }
+            wait_durable(lsn);
+            return true;
+        }
+
+        bool remove(_key_t key) {
+            uint64_t lsn;
+            bool ret;
+            {
+                std::lock_guard<std::mutex> lk(tree_mtx);
+                ret = tree.remove(key);
+                if(!ret) return false; // nothing to log
+                lsn = log_op(OP_REMOVE, key, 0);
+            }
+            wait_durable(lsn);
+            return ret;
+        }
+
+        int scan(_key_t start_key, int num, _value_t * vals) {
+            std::lock_guard<std::mutex> lk(tree_mtx);
+            return tree.scan(start_key, num, vals);
+        }
+
+        void printAll() {
+            std::lock_guard<std::mutex> lk(tree_mtx);
+            tree.printAll();
+        }
+
+        void checkpoint() {
+            std::lock_guard<std::mutex> lk(tree_mtx);
+            checkpoint_locked();
+        }
+
+        // only the leaves changed since the last checkpoint, falls back to a full one if
+        // the tree has no dirty tracking, there is no base yet or too many deltas pile up
+        void checkpoint_incremental() {
+            std::lock_guard<std::mutex> lk(tree_mtx);
+            incremental_locked();
+        }
+
+        // make everything appended so far durable
+        void sync() {
+            log->commit(log->last_lsn());
+        }
+
+        uint64_t sync_count() {
+            return log->sync_count();
+        }
+};
+
+}; // namespace wal
+
+#endif //__WAL__